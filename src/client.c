@@ -0,0 +1,415 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "testgear/client.h"
+#include "testgear/event.h"
+#include "testgear/debug.h"
+#include "testgear/log.h"
+#include "testgear/options.h"
+#include "testgear/message.h"
+
+static void client_deferred_flush(void *data)
+{
+    struct client_t *client = data;
+    bool congested;
+
+    if (client->connected)
+    {
+        congested = client_congested(client);
+        client_flush(client);
+
+        // Resume handling of requests held back while congested
+        if (client->connected && congested && !client_congested(client))
+            handle_outgoing_messages(client);
+    }
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * client_idle_timeout() - Closes connection if nothing has been received
+ *
+ * The timer is not restarted for each received message. Instead, when it
+ * expires, it is restarted for the time remaining since the last receive.
+ */
+
+static void client_idle_timeout(void *data)
+{
+    struct client_t *client = data;
+    uint64_t timeout = (uint64_t) option.idle_timeout * 1000;
+    uint64_t idle;
+
+    if (!client->connected)
+        return;
+
+    idle = event_now(client->loop) - client->rx_time;
+    if (idle < timeout)
+    {
+        event_timer_start(client->loop, &client->idle_timer, timeout - idle);
+        return;
+    }
+
+    log_info("Closing idle client connection (%s)", client->address);
+    client->io->close(client);
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * client_heartbeat() - Sends PING to client
+ *
+ * The client answers with a PONG, which gives the round trip time. A client
+ * which has not answered the last CLIENT_HEARTBEATS_MISSED_MAX PINGs, nor
+ * sent anything else, is considered dead and disconnected.
+ */
+
+static void client_heartbeat(void *data)
+{
+    struct client_t *client = data;
+
+    if (!client->connected)
+        return;
+
+    if (client->ping_outstanding)
+    {
+        if (event_now(client->loop) - client->rx_time < (uint64_t) option.heartbeat * 1000)
+            client->heartbeats_missed = 0;
+        else if (++client->heartbeats_missed >= CLIENT_HEARTBEATS_MISSED_MAX)
+        {
+            log_info("Client (%s) not responding, closing connection", client->address);
+            client->io->close(client);
+            if (!client->connected)
+                client_destroy(client);
+            return;
+        }
+    }
+
+    send_ping(client);
+
+    event_timer_start(client->loop, &client->heartbeat_timer, option.heartbeat * 1000);
+}
+
+struct client_t * client_create(struct event_loop_t *loop,
+                                int fd,
+                                struct message_io_t *io,
+                                event_callback_t callback)
+{
+    struct client_t *client;
+
+    client = calloc(1, sizeof(struct client_t));
+    if (client == NULL)
+    {
+        log_error("malloc() failed");
+        return NULL;
+    }
+
+    client->fd = fd;
+    client->connected = true;
+    client->loop = loop;
+    client->io = io;
+    client->tx_events = EPOLLOUT;
+    client->tx_flush.callback = &client_deferred_flush;
+    client->tx_flush.data = client;
+    client->idle_timer.callback = &client_idle_timeout;
+    client->idle_timer.data = client;
+    client->heartbeat_timer.callback = &client_heartbeat;
+    client->heartbeat_timer.data = client;
+    client->rx_time = event_now(loop);
+
+    // Allocate receive buffer
+    if (ring_init(&client->rx, CLIENT_RX_SIZE))
+    {
+        log_error("malloc() failed");
+        free(client);
+        return NULL;
+    }
+
+    // Register client connection in event loop (unless transport does I/O
+    // through io_uring)
+    client->handler.fd = fd;
+    client->handler.callback = callback;
+    client->handler.data = client;
+    client->events = EPOLLIN;
+    if ((callback != NULL) && event_add(loop, &client->handler, client->events))
+    {
+        ring_destroy(&client->rx);
+        free(client);
+        return NULL;
+    }
+
+    if (option.idle_timeout > 0)
+        event_timer_start(loop, &client->idle_timer, option.idle_timeout * 1000);
+    if (option.heartbeat > 0)
+        event_timer_start(loop, &client->heartbeat_timer, option.heartbeat * 1000);
+
+    return client;
+}
+
+/*
+ * client_consume() - Releases messages which have been sent
+ */
+
+static void client_consume(struct client_t *client, unsigned long length)
+{
+    struct client_message_t *message;
+
+    client->tx_length -= length;
+    length += client->tx_offset;
+
+    while (((message = client->tx_first) != NULL) && (length >= message->length))
+    {
+        length -= message->length;
+        client->tx_first = message->next;
+        message->release(client, message->data);
+    }
+
+    if (client->tx_first == NULL)
+        client->tx_last = NULL;
+
+    client->tx_offset = length;
+}
+
+/*
+ * client_sent() - Reports completion of a write issued asynchronously
+ *
+ * For transports which complete writes later (io_uring), where writev
+ * only queues the data.
+ */
+
+void client_sent(struct client_t *client, unsigned long length)
+{
+    client_consume(client, length);
+}
+
+void client_destroy(struct client_t *client)
+{
+    // Stop sampling for the client
+    cancel_subscriptions(client);
+
+    event_timer_stop(client->loop, &client->idle_timer);
+    event_timer_stop(client->loop, &client->heartbeat_timer);
+
+    // Wait for requests and samples still being executed
+    if (client->pending > 0)
+        return;
+
+    debug_printf("Destroying client connection (fd = %d)\n", client->fd);
+    if (client->rtt > 0)
+        log_info("Client (%s) disconnected, round trip time %u us", client->address, client->rtt);
+    event_defer_cancel(client->loop, &client->tx_flush);
+    client_consume(client, client->tx_length);
+    free_request_pool(client);
+    ring_destroy(&client->rx);
+    free(client->frame);
+    free(client);
+}
+
+/*
+ * client_frame_reserve() - Makes sure frame buffer can hold size bytes
+ *
+ * The frame buffer is used to linearize messages which wrap around the end
+ * of the receive ring buffer.
+ */
+
+int client_frame_reserve(struct client_t *client, unsigned int size)
+{
+    char *frame;
+
+    if (size <= client->frame_size)
+        return 0;
+
+    frame = realloc(client->frame, size);
+    if (frame == NULL)
+    {
+        log_error("malloc() failed");
+        return -1;
+    }
+
+    client->frame = frame;
+    client->frame_size = size;
+
+    return 0;
+}
+
+/*
+ * client_send() - Queues message for transmission to client
+ *
+ * Messages are sent from the buffers of the sender, so nothing is copied.
+ */
+
+void client_send(struct client_t *client, struct client_message_t *message)
+{
+    unsigned int i;
+
+    message->length = 0;
+    for (i=0; i<message->iov_count; i++)
+        message->length += message->iov[i].iov_len;
+    message->next = NULL;
+
+    if (client->tx_last != NULL)
+        client->tx_last->next = message;
+    else
+        client->tx_first = message;
+    client->tx_last = message;
+    client->tx_length += message->length;
+}
+
+/*
+ * client_schedule_flush() - Sends queued messages once events are handled
+ *
+ * Responses which become ready in the same event loop iteration are thereby
+ * sent together.
+ */
+
+void client_schedule_flush(struct client_t *client)
+{
+    event_defer(client->loop, &client->tx_flush);
+}
+
+/*
+ * client_received() - Notes that data has been received from client
+ */
+
+void client_received(struct client_t *client)
+{
+    client->rx_time = event_now(client->loop);
+}
+
+/*
+ * client_rtt_sample() - Handles PONG answering outstanding PING
+ *
+ * The round trip time is smoothed like TCP does (RFC 6298).
+ */
+
+void client_rtt_sample(struct client_t *client, unsigned int rtt)
+{
+    client->ping_outstanding = false;
+    client->heartbeats_missed = 0;
+
+    if (client->rtt == 0)
+        client->rtt = rtt;
+    else
+        client->rtt = (7 * (uint64_t) client->rtt + rtt) / 8;
+
+    debug_printf("Client (%s) round trip time %u us (smoothed %u us)\n", client->address, rtt, client->rtt);
+}
+
+bool client_congested(struct client_t *client)
+{
+    return (client->tx_length >= CLIENT_TX_HIGH) ||
+           (client->pending >= CLIENT_PENDING_MAX);
+}
+
+/*
+ * client_update_events() - Updates events the client is waiting for
+ *
+ * Wait for writability while data is queued and stop reading while the
+ * client is congested.
+ */
+
+static void client_update_events(struct client_t *client)
+{
+    unsigned int events = 0;
+
+    if (!client_congested(client))
+        events |= EPOLLIN;
+    if (client->tx_length > 0)
+        events |= client->tx_events;
+
+    if (events != client->events)
+    {
+        client->events = events;
+        if (client->io->events != NULL)
+            client->io->events(client, events);
+        else
+            event_modify(client->loop, &client->handler, events);
+    }
+}
+
+/*
+ * client_flush() - Sends as much queued data as the connection accepts
+ *
+ * Queued messages are gathered into one write of up to CLIENT_IOV_MAX
+ * buffers.
+ */
+
+int client_flush(struct client_t *client)
+{
+    struct iovec iov[CLIENT_IOV_MAX];
+    struct client_message_t *message;
+    unsigned int offset, count, i;
+    int size;
+
+    while (client->tx_length > 0)
+    {
+        // Skip part of first message already sent
+        offset = client->tx_offset;
+        count = 0;
+
+        for (message = client->tx_first; (message != NULL) && (count < CLIENT_IOV_MAX); message = message->next)
+        {
+            for (i=0; (i<message->iov_count) && (count < CLIENT_IOV_MAX); i++)
+            {
+                if (offset >= message->iov[i].iov_len)
+                {
+                    offset -= message->iov[i].iov_len;
+                    continue;
+                }
+                iov[count].iov_base = (char *) message->iov[i].iov_base + offset;
+                iov[count].iov_len = message->iov[i].iov_len - offset;
+                offset = 0;
+                count++;
+            }
+        }
+
+        size = client->io->writev(client, iov, count);
+        if (size < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if (errno == EINTR)
+                continue;
+            debug_printf("Write to client failed (%s)\n", strerror(errno));
+            client->io->close(client);
+            return -1;
+        }
+        client_consume(client, size);
+    }
+
+    client_update_events(client);
+
+    return 0;
+}
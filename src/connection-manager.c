@@ -28,41 +28,212 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <sched.h>
+#include <pthread.h>
 #include "testgear/connection-manager.h"
+#include "testgear/event.h"
 #include "testgear/tcp.h"
+#include "testgear/unix.h"
+#include "testgear/shm.h"
+#include "testgear/serial.h"
 #include "testgear/options.h"
 #include "testgear/message.h"
+#include "testgear/plugin-manager.h"
+#include "testgear/log.h"
 
-void connection_manager_start(void)
+/* TCP shard, a listener with its own event loop and thread */
+struct shard_t
 {
+    int index;
     struct message_io_t io;
+};
+
+/*
+ * pin_thread() - Pins calling thread to the n'th CPU it may run on
+ */
+
+static void pin_thread(int n)
+{
+    cpu_set_t allowed, set;
+    int cpu, count;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return;
+
+    count = CPU_COUNT(&allowed);
+    if (count == 0)
+        return;
+    n %= count;
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && (n-- == 0))
+            break;
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+        log_error("Pinning thread to CPU %d failed", cpu);
+}
+
+static struct event_loop_t * create_loop(void)
+{
+    struct event_loop_t *loop;
+
+    loop = event_loop_create();
+
+    if ((option.event_backend == URING) && event_loop_use_uring(loop))
+        log_info("io_uring not available, using epoll");
+
+    return loop;
+}
+
+/*
+ * run_shard() - Serves TCP connections accepted by one shard
+ *
+ * Everything from the event loop up is set up by the thread running it,
+ * so io_uring is set up by the only thread submitting to it.
+ */
+
+static void * run_shard(void *data)
+{
+    struct shard_t *shard = data;
+    struct event_loop_t *loop;
+
+    if (option.affinity)
+        pin_thread(shard->index);
+
+    loop = create_loop();
+
+    if (loop->uring != NULL)
+    {
+        shard->io.writev = &tcp_uring_writev;
+        shard->io.close = &tcp_uring_close;
+        shard->io.events = &tcp_uring_events;
+    }
+    else
+    {
+        shard->io.writev = &tcp_writev;
+        shard->io.read = &tcp_read;
+        shard->io.close = &tcp_close;
+    }
+    tcp_server_start(loop, option.tcp_port, &shard->io, option.shards > 1);
+
+    if (shard->index == 0)
+        plugin_manager_watch(loop);
+
+    event_loop_run(loop);
+
+    return NULL;
+}
+
+/*
+ * start_shards() - Starts TCP shards
+ *
+ * Each shard listens on the TCP port through its own socket and serves
+ * the connections it accepts by its own event loop, so connections are
+ * served in parallel without a shared accept path. The calling thread runs
+ * the first shard.
+ */
+
+static void start_shards(void)
+{
+    struct shard_t *shards;
+    pthread_t thread;
+    int i;
+
+    shards = calloc(option.shards, sizeof(struct shard_t));
+    if (shards == NULL)
+    {
+        printf("Error: malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i=1; i<option.shards; i++)
+    {
+        shards[i].index = i;
+        if (pthread_create(&thread, NULL, &run_shard, &shards[i]) != 0)
+        {
+            perror("Error: pthread_create() call failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+
+    if (option.shards > 1)
+        log_info("Started %d TCP shards", option.shards);
+
+    run_shard(&shards[0]);
+}
+
+void connection_manager_start(void)
+{
+    static struct message_io_t io;
+    struct event_loop_t *loop;
 
     // Start listen on connection types:
     //
     // Network:
     //      TCP port 8000
+    // Local:
+    //      UNIX socket /tmp/testgeard.sock
+    //      Shared memory (set up through UNIX socket)
     // Serial device:
     //      /dev/USBtty0
 
+    // TCP connections are served by one or more shards
+    if (option.connection == TCP)
+    {
+        start_shards();
+        return;
+    }
+
+    // Create event loop serving all connections
+    loop = create_loop();
+
     switch (option.connection)
     {
-        case TCP:
-            io.write = &tcp_write;
-            io.read = &tcp_read;
-            io.close = &tcp_close;
-            message_register_io(&io);
-            tcp_server_start(option.tcp_port);
+        case UNIX:
+            io.writev = &unix_writev;
+            io.read = &unix_read;
+            io.close = &unix_close;
+            unix_server_start(loop, option.unix_socket, &io);
+            break;
+        case SHM:
+            io.writev = &shm_writev;
+            io.read = &shm_read;
+            io.close = &shm_close;
+            shm_server_start(loop, option.unix_socket, &io);
             break;
-        case USB:
         case SERIAL:
+            if (option.serial_device[0] == 0)
+            {
+                printf("Error: No serial device specified!\n");
+                exit(EXIT_FAILURE);
+            }
+            io.writev = &serial_writev;
+            io.read = &serial_read;
+            io.close = &serial_close;
+            serial_server_start(loop, option.serial_device, option.serial_baud, &io);
+            break;
+        case USB:
             break;
         default:
             printf("Error: Invalid connection type!");
             exit(EXIT_FAILURE);
             break;
     }
+
+    plugin_manager_watch(loop);
+
+    // Serve connections
+    event_loop_run(loop);
 }
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include "testgear/crc32c.h"
+
+/*
+ * CRC-32C (Castagnoli) as used by iSCSI and SCTP. Computed with the SSE4.2
+ * crc32 instruction where the processor supports it, otherwise with a
+ * table driven implementation.
+ */
+
+#define CRC32C_POLYNOMIAL 0x82f63b78 // Reversed
+
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *data, size_t length);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_update_table(uint32_t crc, const unsigned char *data, size_t length)
+{
+    while (length--)
+        crc = crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_update_sse42(uint32_t crc, const unsigned char *data, size_t length)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    while (length >= sizeof(uint64_t))
+    {
+        memcpy(&word, data, sizeof(uint64_t));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        data += sizeof(uint64_t);
+        length -= sizeof(uint64_t);
+    }
+    crc = (uint32_t) crc64;
+#endif
+
+    while (length--)
+        crc = __builtin_ia32_crc32qi(crc, *data++);
+
+    return crc;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    uint32_t crc;
+    int i, j;
+
+    for (i=0; i<256; i++)
+    {
+        crc = i;
+        for (j=0; j<8; j++)
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+
+    crc32c_update = &crc32c_update_table;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_update = &crc32c_update_sse42;
+#endif
+}
+
+/*
+ * crc32c() - Computes CRC-32C of data
+ *
+ * Start with crc 0. Pass the previous result to continue over more data.
+ */
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length)
+{
+    pthread_once(&crc32c_once, &crc32c_init);
+
+    return ~crc32c_update(~crc, data, length);
+}
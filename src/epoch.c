@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include "testgear/epoch.h"
+#include "testgear/log.h"
+
+/*
+ * === Epoch based reclamation ===
+ *
+ * Readers enter an epoch before they look up a shared object and exit it
+ * when they are done using it. A writer unpublishes the object, starts a
+ * new epoch and waits until every reader has either exited or entered the
+ * new epoch. Readers which may still see the object have then exited, so
+ * it can be freed.
+ *
+ * Each thread registers a reader record the first time it enters an
+ * epoch. Records are never freed, threads of the daemon live forever.
+ */
+
+struct epoch_reader_t
+{
+    uint64_t epoch;     // Epoch entered (0 if not in epoch)
+    unsigned int depth; // Nesting depth (only used by owning thread)
+    struct epoch_reader_t *next;
+};
+
+static uint64_t global_epoch = 1;
+static struct epoch_reader_t *readers = NULL;
+static __thread struct epoch_reader_t *reader = NULL;
+
+static void register_reader(void)
+{
+    reader = calloc(1, sizeof(struct epoch_reader_t));
+    if (reader == NULL)
+    {
+        log_error("malloc() failed");
+        exit(EXIT_FAILURE);
+    }
+
+    reader->next = __atomic_load_n(&readers, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&readers, &reader->next, reader, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * epoch_enter() - Enters epoch of calling thread
+ */
+
+void epoch_enter(void)
+{
+    if (reader == NULL)
+        register_reader();
+
+    if (reader->depth++ > 0)
+        return;
+
+    // Must be visible before any shared object is looked up
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/*
+ * epoch_exit() - Exits epoch of calling thread
+ */
+
+void epoch_exit(void)
+{
+    if (--reader->depth > 0)
+        return;
+
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * epoch_synchronize() - Waits for readers of previous epochs to exit
+ *
+ * Must not be called from within an epoch.
+ */
+
+void epoch_synchronize(void)
+{
+    struct epoch_reader_t *r;
+    uint64_t epoch, entered;
+
+    epoch = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+
+    for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+    {
+        // Readers may be in the middle of a long plugin call, do not spin
+        while (((entered = __atomic_load_n(&r->epoch, __ATOMIC_ACQUIRE)) != 0) &&
+               (entered < epoch))
+            usleep(100);
+    }
+}
@@ -0,0 +1,475 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include "testgear/event.h"
+#include "testgear/debug.h"
+#include "testgear/log.h"
+
+/*
+ * === Event loop ===
+ *
+ * Simple epoll based reactor. Each file descriptor is registered together
+ * with an event handler which is embedded in the object owning the
+ * descriptor (server socket, client connection, ...). When the descriptor
+ * becomes ready the handler callback is invoked with the ready events.
+ *
+ * Descriptors are registered level-triggered, so a handler which does not
+ * consume all available data will simply be called again.
+ *
+ * Other threads (eg. workers) hand results back to the loop by posting
+ * calls, which are then run by the thread running the loop.
+ *
+ * Work which should be done once per loop iteration, no matter how many
+ * events caused it (eg. sending queued responses), is deferred until all
+ * ready events have been dispatched.
+ *
+ * Timeouts (idle connections, heartbeats, request deadlines) are kept in a
+ * timer wheel with millisecond ticks. The loop waits no longer than until
+ * the next tick with timers and runs expired timers after dispatching
+ * events.
+ *
+ * With the io_uring backend the loop waits in io_uring_enter() instead,
+ * with the epoll descriptor itself polled through the ring. Transports may
+ * then submit their I/O to the ring, and everything queued while handling
+ * one batch of completions is submitted by the single system call waiting
+ * for the next batch.
+ */
+
+static void event_wakeup(int fd, unsigned int events, void *data)
+{
+    struct event_loop_t *loop = data;
+    struct event_call_t *call, *next;
+    uint64_t value;
+
+    if (read(fd, &value, sizeof(value)) < 0)
+        debug_printf("Wakeup read failed (%s)\n", strerror(errno));
+
+    // Take all posted calls
+    pthread_mutex_lock(&loop->calls_lock);
+    call = loop->calls_first;
+    loop->calls_first = NULL;
+    loop->calls_last = NULL;
+    loop->wakeup_pending = false;
+    pthread_mutex_unlock(&loop->calls_lock);
+
+    // Run them in the order they were posted
+    while (call != NULL)
+    {
+        next = call->next;
+        call->callback(call->data);
+        call = next;
+    }
+}
+
+static uint64_t event_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+struct event_loop_t * event_loop_create(void)
+{
+    struct event_loop_t *loop;
+
+    loop = malloc(sizeof(struct event_loop_t));
+    if (loop == NULL)
+    {
+        printf("Error: malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        perror("Error: epoll_create1() call failed");
+        exit(EXIT_FAILURE);
+    }
+
+    loop->running = false;
+    loop->event_count = 0;
+    loop->event_index = 0;
+    loop->deferred = NULL;
+    loop->now = event_clock();
+    timer_wheel_init(&loop->timers, loop->now + 1);
+    loop->uring = NULL;
+    loop->poll_armed = false;
+
+    // Set up wakeup for posted calls
+    pthread_mutex_init(&loop->calls_lock, NULL);
+    loop->calls_first = NULL;
+    loop->calls_last = NULL;
+    loop->wakeup_pending = false;
+
+    loop->wakeup_handler.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakeup_handler.fd < 0)
+    {
+        perror("Error: eventfd() call failed");
+        exit(EXIT_FAILURE);
+    }
+    loop->wakeup_handler.callback = &event_wakeup;
+    loop->wakeup_handler.data = loop;
+    if (event_add(loop, &loop->wakeup_handler, EPOLLIN))
+        exit(EXIT_FAILURE);
+
+    return loop;
+}
+
+int event_add(struct event_loop_t *loop, struct event_handler_t *handler, unsigned int events)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = handler;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handler->fd, &event) < 0)
+    {
+        log_error("epoll_ctl() add failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_modify(struct event_loop_t *loop, struct event_handler_t *handler, unsigned int events)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.ptr = handler;
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handler->fd, &event) < 0)
+    {
+        log_error("epoll_ctl() modify failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * event_remove() - Removes file descriptor from event loop
+ *
+ * Events of the handler not yet dispatched are dropped, so the handler may
+ * be freed right after removal.
+ */
+
+int event_remove(struct event_loop_t *loop, struct event_handler_t *handler)
+{
+    int i;
+
+    for (i = loop->event_index + 1; i < loop->event_count; i++)
+    {
+        if (loop->events[i].data.ptr == handler)
+            loop->events[i].data.ptr = NULL;
+    }
+
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL) < 0)
+    {
+        log_error("epoll_ctl() delete failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * event_post() - Posts call to be run by event loop thread
+ *
+ * May be called from any thread. The loop is only woken up if it has not
+ * already been woken up for previously posted calls.
+ */
+
+void event_post(struct event_loop_t *loop, struct event_call_t *call)
+{
+    uint64_t value = 1;
+    bool wakeup;
+
+    call->next = NULL;
+
+    pthread_mutex_lock(&loop->calls_lock);
+    if (loop->calls_last != NULL)
+        loop->calls_last->next = call;
+    else
+        loop->calls_first = call;
+    loop->calls_last = call;
+    wakeup = !loop->wakeup_pending;
+    loop->wakeup_pending = true;
+    pthread_mutex_unlock(&loop->calls_lock);
+
+    if (wakeup)
+    {
+        if (write(loop->wakeup_handler.fd, &value, sizeof(value)) < 0)
+            log_error("Wakeup of event loop failed (%s)", strerror(errno));
+    }
+}
+
+/*
+ * event_defer() - Defers call until ready events have been dispatched
+ *
+ * Must be called by the event loop thread. Deferring an already deferred
+ * call has no effect.
+ */
+
+void event_defer(struct event_loop_t *loop, struct event_defer_t *defer)
+{
+    if (defer->queued)
+        return;
+
+    defer->queued = true;
+    defer->next = loop->deferred;
+    loop->deferred = defer;
+}
+
+/*
+ * event_defer_cancel() - Cancels deferred call
+ */
+
+void event_defer_cancel(struct event_loop_t *loop, struct event_defer_t *defer)
+{
+    struct event_defer_t **p;
+
+    if (!defer->queued)
+        return;
+
+    for (p = &loop->deferred; *p != defer; p = &(*p)->next);
+    *p = defer->next;
+    defer->queued = false;
+}
+
+/*
+ * event_now() - Returns tick (milliseconds) of current loop iteration
+ */
+
+uint64_t event_now(struct event_loop_t *loop)
+{
+    return loop->now;
+}
+
+/*
+ * event_timer_start() - Starts timer expiring after timeout milliseconds
+ *
+ * Must be called by the event loop thread. A pending timer is restarted.
+ * The callback is run by the event loop thread.
+ */
+
+void event_timer_start(struct event_loop_t *loop, struct wheel_timer_t *timer, unsigned int timeout)
+{
+    timer_wheel_add(&loop->timers, timer, loop->now + (timeout > 0 ? timeout : 1));
+}
+
+/*
+ * event_timer_stop() - Stops timer (has no effect if not pending)
+ */
+
+void event_timer_stop(struct event_loop_t *loop, struct wheel_timer_t *timer)
+{
+    timer_wheel_remove(&loop->timers, timer);
+}
+
+/*
+ * event_timeout() - Returns milliseconds until timers must be run
+ *
+ * Returns -1 if no timers are pending.
+ */
+
+static int event_timeout(struct event_loop_t *loop)
+{
+    uint64_t next, now;
+
+    if (timer_wheel_next(&loop->timers, &next) != 0)
+        return -1;
+
+    now = event_clock();
+    if (next <= now)
+        return 0;
+    if (next - now > 3600000)
+        return 3600000;
+
+    return next - now;
+}
+
+static void event_run_timers(struct event_loop_t *loop)
+{
+    loop->now = event_clock();
+    timer_wheel_advance(&loop->timers, loop->now);
+}
+
+static void event_run_deferred(struct event_loop_t *loop)
+{
+    struct event_defer_t *defer;
+
+    // Calls may free their own defer structure
+    while ((defer = loop->deferred) != NULL)
+    {
+        loop->deferred = defer->next;
+        defer->queued = false;
+        defer->callback(defer->data);
+    }
+}
+
+static void event_dispatch(struct event_loop_t *loop, int count)
+{
+    struct event_handler_t *handler;
+
+    loop->event_count = count;
+    for (loop->event_index = 0; loop->event_index < count; loop->event_index++)
+    {
+        // Handler removed by a previous callback
+        handler = loop->events[loop->event_index].data.ptr;
+        if (handler == NULL)
+            continue;
+        handler->callback(handler->fd, loop->events[loop->event_index].events, handler->data);
+    }
+    loop->event_count = 0;
+}
+
+static void event_poll_complete(struct uring_op_t *op, int result, unsigned int flags)
+{
+    struct event_loop_t *loop = op->data;
+    int count;
+
+    loop->poll_armed = false;
+
+    count = epoll_wait(loop->epoll_fd, loop->events, EVENT_MAX, 0);
+    if (count < 0)
+    {
+        if (errno == EINTR)
+            return;
+        perror("Error: epoll_wait() call failed");
+        exit(EXIT_FAILURE);
+    }
+
+    event_dispatch(loop, count);
+}
+
+/*
+ * event_loop_use_uring() - Switches event loop to io_uring backend
+ *
+ * Must be called by the thread which is going to run the loop, before any
+ * transport is started. Returns -1 if io_uring is not supported, in which
+ * case the loop stays with epoll.
+ */
+
+int event_loop_use_uring(struct event_loop_t *loop)
+{
+    loop->uring = uring_create();
+    if (loop->uring == NULL)
+        return -1;
+
+    loop->poll_op.complete = &event_poll_complete;
+    loop->poll_op.data = loop;
+
+    return 0;
+}
+
+static void event_loop_run_uring(struct event_loop_t *loop)
+{
+    struct io_uring_sqe *sqe;
+
+    while (loop->running)
+    {
+        // Watch registered descriptors
+        if (!loop->poll_armed)
+        {
+            sqe = uring_get_sqe(loop->uring, &loop->poll_op);
+            if (sqe != NULL)
+            {
+                sqe->opcode = IORING_OP_POLL_ADD;
+                sqe->fd = loop->epoll_fd;
+                sqe->poll32_events = POLLIN;
+                loop->poll_armed = true;
+            }
+        }
+
+        // Submit queued I/O and wait for completions
+        if (uring_submit_and_wait(loop->uring, 1, event_timeout(loop)))
+            exit(EXIT_FAILURE);
+
+        loop->now = event_clock();
+        uring_reap(loop->uring);
+
+        event_run_timers(loop);
+        event_run_deferred(loop);
+    }
+}
+
+/*
+ * event_loop_run() - Runs event loop
+ *
+ * Waits for events on all registered file descriptors and dispatches them
+ * to their handlers. Does not return until the loop is stopped.
+ */
+
+void event_loop_run(struct event_loop_t *loop)
+{
+    int count;
+
+    loop->running = true;
+
+    if (loop->uring != NULL)
+    {
+        event_loop_run_uring(loop);
+        return;
+    }
+
+    while (loop->running)
+    {
+        count = epoll_wait(loop->epoll_fd, loop->events, EVENT_MAX, event_timeout(loop));
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Error: epoll_wait() call failed");
+            exit(EXIT_FAILURE);
+        }
+
+        loop->now = event_clock();
+        event_dispatch(loop, count);
+
+        event_run_timers(loop);
+        event_run_deferred(loop);
+    }
+}
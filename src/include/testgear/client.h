@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include "testgear/event.h"
+#include "testgear/message.h"
+#include "testgear/ring.h"
+
+#define CLIENT_RX_SIZE 65536
+#define CLIENT_TX_HIGH (1024 * 1024) // Pause reading when exceeded
+#define CLIENT_PENDING_MAX 1024      // Max requests in flight per client
+#define CLIENT_IOV_MAX 256           // Max buffers sent per system call
+#define CLIENT_HEARTBEATS_MISSED_MAX 3 // Unanswered PINGs before closing
+#define CLIENT_PING_SIZE 18          // PING message carrying timestamp
+
+struct subscription_t;
+struct request_t;
+struct client_t;
+
+/*
+ * Message queued for transmission. The buffers are owned by the sender and
+ * must stay untouched until release is called, once the message is sent or
+ * the connection is destroyed.
+ */
+struct client_message_t
+{
+    struct iovec *iov;
+    unsigned int iov_count;
+    unsigned int length;
+    void (*release)(struct client_t *client, void *data);
+    void *data;
+    struct client_message_t *next;
+};
+
+/* Client connection state */
+struct client_t
+{
+    int fd;
+    bool connected;
+    char address[64];
+    struct event_handler_t handler;
+    struct event_loop_t *loop;
+    struct message_io_t *io;
+    void *io_data;            // Transport specific connection state
+    unsigned int events;
+    unsigned int tx_events;   // Events awaited while data is queued
+    unsigned int pending;
+    struct ring_t rx;
+    struct client_message_t *tx_first;
+    struct client_message_t *tx_last;
+    unsigned int tx_offset;   // Bytes of first message already sent
+    unsigned long tx_length;  // Bytes queued
+    struct event_defer_t tx_flush;
+    char *frame;
+    unsigned int frame_size;
+    struct subscription_t *subscriptions;
+    struct request_t *request_pool;
+    unsigned int request_pool_count;
+    uint64_t rx_time;         // Tick of last data received
+    struct wheel_timer_t idle_timer;
+    struct wheel_timer_t heartbeat_timer;
+    unsigned int heartbeats_missed;
+    bool ping_outstanding;    // PING sent, PONG not yet received
+    bool ping_queued;         // PING message waiting to be sent
+    unsigned int ping_id;
+    char ping_buffer[CLIENT_PING_SIZE];
+    struct iovec ping_iov;
+    struct client_message_t ping;
+    unsigned int rtt;         // Smoothed round trip time (us), 0 if unknown
+};
+
+struct client_t * client_create(struct event_loop_t *loop,
+                                int fd,
+                                struct message_io_t *io,
+                                event_callback_t callback);
+void client_destroy(struct client_t *client);
+int client_frame_reserve(struct client_t *client, unsigned int size);
+void client_send(struct client_t *client, struct client_message_t *message);
+void client_schedule_flush(struct client_t *client);
+int client_flush(struct client_t *client);
+void client_sent(struct client_t *client, unsigned long length);
+bool client_congested(struct client_t *client);
+void client_received(struct client_t *client);
+void client_rtt_sample(struct client_t *client, unsigned int rtt);
+
+#endif
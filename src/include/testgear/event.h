@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "testgear/uring.h"
+#include "testgear/timer.h"
+
+#define EVENT_MAX 64
+
+typedef void (*event_callback_t)(int fd, unsigned int events, void *data);
+
+/* Event handler (embedded in the object owning the file descriptor) */
+struct event_handler_t
+{
+    int fd;
+    event_callback_t callback;
+    void *data;
+};
+
+/* Call posted to event loop from another thread */
+struct event_call_t
+{
+    void (*callback)(void *data);
+    void *data;
+    struct event_call_t *next;
+};
+
+/* Call deferred until all ready events have been dispatched */
+struct event_defer_t
+{
+    void (*callback)(void *data);
+    void *data;
+    bool queued;
+    struct event_defer_t *next;
+};
+
+struct event_loop_t
+{
+    int epoll_fd;
+    bool running;
+    struct event_handler_t wakeup_handler;
+    pthread_mutex_t calls_lock;
+    struct event_call_t *calls_first;
+    struct event_call_t *calls_last;
+    bool wakeup_pending;
+    struct epoll_event events[EVENT_MAX]; // Events being dispatched
+    int event_count;
+    int event_index;
+    struct event_defer_t *deferred;
+    struct timer_wheel_t timers;    // Ticks are milliseconds
+    uint64_t now;                   // Tick of current loop iteration
+    struct uring_t *uring;          // NULL unless io_uring backend is used
+    struct uring_op_t poll_op;
+    bool poll_armed;
+};
+
+struct event_loop_t * event_loop_create(void);
+void event_loop_run(struct event_loop_t *loop);
+int event_loop_use_uring(struct event_loop_t *loop);
+
+int event_add(struct event_loop_t *loop, struct event_handler_t *handler, unsigned int events);
+int event_modify(struct event_loop_t *loop, struct event_handler_t *handler, unsigned int events);
+int event_remove(struct event_loop_t *loop, struct event_handler_t *handler);
+
+void event_post(struct event_loop_t *loop, struct event_call_t *call);
+void event_defer(struct event_loop_t *loop, struct event_defer_t *defer);
+void event_defer_cancel(struct event_loop_t *loop, struct event_defer_t *defer);
+
+uint64_t event_now(struct event_loop_t *loop);
+void event_timer_start(struct event_loop_t *loop, struct wheel_timer_t *timer, unsigned int timeout);
+void event_timer_stop(struct event_loop_t *loop, struct wheel_timer_t *timer);
+
+#endif
@@ -32,6 +32,7 @@
 #define LOG_H
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #ifdef SERVER
 
@@ -41,6 +42,7 @@ void log_init(void);
 void log_exit(void);
 void log_info(const char *format, ...);
 void log_error(const char *format, ...);
+int mkpath(char *dir, mode_t mode);
 
 #endif
 
@@ -31,6 +31,10 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#define MSG_PREFIX 0xBD // (binary: 10111101)
+#define MSG_HEADER_SIZE 10
+#define MSG_PAYLOAD_MAX (16 * 1024 * 1024)
+
 enum msg_type_t
 {
     LIST_PLUGINS,
@@ -57,6 +61,16 @@ enum msg_type_t
     DESCRIBE,
     RSP_OK,
     RSP_ERROR,
+    RESOLVE,
+    GET_HANDLE,
+    SET_HANDLE,
+    BATCH,
+    SUBSCRIBE,
+    UNSUBSCRIBE,
+    SAMPLES,
+    PING,
+    PONG,
+    PLUGIN_RELOAD,
 };
 
 int submit_message(int handle,
@@ -67,15 +81,69 @@ int submit_message(int handle,
                  int set_value_size,
                  int timeout);
 
-int handle_incoming_message(void);
+int submit_request(int handle,
+                   int type,
+                   const char *name,
+                   void *set_value,
+                   int set_value_size,
+                   unsigned int *request_id);
+
+int wait_response(int handle,
+                  unsigned int id,
+                  int type,
+                  void *get_value,
+                  int timeout);
+
+int receive_data(int handle,
+                 const char *name,
+                 void *buffer,
+                 unsigned long buffer_size,
+                 unsigned long *size,
+                 int timeout);
+
+int send_data(int handle,
+              const char *name,
+              void *buffer,
+              unsigned long size,
+              int timeout);
+
+int subscribe(int handle,
+              unsigned int period,
+              const char **names,
+              int count,
+              unsigned int *subscription_id,
+              int timeout);
+
+int unsubscribe(int handle, unsigned int subscription_id, int timeout);
+
+int batch_add(void **batch,
+              int *batch_length,
+              int type,
+              const char *name,
+              void *set_value,
+              int set_value_size);
+
+int batch_get(void *responses,
+              unsigned int index,
+              int type,
+              void *get_value);
+
+struct client_t;
+struct iovec;
+
+int handle_incoming_message(struct client_t *client);
+int handle_outgoing_messages(struct client_t *client);
+int handle_received_data(struct client_t *client, const void *data, unsigned int length);
+int send_ping(struct client_t *client);
+void cancel_subscriptions(struct client_t *client);
+void free_request_pool(struct client_t *client);
 
 struct message_io_t
 {
-    int (*write)(void *buffer, int length);
-    int (*read)(void *buffer, int length);
-    int (*close)(void);
+    int (*writev)(struct client_t *client, const struct iovec *iov, int count);
+    int (*read)(struct client_t *client, void *buffer, int length);
+    int (*close)(struct client_t *client);
+    int (*events)(struct client_t *client, unsigned int events); // Optional
 };
 
-int message_register_io(struct message_io_t *io);
-
 #endif
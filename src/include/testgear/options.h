@@ -39,19 +39,38 @@
 enum connection_t
 {
     TCP,
+    UNIX,
+    SHM,
     USB,
     SERIAL
 };
 
+enum event_backend_t
+{
+    EPOLL,
+    URING
+};
+
 /* Options */
 struct option_t
 {
     bool              daemon;
     enum connection_t connection;
     int               tcp_port;
+    char              unix_socket[512];
     char              serial_device[512];
+    int               serial_baud;
     int               usb_vendor_id;
     int               usb_product_id;
+    int               workers;
+    enum event_backend_t event_backend;
+    int               shards;
+    bool              affinity;
+    int               idle_timeout;
+    int               heartbeat;
+    int               request_timeout;
+    bool              isolate;
+    int               host_timeout;
 };
 
 extern struct option_t option;
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PLUGIN_HOST_H
+#define PLUGIN_HOST_H
+
+#define PLUGIN_HOST_ARGUMENT "--plugin-host"
+#define PLUGIN_HOST_VALUE_MAX 65536         // Largest string or property value
+#define PLUGIN_HOST_CHUNK_MAX (1024 * 1024) // Largest data chunk per call
+
+struct plugin_host_t;
+
+struct plugin_host_t * plugin_host_start(const char *name);
+int plugin_host_stop(struct plugin_host_t *host);
+
+int plugin_host_get(struct plugin_host_t *host, int type, char *name, void *value, unsigned int size);
+int plugin_host_set(struct plugin_host_t *host, int type, char *name, const void *value, unsigned int size);
+int plugin_host_get_data(struct plugin_host_t *host, char *name, unsigned long offset, void *value, unsigned long *length, unsigned long *size);
+int plugin_host_set_data(struct plugin_host_t *host, char *name, unsigned long offset, const void *value, unsigned long length, unsigned long size);
+int plugin_host_run(struct plugin_host_t *host, char *name, int *return_value);
+int plugin_host_resolve(struct plugin_host_t *host, char *name);
+int plugin_host_get_property(struct plugin_host_t *host, int index, void *value, int *size, int capacity);
+int plugin_host_set_property(struct plugin_host_t *host, int index, const void *value, int size);
+
+int plugin_host_main(int argc, char *argv[]);
+
+#endif
@@ -31,14 +31,22 @@
 #ifndef PLUGIN_MANAGER_H
 #define PLUGIN_MANAGER_H
 
+#include <stdbool.h>
+#include "testgear/event.h"
+
 void plugin_manager_start(void);
+void plugin_manager_start_host(void);
+void plugin_manager_watch(struct event_loop_t *loop);
+unsigned int plugin_generation(void);
+bool plugin_directory_watched(void);
 
-int list_plugins(char *plugins);
+int list_plugins(char *plugins, unsigned int size);
 
 int plugin_load(char *name);
 int plugin_unload(char *name);
+int plugin_reload(char *name);
 
-int plugin_list_properties(char *plugin_name, char *properties);
+int plugin_list_properties(char *plugin_name, char *properties, unsigned int size);
 
 int plugin_get_char(char *plugin_name, char *variable_name, char *value);
 int plugin_set_char(char *plugin_name, char *variable_name, char value);
@@ -58,11 +66,19 @@ int plugin_set_float(char *plugin_name, char *variable_name, float value);
 int plugin_get_double(char *plugin_name, char *variable_name, double *value);
 int plugin_set_double(char *plugin_name, char *variable_name, double value);
 
-int plugin_get_string(char *plugin_name, char *variable_name, char *value);
+int plugin_get_string(char *plugin_name, char *variable_name, char *value, unsigned int size);
 int plugin_set_string(char *plugin_name, char *variable_name, char *value);
 
+int plugin_get_data(char *plugin_name, char *variable_name, unsigned long offset, void *value, unsigned long *length, unsigned long *size);
+int plugin_set_data(char *plugin_name, char *variable_name, unsigned long offset, void *value, unsigned long length, unsigned long size);
+
 int plugin_run(char *plugin_name, char *command_name, int *return_value);
 
-int plugin_describe(char *plugin_name, char *name, char *value);
+int plugin_describe(char *plugin_name, char *name, char *value, unsigned int size);
+
+int plugin_resolve(char *plugin_name, char *variable_name, unsigned int *handle);
+int plugin_handle_name(unsigned int handle, char *plugin_name);
+int plugin_get_handle(unsigned int handle, void *value, int *size, int capacity);
+int plugin_set_handle(unsigned int handle, void *value, int size);
 
 #endif
@@ -33,6 +33,24 @@
 
 #include <stdbool.h>
 
+/*
+ * Version of the interface between daemon and plugins, which is implemented
+ * by plugin.c. Since version 2 a plugin may be loaded several times under
+ * different names, each instance having its own property values. The
+ * functions below act on the instance the daemon is calling into.
+ */
+#define PLUGIN_ABI 4
+
+/* Maximum length of a string variable, including the terminating zero */
+#define PLUGIN_STRING_MAX 65536
+
+/* Maximum size of a data variable, plugins may be built with another limit */
+#ifndef PLUGIN_DATA_MAX
+#define PLUGIN_DATA_MAX (64 * 1024 * 1024)
+#endif
+
+struct plugin_instance;
+
 struct init_data
 {
     FILE *log_file;
@@ -62,6 +80,7 @@ struct plugin_properties
    void *data;
 };
 
+/* Plugin description, load and unload are called for each instance */
 struct plugin
 {
    const char *name;
@@ -88,7 +107,7 @@ int set_long(char *name, long value);
 int set_float(char *name, float value);
 int set_double(char *name, double value);
 int set_string(char *name, char *value);
-int set_data(char *name, void *value);
+int set_data(char *name, void *value, unsigned long size);
 
 char   get_char(char *name);
 short  get_short(char *name);
@@ -97,7 +116,11 @@ long   get_long(char *name);
 float  get_float(char *name);
 double get_double(char *name);
 char * get_string(char *name);
-void * get_data(void *name);
+void * get_data(char *name, unsigned long *size);
+
+const char * instance_name(void);
+void * get_instance_data(void);
+void set_instance_data(void *data);
 
 void log_info(const char *format, ...);
 void log_error(const char *format, ...);
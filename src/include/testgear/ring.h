@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef RING_H
+#define RING_H
+
+/*
+ * Byte ring buffer. Size is always a power of two and head/tail are free
+ * running counters, so used space is simply head - tail.
+ */
+
+struct ring_t
+{
+    char *data;
+    unsigned int size;
+    unsigned int head;
+    unsigned int tail;
+};
+
+int ring_init(struct ring_t *ring, unsigned int size);
+void ring_destroy(struct ring_t *ring);
+int ring_grow(struct ring_t *ring, unsigned int size);
+
+unsigned int ring_used(struct ring_t *ring);
+unsigned int ring_available(struct ring_t *ring);
+
+void * ring_write_pointer(struct ring_t *ring, unsigned int *length);
+void ring_commit(struct ring_t *ring, unsigned int length);
+void ring_write(struct ring_t *ring, const void *buffer, unsigned int length);
+
+void * ring_read_pointer(struct ring_t *ring, unsigned int *length);
+void ring_peek(struct ring_t *ring, void *buffer, unsigned int length);
+void ring_consume(struct ring_t *ring, unsigned int length);
+
+#endif
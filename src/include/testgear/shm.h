@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SHM_H
+#define SHM_H
+
+#include <stdint.h>
+#include "testgear/event.h"
+#include "testgear/client.h"
+#include "testgear/message.h"
+
+#define SHM_MAGIC 0x54475348     // "TGSH"
+#define SHM_RING_SIZE (1024 * 1024) // Size of each ring (power of two)
+#define SHM_DATA_OFFSET 4096     // Ring data starts after control page
+
+/*
+ * Control block of one single producer single consumer ring. The indexes
+ * are free running byte counters, each written by one side only and kept
+ * in separate cache lines.
+ */
+struct shm_ring_t
+{
+    uint32_t head __attribute__((aligned(64))); // Written by producer
+    uint32_t producer_waiting;                  // Producer waits for room
+    uint32_t tail __attribute__((aligned(64))); // Written by consumer
+    uint32_t consumer_waiting;                  // Consumer waits for data
+};
+
+/* Control page at the start of the shared memory */
+struct shm_control_t
+{
+    struct shm_ring_t requests;  // Client to server
+    struct shm_ring_t responses; // Server to client
+};
+
+/* Sent by server together with the descriptors of a new connection */
+struct shm_hello_t
+{
+    uint32_t magic;
+    uint32_t ring_size;
+};
+
+void shm_server_start(struct event_loop_t *loop, const char *path, struct message_io_t *io);
+int shm_writev(struct client_t *client, const struct iovec *iov, int count);
+int shm_read(struct client_t *client, void *buffer, int length);
+int shm_close(struct client_t *client);
+
+#endif
@@ -28,12 +28,21 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #ifndef TCP_H
 #define TCP_H
 
-int tcp_server_start(int port);
-int tcp_write(void *buffer, int length);
-int tcp_read(void *buffer, int length);
-int tcp_close(void);
+#include <stdbool.h>
+#include "testgear/event.h"
+#include "testgear/client.h"
+#include "testgear/message.h"
+
+void tcp_server_start(struct event_loop_t *loop, int port, struct message_io_t *io, bool shared);
+int tcp_writev(struct client_t *client, const struct iovec *iov, int count);
+int tcp_read(struct client_t *client, void *buffer, int length);
+int tcp_close(struct client_t *client);
+int tcp_uring_writev(struct client_t *client, const struct iovec *iov, int count);
+int tcp_uring_events(struct client_t *client, unsigned int events);
+int tcp_uring_close(struct client_t *client);
 
 #endif
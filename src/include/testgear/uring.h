@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFER_COUNT 256    // Provided receive buffers (power of two)
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+
+/* Submitted operation, the completion is dispatched through user_data */
+struct uring_op_t
+{
+    void (*complete)(struct uring_op_t *op, int result, unsigned int flags);
+    void *data;
+};
+
+struct uring_t
+{
+    int fd;
+
+    // Submission queue
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_local_tail; // Prepared entries
+    unsigned int to_submit;
+
+    // Completion queue
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *ring;
+    size_t ring_size;
+    size_t sqes_size;
+
+    // Provided receive buffers
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    char *buffers;
+    uint16_t buf_tail;
+};
+
+struct uring_t * uring_create(void);
+struct io_uring_sqe * uring_get_sqe(struct uring_t *ring, struct uring_op_t *op);
+int uring_submit_and_wait(struct uring_t *ring, unsigned int wait, int timeout);
+void uring_reap(struct uring_t *ring);
+void * uring_buffer(struct uring_t *ring, unsigned int flags);
+void uring_recycle_buffer(struct uring_t *ring, unsigned int flags);
+
+#endif
@@ -43,7 +43,11 @@
 
 FILE *log_file = NULL;
 
-static int mkpath(char *dir, mode_t mode)
+/*
+ * mkpath() - Creates directory including missing parent directories
+ */
+
+int mkpath(char *dir, mode_t mode)
 {
     if (!dir)
     {
@@ -99,29 +103,35 @@ void log_exit(void)
 void log_info(const char *format, ...)
 {
     va_list args;
+    flockfile(log_file);
     fprintf(log_file, "[testgeard] ");
     va_start(args, format);
     vfprintf(log_file, format, args);
     va_end(args);
     fprintf(log_file, "\n");
+    funlockfile(log_file);
 }
 
 void log_warning(const char *format, ...)
 {
     va_list args;
+    flockfile(log_file);
     fprintf(log_file, "[testgeard] Warning: ");
     va_start(args, format);
     vfprintf(log_file, format, args);
     va_end(args);
     fprintf(log_file, "\n");
+    funlockfile(log_file);
 }
 
 void log_error(const char *format, ...)
 {
     va_list args;
+    flockfile(log_file);
     fprintf(log_file, "[testgeard] Error: ");
     va_start(args, format);
     vfprintf(log_file, format, args);
     va_end(args);
     fprintf(log_file, "\n");
+    funlockfile(log_file);
 }
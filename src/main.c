@@ -30,13 +30,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 #include "config.h"
 #include "testgear/options.h"
 #include "testgear/debug.h"
 #include "testgear/daemon.h"
 #include "testgear/plugin-manager.h"
+#include "testgear/plugin-host.h"
 #include "testgear/connection-manager.h"
+#include "testgear/worker.h"
 #include "testgear/log.h"
 
 void sigint_handler(int signal)
@@ -52,6 +55,10 @@ void exit_handler(void)
 
 int main(int argc, char *argv[])
 {
+    // Plugin hosts are started by the daemon itself (see plugin-host.c)
+    if ((argc > 1) && (strcmp(argv[1], PLUGIN_HOST_ARGUMENT) == 0))
+        return plugin_host_main(argc, argv);
+
     // Initialize log
     log_init();
 
@@ -71,6 +78,9 @@ int main(int argc, char *argv[])
     // Start plugin manager
     plugin_manager_start();
 
+    // Start worker threads executing requests
+    worker_start(option.workers);
+
     // Start connection manager
     connection_manager_start();
 
@@ -30,13 +30,24 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include "testgear/debug.h"
 #include "testgear/message.h"
 #include "testgear/tcp.h"
 #ifdef SERVER
 #include "testgear/plugin-manager.h"
+#include "testgear/client.h"
+#include "testgear/ring.h"
+#include "testgear/event.h"
+#include "testgear/worker.h"
+#include "testgear/hash.h"
+#include "testgear/log.h"
+#include "testgear/options.h"
+#include <sys/timerfd.h>
 #else
 #include "testgear/testgear.h"
 #include "testgear/session.h"
@@ -51,19 +62,29 @@
  *  message[5]    = type
  *  message[6-9]  = payload length (32 bit)
  *  message[10-*] = payload
+ *
+ * Each response carries the ID of the request it answers. A client may send
+ * any number of requests without waiting for their responses (pipelining).
+ * Responses are not guaranteed to arrive in request order, so clients must
+ * match responses to requests by ID.
  * 
  * Possible message types include:
  *  LIST_PLUGINS,
- *  PLUGIN_LOAD, PLUGIN_UNLOAD,
+ *  PLUGIN_LOAD, PLUGIN_UNLOAD, PLUGIN_RELOAD,
  *  PLUGIN_LIST_PROPERTIES,
  *  GET_CHAR, GET_SHORT, GET_INT, GET_LONG, GET_FLOAT, GET_DOUBLE
  *  SET_CHAR, SET_SHORT, SET_INT, SET_LONG, SET_FLOAT, SET_DOUBLE
+ *  GET_DATA, SET_DATA
  *  RSP_OK, RSP_ERROR
+ *  RESOLVE, GET_HANDLE, SET_HANDLE
+ *  BATCH
+ *  SUBSCRIBE, UNSUBSCRIBE, SAMPLES
+ *  PING, PONG
  *
  * Payload format depends on message type:
  *  LIST_PLUGINS:
  *   No payload (payload length = 0)
- *  PLUGIN_LOAD, PLUGIN_UNLOAD, PLUGIN_LIST_PROPERTIES:
+ *  PLUGIN_LOAD, PLUGIN_UNLOAD, PLUGIN_RELOAD, PLUGIN_LIST_PROPERTIES:
  *   payload[0]   = plugin name length
  *   payload[1-*] = plugin name
  *  GET_CHAR, GET_SHORT, GET_INT, GET_LONG,
@@ -99,12 +120,48 @@
  *   payload[1-*] = variable name
  *   payload[*]   = string length (1 byte)
  *   payload[*-*] = string data
+ *  GET_DATA:
+ *   payload[0]   = variable name length
+ *   payload[1-*] = variable name
+ *   payload[*-*] = offset (8 bytes)
+ *   payload[*-*] = chunk length (4 bytes)
+ *  SET_DATA:
+ *   payload[0]   = variable name length
+ *   payload[1-*] = variable name
+ *   payload[*-*] = offset (8 bytes)
+ *   payload[*-*] = total size (8 bytes)
+ *   payload[*-*] = chunk data
  *  RUN:
  *   payload[0]   = function name length
  *   payload[1-*] = function name
  *  DESCRIBE:
  *   payload[0]   = name length
  *   payload[1-*] = name
+ *  RESOLVE:
+ *   payload[0]   = variable name length
+ *   payload[1-*] = variable name
+ *  GET_HANDLE:
+ *   payload[0-3] = handle
+ *  SET_HANDLE:
+ *   payload[0-3] = handle
+ *   payload[4-*] = value (size of variable type, or string data)
+ *  BATCH:
+ *   payload[0-*] = request messages (operations), back to back
+ *  SUBSCRIBE:
+ *   payload[0-3] = sampling period in microseconds (at least 1000)
+ *   payload[4]   = variable name length
+ *   payload[5-*] = variable name
+ *   (name length and name repeated for each variable)
+ *  UNSUBSCRIBE:
+ *   payload[0-3] = subscription ID
+ *  SAMPLES:
+ *   payload[0-7] = timestamp (nanoseconds since the Epoch)
+ *   payload[8-*] = values in subscription order (size of variable type,
+ *                  or zero terminated string)
+ *  PING:
+ *   payload[0-*] = any data (server sends timestamp, 8 bytes)
+ *  PONG:
+ *   payload[0-*] = data of PING answered
  *  RSP_OK, RSP_ERROR:
  *   payload[0-3] = response data length
  *   payload[4-*] = response data
@@ -128,25 +185,77 @@
  *   data[0-7] = value (8 bytes)
  *  (GET_STRING):
  *   data[0-N] = string (N bytes)
+ *  (GET_DATA):
+ *   data[0-7] = total size (8 bytes)
+ *   data[8-N] = chunk data (N-7 bytes)
  *  (RUN):
  *   data[0-3] = function return value (4 bytes)
+ *  (RESOLVE):
+ *   data[0-3] = handle (4 bytes)
+ *  (GET_HANDLE):
+ *   data[0-N] = value (size of variable type, or zero terminated string)
+ *  (BATCH):
+ *   data[0-N] = response messages, one per operation (N bytes)
+ *  (SUBSCRIBE):
+ *   data[0-3] = subscription ID (4 bytes)
  *
  *  Data format for RSP_ERROR response:
  *   data[0-N] = error string (N bytes)
  *
+ *  DATA variables are transferred in chunks of at most DATA_CHUNK_MAX bytes.
+ *  A GET_DATA chunk is shorter than requested only at the end of the data.
+ *  A SET_DATA transfer starts at offset 0, which sets the total size, and
+ *  is complete when the last byte is written. Chunks are copied directly
+ *  between messages and plugin buffers.
+ *
+ *  A handle returned by RESOLVE refers to a variable of a loaded plugin and
+ *  saves decoding and looking up its name in each GET_HANDLE and SET_HANDLE
+ *  request. Handles become invalid when the plugin is unloaded.
+ *
+ *  A BATCH request carries any number of operations, up to 4096, in one
+ *  message. Each operation is encoded as a complete request message of any
+ *  other type. The response to each operation carries the ID of its request
+ *  message and tells its status by its type. The responses are returned in
+ *  operation order in a single RSP_OK response. Operations on the same
+ *  plugin are executed in order.
+ *
+ *  A SUBSCRIBE request makes the server sample the given variables of one
+ *  plugin periodically until the subscription is cancelled by UNSUBSCRIBE
+ *  or the connection is closed. The subscription ID is the ID of the
+ *  SUBSCRIBE request. The sampling period must be at least 1 ms, shorter
+ *  periods are rejected. Each sample is pushed to the client in a SAMPLES
+ *  message carrying the subscription ID. Samples are skipped while the
+ *  previous sample is still being taken or the client does not keep up.
+ *  If sampling fails, for example because the plugin was unloaded, the
+ *  subscription ends with a RSP_ERROR message carrying the subscription ID.
+ *
+ *  A plugin may be loaded several times, each instance having its own
+ *  property values, by loading it as "<instance>=<plugin>" (eg. "psu0=psu").
+ *  The instance is then referred to by its instance name ("psu0.voltage").
+ *  Requests for different instances are executed in parallel.
+ *
+ *  PLUGIN_RELOAD replaces a loaded plugin by the plugin currently
+ *  installed under its name, including all its instances. Requests for the
+ *  plugin are not held up by the reload and are executed by either the old
+ *  or the new plugin. The new plugin starts over with fresh state. Handles
+ *  stay valid if the properties of the plugin are unchanged. A plugin file
+ *  must be replaced (not overwritten) for the new plugin to be loaded.
+ *
+ *  PING may be sent by either side, the other side answers with a PONG
+ *  carrying the ID and payload of the PING. The server sends PINGs to
+ *  measure round trip time and detect dead clients, if so configured.
+ *
+ *  The server may be configured to answer requests which have not been
+ *  started in time with a RSP_ERROR message. Such requests are not
+ *  executed. Requests already being executed are always answered with their
+ *  result.
+ *
  *  RSP_ERROR only relates to Test Gear errors ("plugin not found", "variable
  *  not found", "out of memory", etc.)
  */
 
-#define MSG_PREFIX 0xBD // (binary: 10111101)
-#define MSG_HEADER_SIZE 10
 #define MSG_NAME_LENGTH_MAX 256
-
-static struct message_io_t *msg_io;
-
-static unsigned int message_counter = 0;
-
-static char error_message[4096] = "";
+#define DATA_CHUNK_MAX (1024 * 1024)
 
 struct __attribute__((__packed__)) msg_header_t
 {
@@ -157,41 +266,14 @@ struct __attribute__((__packed__)) msg_header_t
    char payload; // Fake payload item (for reference only)
 };
 
-#ifdef SERVER
-int message_register_io(struct message_io_t *io)
-{
-    msg_io = io;
-
-    // Check for NULL functions here
-    return 0;
-}
-#endif
-
-static int value_size(int command)
-{ 
-    switch (command)
-    {
-        case GET_CHAR:
-            return sizeof(char);
-        case GET_SHORT:
-            return sizeof(short);
-        case GET_INT:
-            return sizeof(int);
-        case GET_LONG:
-            return sizeof(long);
-        case GET_FLOAT:
-            return sizeof(float);
-        case GET_DOUBLE:
-            return sizeof(double);
-        default:
-            return 0;
-            break;
-    }
-
-    return 0;
-} 
+/*
+ * encode_message() - Encodes message into buffer
+ *
+ * The buffer must hold the message, see create_message() for worst case
+ * size.
+ */
 
-static int create_message(void **msg_buffer,
+static int encode_message(void *msg_buffer,
                    char type,
                    const char *name,
                    void *value,
@@ -208,31 +290,14 @@ static int create_message(void **msg_buffer,
     else
         name_length = 0;
 
-    if ((type != RSP_OK) || (type != RSP_ERROR))
-    {
-        // Verify length of name
-        if (name_length > MSG_NAME_LENGTH_MAX)
-        {
-            printf("Error: Length of name must not exceed %d bytes\n", MSG_NAME_LENGTH_MAX);
-            return -1;
-        }
-    }
-
-    // Allocate memory for message buffer (worst case)
-    *msg_buffer = malloc(MSG_HEADER_SIZE + 1 + name_length + 4 + value_length);
-    if (msg_buffer == NULL)
-    {
-        printf("Error: malloc() failed");
-        return -1;
-    }
-
     // Create message header
-    message         = *msg_buffer;
+    message         = msg_buffer;
     message->prefix = MSG_PREFIX;
     message->id     = id;
     message->type   = type;
     
-    payload = &message->payload;
+    // Payload follows header, the payload member only marks where
+    payload = (char *) msg_buffer + MSG_HEADER_SIZE;
 
     switch (type)
     {
@@ -241,6 +306,7 @@ static int create_message(void **msg_buffer,
             break;
         case PLUGIN_LOAD:
         case PLUGIN_UNLOAD:
+        case PLUGIN_RELOAD:
         case PLUGIN_LIST_PROPERTIES:
         case GET_CHAR:
         case GET_SHORT:
@@ -249,9 +315,11 @@ static int create_message(void **msg_buffer,
         case GET_FLOAT:
         case GET_DOUBLE:
         case GET_STRING:
-        case GET_DATA:
         case RUN:
         case DESCRIBE:
+        case RESOLVE:
+            if (name == NULL)
+                return -1;
             payload[0] = name_length;
             strcpy(&payload[1], name);
             message->payload_length = 1 + name_length;
@@ -262,24 +330,37 @@ static int create_message(void **msg_buffer,
         case SET_LONG:
         case SET_FLOAT:
         case SET_DOUBLE:
+        case GET_DATA:
+        case SET_DATA:
+            if (name == NULL)
+                return -1;
             payload[0] = name_length;
             strcpy(&payload[1], name);
             memcpy(&payload[1+name_length], value, value_length);
             message->payload_length = 1 + name_length + value_length;
             break;
         case SET_STRING:
+            if (name == NULL)
+                return -1;
             payload[0] = name_length;
             strcpy(&payload[1], name);
             payload[1+name_length] = value_length;
             memcpy(&payload[1+name_length+1], value, value_length);
             message->payload_length = 1 + name_length + 1 + value_length;
             break;
+        case GET_HANDLE:
+        case SET_HANDLE:
+        case BATCH:
+        case SUBSCRIBE:
+        case UNSUBSCRIBE:
+        case SAMPLES:
+        case PING:
+        case PONG:
         case RSP_OK:
         case RSP_ERROR:
             memcpy(&payload[0], value, value_length);
             message->payload_length = value_length;
             break;
-        case SET_DATA:
         default:
             printf("Error: Unknown message type\n");
             return -1;
@@ -292,22 +373,136 @@ static int create_message(void **msg_buffer,
     return msg_length;
 }
 
-static int verify_request(void *msg_buffer)
+#ifdef DEBUG
+static char *message_type(int type)
 {
-    struct msg_header_t *message;
-    message = msg_buffer;
+    switch (type)
+    {
+        case LIST_PLUGINS:
+            return "LIST_PLUGINS";
+        case PLUGIN_LOAD:
+            return "PLUGIN_LOAD";
+        case PLUGIN_UNLOAD:
+            return "PLUGIN_UNLOAD";
+        case PLUGIN_RELOAD:
+            return "PLUGIN_RELOAD";
+        case PLUGIN_LIST_PROPERTIES:
+            return "PLUGIN_LIST_PROPERTIES";
+        case GET_CHAR:
+            return "GET_CHAR";
+        case GET_SHORT:
+            return "GET_SHORT";
+        case GET_INT:
+            return "GET_INT";
+        case GET_LONG:
+            return "GET_LONG";
+        case GET_FLOAT:
+            return "GET_FLOAT";
+        case GET_DOUBLE:
+            return "GET_DOUBLE";
+        case GET_STRING:
+            return "GET_STRING";
+        case GET_DATA:
+            return "GET_DATA";
+        case SET_CHAR:
+            return "SET_CHAR";
+        case SET_SHORT:
+            return "SET_SHORT";
+        case SET_INT:
+            return "SET_INT";
+        case SET_LONG:
+            return "SET_LONG";
+        case SET_FLOAT:
+            return "SET_FLOAT";
+        case SET_DOUBLE:
+            return "SET_DOUBLE";
+        case SET_STRING:
+            return "SET_STRING";
+        case SET_DATA:
+            return "SET_DATA";
+        case RUN:
+            return "RUN";
+        case DESCRIBE:
+            return "DESCRIBE";
+        case RSP_OK:
+            return "RSP_OK";
+        case RSP_ERROR:
+            return "RSP_ERROR";
+        case RESOLVE:
+            return "RESOLVE";
+        case GET_HANDLE:
+            return "GET_HANDLE";
+        case SET_HANDLE:
+            return "SET_HANDLE";
+        case BATCH:
+            return "BATCH";
+        case SUBSCRIBE:
+            return "SUBSCRIBE";
+        case UNSUBSCRIBE:
+            return "UNSUBSCRIBE";
+        case SAMPLES:
+            return "SAMPLES";
+        case PING:
+            return "PING";
+        case PONG:
+            return "PONG";
+        default:
+            break;
+    }
+    return "unknown";
+}
+#endif
 
-    // Verify message prefix
-    if (message->prefix != MSG_PREFIX)
+#ifndef SERVER
+
+static unsigned int message_counter = 0;
+
+static char error_message[4096] = "";
+
+static int create_message(void **msg_buffer,
+                   char type,
+                   const char *name,
+                   void *value,
+                   int value_length,
+                   unsigned int id)
+{
+    unsigned char name_length = 0;
+    int msg_length;
+
+    if (name != NULL)
+        name_length = strlen(name);
+    else
+        name_length = 0;
+
+    if ((type != RSP_OK) && (type != RSP_ERROR))
     {
-        printf("Error: Received invalid request message (invalid prefix)\n");
+        // Verify length of name
+        if (name_length > MSG_NAME_LENGTH_MAX)
+        {
+            printf("Error: Length of name must not exceed %d bytes\n", MSG_NAME_LENGTH_MAX);
+            return -1;
+        }
+    }
+
+    // Allocate memory for message buffer (worst case)
+    *msg_buffer = malloc(MSG_HEADER_SIZE + 1 + name_length + 4 + value_length);
+    if (*msg_buffer == NULL)
+    {
+        printf("Error: malloc() failed");
         return -1;
     }
 
-    return 0;
+    msg_length = encode_message(*msg_buffer, type, name, value, value_length, id);
+    if (msg_length < 0)
+    {
+        free(*msg_buffer);
+        *msg_buffer = NULL;
+    }
+
+    return msg_length;
 }
 
-static int verify_response(void *msg_buffer, unsigned int id)
+static int verify_response(void *msg_buffer)
 {
     struct msg_header_t *message;
     message = msg_buffer;
@@ -320,19 +515,13 @@ static int verify_response(void *msg_buffer, unsigned int id)
     }
 
     // Verify that we are receiving a response type message
-    if ((message->type != RSP_OK) && (message->type != RSP_ERROR))
+    if ((message->type != RSP_OK) && (message->type != RSP_ERROR) &&
+        (message->type != SAMPLES) && (message->type != PING))
     {
         printf("Error: Received invalid response message (invalid response type)\n");
         return -1;
     }
 
-    // Verify response id
-    if (message->id != id)
-    {
-        printf("Error: Received invalid response message (invalid response id)\n");
-        return -1;
-    }
-
     return 0;
 }
 
@@ -350,6 +539,7 @@ static int decode_value(void *payload, int payload_size, char type, void *value)
             break;
         case PLUGIN_LOAD:
         case PLUGIN_UNLOAD:
+        case PLUGIN_RELOAD:
         case GET_CHAR:
             memcpy(value, payload, sizeof(char));
             break;
@@ -381,6 +571,18 @@ static int decode_value(void *payload, int payload_size, char type, void *value)
         case RUN:
             memcpy(value, payload, sizeof(int));
             break;
+        case RESOLVE:
+            memcpy(value, payload, sizeof(unsigned int));
+            break;
+        case GET_HANDLE:
+        case GET_DATA:
+        case BATCH:
+        case SAMPLES:
+            memcpy(value, payload, payload_size);
+            break;
+        case SUBSCRIBE:
+            memcpy(value, payload, sizeof(unsigned int));
+            break;
         default:
             // Do nothing (no value returned for set commands)
             break;
@@ -389,100 +591,47 @@ static int decode_value(void *payload, int payload_size, char type, void *value)
     return 0;
 }
 
-static int decode_name(void *payload, void *name)
+/* Response received while waiting for the response to another request */
+struct pending_response_t
 {
-    unsigned char length;
-    char *p, *n;
-
-    p = payload;
-    length = p[0];
-
-    memcpy(name, &p[1], length);
-
-    // Terminate name string
-    n = name;
-    n[length] = 0;
+    int handle;
+    unsigned int id;
+    unsigned char type;
+    unsigned int payload_length;
+    char *payload;
+    struct pending_response_t *next;
+};
 
-    return 0;
-}
+static struct pending_response_t *pending_responses = NULL;
 
-#ifdef DEBUG
-static char *message_type(type)
+static void free_response(struct pending_response_t *response)
 {
-    switch (type)
-    {
-        case LIST_PLUGINS:
-            return "LIST_PLUGINS";
-        case PLUGIN_LOAD:
-            return "PLUGIN_LOAD";
-        case PLUGIN_UNLOAD:
-            return "PLUGIN_UNLOAD";
-        case PLUGIN_LIST_PROPERTIES:
-            return "PLUGIN_LIST_PROPERTIES";
-        case GET_CHAR:
-            return "GET_CHAR";
-        case GET_SHORT:
-            return "GET_SHORT";
-        case GET_INT:
-            return "GET_INT";
-        case GET_LONG:
-            return "GET_LONG";
-        case GET_FLOAT:
-            return "GET_FLOAT";
-        case GET_DOUBLE:
-            return "GET_DOUBLE";
-        case GET_STRING:
-            return "GET_STRING";
-        case GET_DATA:
-            return "GET_DATA";
-        case SET_CHAR:
-            return "SET_CHAR";
-        case SET_SHORT:
-            return "SET_SHORT";
-        case SET_INT:
-            return "SET_INT";
-        case SET_LONG:
-            return "SET_LONG";
-        case SET_FLOAT:
-            return "SET_FLOAT";
-        case SET_DOUBLE:
-            return "SET_DOUBLE";
-        case SET_STRING:
-            return "SET_STRING";
-        case SET_DATA:
-            return "SET_DATA";
-        case RUN:
-            return "RUN";
-        case DESCRIBE:
-            return "DESCRIBE";
-        case RSP_OK:
-            return "RSP_OK";
-        case RSP_ERROR:
-            return "RSP_ERROR";
-        default:
-            break;
-    }
-    return "unknown";
+    free(response->payload);
+    free(response);
 }
-#endif
 
-#ifndef SERVER
-int submit_message(int handle,
+/*
+ * submit_request() - Sends request message without waiting for response
+ *
+ * The ID of the request is returned in request_id and is used to collect
+ * the response with wait_response(). Any number of requests may be in
+ * flight at the same time.
+ */
+
+int submit_request(int handle,
                    int type,
                    const char *name,
-                   void *get_value,
                    void *set_value,
                    int set_value_size,
-                   int timeout)
+                   unsigned int *request_id)
 {
-    struct msg_header_t msg_header;
-    char *response_message;
     char *message;
-    char *payload;
     int length;
-    static unsigned int id = 0;
+    unsigned int id;
     int ret;
 
+    id = message_counter++;
+
     // Create request message
     length = create_message( (void *) &message, type, name, set_value, set_value_size, id);
     if (length < 0)
@@ -492,14 +641,22 @@ int submit_message(int handle,
 
     // Send request message
     ret = session[handle].write(handle, message, length);
-    if (ret < 0 )
-    {
-        return -1;
-    }
 
     // Free request message buffer
     free(message);
 
+    if (ret < 0 )
+        return -1;
+
+    *request_id = id;
+
+    return 0;
+}
+
+static int receive_response(int handle, struct pending_response_t *response)
+{
+    struct msg_header_t msg_header;
+
     // Receive response message header
     if (session[handle].read(handle, &msg_header, MSG_HEADER_SIZE) == 0)
     {
@@ -509,53 +666,458 @@ int submit_message(int handle,
     }
 
     // Verify response message
-    verify_response(&msg_header, id);
+    if (verify_response(&msg_header) != 0)
+    {
+        tg_error = "Received invalid response message";
+        session[handle].close(handle);
+        return -1;
+    }
+
+    response->handle = handle;
+    response->id = msg_header.id;
+    response->type = msg_header.type;
+    response->payload_length = msg_header.payload_length;
+
+    // Allocate memory for payload buffer
+    response->payload = malloc(msg_header.payload_length + 1);
+    if (response->payload == NULL)
+    {
+        printf("Error: malloc() failed");
+        return -1;
+    }
 
     if (msg_header.payload_length > 0)
     {
-        // Allocate memory for payload buffer
-        payload = malloc(msg_header.payload_length + 1);
-        if (payload == NULL)
+        // Receive payload
+        if (session[handle].read(handle, response->payload, msg_header.payload_length) == 0)
+        {
+            tg_error = "Server closed connection";
+            session[handle].close(handle);
+            free(response->payload);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * answer_ping() - Answers PING from server with PONG
+ */
+
+static void answer_ping(struct pending_response_t *ping)
+{
+    char *message;
+    int length;
+
+    length = create_message((void *) &message, PONG, NULL, ping->payload, ping->payload_length, ping->id);
+    if (length < 0)
+        return;
+
+    session[ping->handle].write(ping->handle, message, length);
+
+    free(message);
+}
+
+/*
+ * wait_response() - Waits for response to request with given ID
+ *
+ * Responses may arrive in a different order than the requests were sent.
+ * Responses to other requests received meanwhile are kept until they are
+ * waited for.
+ */
+
+int wait_response(int handle,
+                  unsigned int id,
+                  int type,
+                  void *get_value,
+                  int timeout)
+{
+    struct pending_response_t *response = NULL;
+    struct pending_response_t **p;
+    int ret = 0;
+
+    // Check responses already received
+    for (p = &pending_responses; *p != NULL; p = &(*p)->next)
+    {
+        if (((*p)->handle == handle) && ((*p)->id == id))
+        {
+            response = *p;
+            *p = response->next;
+            break;
+        }
+    }
+
+    // Receive responses until the matching one arrives
+    while (response == NULL)
+    {
+        response = malloc(sizeof(struct pending_response_t));
+        if (response == NULL)
         {
             printf("Error: malloc() failed");
             return -1;
         }
 
-        // Receive payload
-        if (session[handle].read(handle, payload, msg_header.payload_length) == 0)
+        if (receive_response(handle, response) != 0)
         {
-            tg_error = "Server closed connection";
-            session[handle].close(handle);
-            free(payload);
+            free(response);
             return -1;
         }
 
-        if (msg_header.type == RSP_OK)
+        if (response->type == PING)
         {
-            // Extract value from response message
-            decode_value(payload, msg_header.payload_length, type, get_value);
+            answer_ping(response);
+            free_response(response);
+            response = NULL;
+            continue;
         }
 
-        if (msg_header.type == RSP_ERROR)
+        if (response->id != id)
         {
-            // Payload is the error string
-            strcpy(error_message, payload);
-            tg_error = error_message;
-            return -1;
+            debug_printf("Keeping response with ID %d for later\n", response->id);
+
+            // Keep in order of arrival (subscriptions push many messages)
+            response->next = NULL;
+            for (p = &pending_responses; *p != NULL; p = &(*p)->next);
+            *p = response;
+            response = NULL;
         }
+    }
 
-        free(payload);
+    if ((response->type == RSP_OK) || (response->type == SAMPLES))
+    {
+        // Extract value from response message
+        if (response->payload_length > 0)
+            decode_value(response->payload, response->payload_length, type, get_value);
+    }
+    else
+    {
+        // Payload is the error string
+        response->payload[response->payload_length] = 0;
+        strncpy(error_message, response->payload, sizeof(error_message) - 1);
+        tg_error = error_message;
+        ret = -1;
+    }
+
+    free_response(response);
+
+    return ret;
+}
+
+int submit_message(int handle,
+                   int type,
+                   const char *name,
+                   void *get_value,
+                   void *set_value,
+                   int set_value_size,
+                   int timeout)
+{
+    unsigned int id;
+
+    if (submit_request(handle, type, name, set_value, set_value_size, &id) != 0)
+        return -1;
+
+    return wait_response(handle, id, type, get_value, timeout);
+}
+
+/*
+ * receive_data() - Gets DATA variable in chunks
+ *
+ * The total size of the data is returned in size. Fails if the data does
+ * not fit in buffer.
+ */
+
+int receive_data(int handle,
+                 const char *name,
+                 void *buffer,
+                 unsigned long buffer_size,
+                 unsigned long *size,
+                 int timeout)
+{
+    char request[sizeof(uint64_t) + sizeof(uint32_t)];
+    uint32_t chunk = DATA_CHUNK_MAX;
+    uint64_t offset = 0, total;
+    unsigned long length;
+    unsigned int id;
+    char *response;
+    int ret = 0;
+
+    response = malloc(sizeof(uint64_t) + DATA_CHUNK_MAX + 1);
+    if (response == NULL)
+    {
+        printf("Error: malloc() failed");
+        return -1;
+    }
+
+    do
+    {
+        memcpy(&request[0], &offset, sizeof(uint64_t));
+        memcpy(&request[sizeof(uint64_t)], &chunk, sizeof(uint32_t));
+
+        if ((submit_request(handle, GET_DATA, name, request, sizeof(request), &id) != 0) ||
+            (wait_response(handle, id, GET_DATA, response, timeout) != 0))
+        {
+            ret = -1;
+            break;
+        }
+
+        memcpy(&total, response, sizeof(uint64_t));
+        *size = total;
+        if (total > buffer_size)
+        {
+            tg_error = "Data does not fit in buffer";
+            ret = -1;
+            break;
+        }
+
+        length = (total - offset < chunk) ? total - offset : chunk;
+        memcpy((char *) buffer + offset, &response[sizeof(uint64_t)], length);
+        offset += length;
+    }
+    while (offset < total);
+
+    free(response);
+
+    return ret;
+}
+
+/*
+ * send_data() - Sets DATA variable in chunks
+ */
+
+int send_data(int handle,
+              const char *name,
+              void *buffer,
+              unsigned long size,
+              int timeout)
+{
+    uint64_t offset = 0, total = size;
+    unsigned long length;
+    char *request;
+    int ret = 0;
+
+    request = malloc(2 * sizeof(uint64_t) + DATA_CHUNK_MAX);
+    if (request == NULL)
+    {
+        printf("Error: malloc() failed");
+        return -1;
+    }
+
+    do
+    {
+        length = (total - offset < DATA_CHUNK_MAX) ? total - offset : DATA_CHUNK_MAX;
+
+        memcpy(&request[0], &offset, sizeof(uint64_t));
+        memcpy(&request[sizeof(uint64_t)], &total, sizeof(uint64_t));
+        memcpy(&request[2 * sizeof(uint64_t)], (char *) buffer + offset, length);
+
+        if (submit_message(handle, SET_DATA, name, NULL, request, 2 * sizeof(uint64_t) + length, timeout) != 0)
+        {
+            ret = -1;
+            break;
+        }
+
+        offset += length;
+    }
+    while (offset < total);
+
+    free(request);
+
+    return ret;
+}
+
+/*
+ * subscribe() - Subscribes to periodic samples of variables
+ *
+ * All variables must belong to the same plugin and the period, in
+ * microseconds, must be at least 1 ms. Samples are collected with
+ * wait_response() using the returned subscription ID and SAMPLES type.
+ */
+
+int subscribe(int handle,
+              unsigned int period,
+              const char **names,
+              int count,
+              unsigned int *subscription_id,
+              int timeout)
+{
+    char *payload;
+    int length = sizeof(unsigned int);
+    int i, ret;
+
+    for (i=0; i<count; i++)
+        length += 1 + strlen(names[i]);
+
+    payload = malloc(length);
+    if (payload == NULL)
+    {
+        printf("Error: malloc() failed");
+        return -1;
+    }
+
+    memcpy(payload, &period, sizeof(unsigned int));
+    length = sizeof(unsigned int);
+    for (i=0; i<count; i++)
+    {
+        payload[length] = strlen(names[i]);
+        memcpy(&payload[length + 1], names[i], strlen(names[i]));
+        length += 1 + strlen(names[i]);
+    }
+
+    ret = submit_message(handle, SUBSCRIBE, NULL, subscription_id, payload, length, timeout);
+
+    free(payload);
+
+    return ret;
+}
+
+int unsubscribe(int handle, unsigned int subscription_id, int timeout)
+{
+    return submit_message(handle, UNSUBSCRIBE, NULL, NULL, &subscription_id, sizeof(unsigned int), timeout);
+}
+
+/*
+ * batch_add() - Adds operation to batch request
+ *
+ * The operation is encoded as a request message and appended to the batch
+ * buffer, which is (re)allocated as needed. Start with *batch = NULL and
+ * *batch_length = 0, then send the batch with submit_message() as BATCH
+ * type.
+ */
+
+int batch_add(void **batch,
+              int *batch_length,
+              int type,
+              const char *name,
+              void *set_value,
+              int set_value_size)
+{
+    struct msg_header_t *message;
+    unsigned int index = 0;
+    char *operation;
+    char *buffer;
+    int offset;
+    int length;
+
+    // Operations are numbered in order
+    for (offset = 0; offset < *batch_length; index++)
+    {
+        message = (struct msg_header_t *) ((char *) *batch + offset);
+        offset += MSG_HEADER_SIZE + message->payload_length;
     }
 
-    id++;
+    length = create_message( (void *) &operation, type, name, set_value, set_value_size, index);
+    if (length < 0)
+        return -1;
+
+    buffer = realloc(*batch, *batch_length + length);
+    if (buffer == NULL)
+    {
+        printf("Error: malloc() failed");
+        free(operation);
+        return -1;
+    }
+
+    memcpy(&buffer[*batch_length], operation, length);
+    free(operation);
+
+    *batch = buffer;
+    *batch_length += length;
 
     return 0;
 }
 
+/*
+ * batch_get() - Gets result of operation from batch response
+ *
+ * Operations are indexed in the order they were added to the batch.
+ */
+
+int batch_get(void *responses,
+              unsigned int index,
+              int type,
+              void *get_value)
+{
+    struct msg_header_t *message;
+    char *payload;
+    char *p = responses;
+    unsigned int i;
+
+    // Find response of operation
+    for (i=0; i<index; i++)
+    {
+        message = (struct msg_header_t *) p;
+        p += MSG_HEADER_SIZE + message->payload_length;
+    }
+    message = (struct msg_header_t *) p;
+
+    if ((verify_response(message) != 0) || (message->id != index))
+    {
+        tg_error = "Received invalid batch response";
+        return -1;
+    }
+
+    // Decode from copy, strings are terminated in place
+    payload = malloc(message->payload_length + 1);
+    if (payload == NULL)
+    {
+        printf("Error: malloc() failed");
+        return -1;
+    }
+    memcpy(payload, &message->payload, message->payload_length);
+
+    if (message->type == RSP_OK)
+    {
+        if (message->payload_length > 0)
+            decode_value(payload, message->payload_length, type, get_value);
+        free(payload);
+        return 0;
+    }
+
+    payload[message->payload_length] = 0;
+    strncpy(error_message, payload, sizeof(error_message) - 1);
+    tg_error = error_message;
+    free(payload);
+
+    return -1;
+}
+
 #endif
 
 #ifdef SERVER
 
+static int verify_request(void *msg_buffer)
+{
+    struct msg_header_t *message;
+    message = msg_buffer;
+
+    // Verify message prefix
+    if (message->prefix != MSG_PREFIX)
+    {
+        printf("Error: Received invalid request message (invalid prefix)\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int decode_name(void *payload, void *name)
+{
+    unsigned char length;
+    char *p, *n;
+
+    p = payload;
+    length = p[0];
+
+    memcpy(name, &p[1], length);
+
+    // Terminate name string
+    n = name;
+    n[length] = 0;
+
+    return 0;
+}
+
 int decode_tg_string(char *string, char *plugin, char *variable)
 {
     int i;
@@ -585,153 +1147,1144 @@ int decode_tg_string(char *string, char *plugin, char *variable)
     return 0;
 }
 
-int handle_incoming_message(void)
-{
-    struct msg_header_t msg_header;
-    unsigned int id;
-    char *response_message;
-    char *payload;
-    int length, ret;
-    char name[MSG_NAME_LENGTH_MAX];
-    int response_type;
-    int response_size = 0;
-    char response_value[65536] = "";
-    char plugin_name[256] = "";
-    char variable_name[256] = "";
-
-    /* 1. Receive message (blocking)
-     * 1.1 Receive header length
-     * 1.2 Decode payload length
-     * 1.3 Allocate payload length memory
-     * 1.4 Receive payload length
-     * 2. Decode message
-     * 3. Execute request
-     * 4. Send response (blocking)
-     */
-
-    // Receive message header
-    if (msg_io->read(&msg_header, MSG_HEADER_SIZE) == 0)
-    {
-        printf("Client closed connection\n");
-        msg_io->close();
-        return 0;
-    }
+/*
+ * Message buffers are kept and reused for further messages, so steady
+ * state request handling does not allocate memory.
+ */
 
-    // Verify message header
-    verify_request(&msg_header);
+/* Reusable message buffer */
+struct message_buffer_t
+{
+    char *data;
+    unsigned int size;
+    int length; // Length of message in buffer (-1 if none)
+};
+
+static int reserve_message_buffer(struct message_buffer_t *buffer, unsigned int size)
+{
+    char *data;
+
+    if (size <= buffer->size)
+        return 0;
+
+    data = realloc(buffer->data, size);
+    if (data == NULL)
+    {
+        log_error("malloc() failed");
+        return -1;
+    }
+
+    buffer->data = data;
+    buffer->size = size;
+
+    return 0;
+}
+
+/*
+ * trim_message_buffer() - Releases room not used by message in buffer
+ */
+
+static void trim_message_buffer(struct message_buffer_t *buffer)
+{
+    char *data;
+
+    if ((buffer->length <= 0) || ((unsigned int) buffer->length == buffer->size))
+        return;
+
+    data = realloc(buffer->data, buffer->length);
+    if (data == NULL)
+        return;
+
+    buffer->data = data;
+    buffer->size = buffer->length;
+}
+
+/*
+ * buffer_message() - Encodes response type message into message buffer
+ */
+
+static int buffer_message(struct message_buffer_t *buffer, char type, void *value, int value_length, unsigned int id)
+{
+    buffer->length = -1;
+
+    if (reserve_message_buffer(buffer, MSG_HEADER_SIZE + value_length) == 0)
+        buffer->length = encode_message(buffer->data, type, NULL, value, value_length, id);
+
+    return buffer->length;
+}
+
+/*
+ * buffer_header() - Encodes header of response type message
+ *
+ * For payloads written directly into the message buffer.
+ */
+
+static int buffer_header(struct message_buffer_t *buffer, char type, unsigned int payload_length, unsigned int id)
+{
+    struct msg_header_t *message = (struct msg_header_t *) buffer->data;
+
+    message->prefix = MSG_PREFIX;
+    message->id = id;
+    message->type = type;
+    message->payload_length = payload_length;
+
+    buffer->length = MSG_HEADER_SIZE + payload_length;
+
+    return buffer->length;
+}
+
+/* Operation decoded from request message */
+struct operation_t
+{
+    unsigned char type;
+    char name[MSG_NAME_LENGTH_MAX];
+    char plugin_name[256];
+    char variable_name[256];
+    unsigned int handle;
+    unsigned int payload_length;
+    char *payload;
+    struct subscription_t *subscription;
+};
+
+struct batch_t;
+
+static void free_batch(struct batch_t *batch);
+static void batch_iov(struct batch_t *batch, struct message_buffer_t *header, struct client_message_t *message);
+
+/* State of request, claimed by either worker or deadline */
+enum request_state_t
+{
+    REQUEST_QUEUED,
+    REQUEST_STARTED,
+    REQUEST_EXPIRED,            // Answered with error, not executed
+};
+
+/* Request being executed by worker thread */
+struct request_t
+{
+    struct job_t job;
+    struct event_call_t completion;
+    struct client_t *client;
+    unsigned int id;
+    struct operation_t operation;
+    struct batch_t *batch;
+    struct message_buffer_t response;
+    struct client_message_t message;
+    struct iovec iov;
+    struct wheel_timer_t deadline;
+    int state;                  // enum request_state_t
+    bool executed;
+    bool expiry_queued;
+    struct message_buffer_t expiry;
+    struct client_message_t expiry_message;
+    struct iovec expiry_iov;
+    unsigned int payload_length;
+    unsigned int payload_size;
+    char *payload;
+    struct request_t *next; // Next free request in pool of client
+};
+
+/*
+ * Each client keeps a pool of requests including their payload and
+ * response buffers. Requests are taken from and returned to the pool by the
+ * event loop thread owning the client only. Requests with large buffers
+ * are not kept.
+ */
+
+#define REQUEST_POOL_MAX 64
+#define REQUEST_POOL_BUFFER_MAX (MSG_HEADER_SIZE + 65536)
+
+static void free_request(struct request_t *request)
+{
+    free(request->payload);
+    free(request->response.data);
+    free(request->expiry.data);
+    free(request);
+}
 
-    id = msg_header.id;
+static struct request_t * alloc_request(struct client_t *client, unsigned int payload_length)
+{
+    struct request_t *request;
+    char *payload;
+
+    request = client->request_pool;
+    if (request != NULL)
+    {
+        client->request_pool = request->next;
+        client->request_pool_count--;
+    }
+    else
+    {
+        request = calloc(1, sizeof(struct request_t));
+        if (request == NULL)
+            return NULL;
+    }
 
-    if (msg_header.type != LIST_PLUGINS)
+    // Make room for zero terminated payload
+    if (payload_length + 1 > request->payload_size)
     {
-        // Allocate memory for payload buffer
-        payload = malloc(msg_header.payload_length);
+        payload = realloc(request->payload, payload_length + 1);
         if (payload == NULL)
         {
-            printf("Error: malloc() failed");
-            return -1;
+            free_request(request);
+            return NULL;
         }
+        request->payload = payload;
+        request->payload_size = payload_length + 1;
+    }
 
-        // Receive payload
-        if (msg_io->read(payload, msg_header.payload_length) == 0)
-        {
-            printf("Client closed connection\n");
-            msg_io->close();
-            free(payload);
-            return 0;
-        }
+    return request;
+}
+
+static void release_request(struct client_t *client, struct request_t *request)
+{
+    free_batch(request->batch);
+    request->batch = NULL;
+
+    if ((client->request_pool_count >= REQUEST_POOL_MAX) ||
+        (request->payload_size > REQUEST_POOL_BUFFER_MAX) ||
+        (request->response.size > REQUEST_POOL_BUFFER_MAX))
+    {
+        free_request(request);
+        return;
     }
 
-    debug_printf("Received message (id = %d, type = %s, payload size = %d)\n", msg_header.id, message_type(msg_header.type), msg_header.payload_length);
+    request->next = client->request_pool;
+    client->request_pool = request;
+    client->request_pool_count++;
+}
+
+/*
+ * free_request_pool() - Frees pooled requests of client
+ */
+
+void free_request_pool(struct client_t *client)
+{
+    struct request_t *request;
 
-    if (msg_header.type != LIST_PLUGINS)
+    while ((request = client->request_pool) != NULL)
     {
-        // Decode name part of payload (eg. "fb.xres")
-        decode_name(payload, &name);
+        client->request_pool = request->next;
+        free_request(request);
     }
+    client->request_pool_count = 0;
+}
+
+static int handle_received_messages(struct client_t *client);
+static int start_subscription(struct client_t *client, struct subscription_t *subscription);
+static void free_subscription(struct subscription_t *subscription);
+
+static void response_sent(struct client_t *client, void *data)
+{
+    release_request(client, data);
+}
 
-    // For all message types except plugin load/unload/list
-    if ((msg_header.type != PLUGIN_LOAD) && 
-        (msg_header.type != PLUGIN_UNLOAD) &&
-        (msg_header.type != LIST_PLUGINS))
+/*
+ * send_response() - Queues response message of request
+ *
+ * The request is released once the response has been sent. Batch
+ * responses are sent as the response header followed by the responses of
+ * the operations.
+ */
+
+static void send_response(struct client_t *client, struct request_t *request)
+{
+    if (request->response.length < 0)
     {
-        // Decode plugin name and variable name
-        decode_tg_string(name, (char *) &plugin_name, (char *) &variable_name);
+        release_request(client, request);
+        return;
     }
 
-    // Decode message and execute request
-    switch (msg_header.type)
+    debug_printf("Sending response message with ID %d\n", request->id);
+
+    if (request->batch != NULL)
+        batch_iov(request->batch, &request->response, &request->message);
+    else
     {
-        case LIST_PLUGINS:
-            debug_printf("LIST_PLUGINS()\n");
-            if (list_plugins((char *) &response_value))
-            {
-                response_type = RSP_ERROR;
-                sprintf(response_value, "Failed to list plugins");
-                response_size = strlen(response_value) + 1;
-            }
-            else
+        request->iov.iov_base = request->response.data;
+        request->iov.iov_len = request->response.length;
+        request->message.iov = &request->iov;
+        request->message.iov_count = 1;
+    }
+    request->message.release = &response_sent;
+    request->message.data = request;
+
+    client_send(client, &request->message);
+}
+
+/*
+ * Requests may have a deadline (option request_timeout). A request not
+ * started by then is answered with an error right away, sent from its own
+ * buffer, and is skipped by the worker. Whichever of worker and deadline
+ * comes first claims the request, so a request is never answered with a
+ * timeout after its operation has been started. The request is released
+ * once the worker is done with it and the error has been sent.
+ */
+
+static bool claim_request(struct request_t *request, int state)
+{
+    int queued = REQUEST_QUEUED;
+
+    return __atomic_compare_exchange_n(&request->state, &queued, state, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static void expiry_sent(struct client_t *client, void *data)
+{
+    struct request_t *request = data;
+
+    request->expiry_queued = false;
+
+    if (request->executed)
+        release_request(client, request);
+}
+
+/*
+ * request_expired() - Answers request not started in time with error
+ */
+
+static void request_expired(void *data)
+{
+    struct request_t *request = data;
+    struct client_t *client = request->client;
+
+    if (!client->connected)
+        return;
+
+    if (buffer_message(&request->expiry, RSP_ERROR, "Request timed out", strlen("Request timed out") + 1, request->id) < 0)
+        return;
+
+    // Request being executed is answered by its result
+    if (!claim_request(request, REQUEST_EXPIRED))
+        return;
+
+    debug_printf("Request with ID %d timed out\n", request->id);
+
+    request->expiry_iov.iov_base = request->expiry.data;
+    request->expiry_iov.iov_len = request->expiry.length;
+    request->expiry_message.iov = &request->expiry_iov;
+    request->expiry_message.iov_count = 1;
+    request->expiry_message.release = &expiry_sent;
+    request->expiry_message.data = request;
+    request->expiry_queued = true;
+
+    client_send(client, &request->expiry_message);
+    client_schedule_flush(client);
+}
+
+/*
+ * start_deadline() - Starts deadline of request submitted for execution
+ */
+
+static void start_deadline(struct client_t *client, struct request_t *request)
+{
+    if (option.request_timeout <= 0)
+        return;
+
+    request->deadline.callback = &request_expired;
+    request->deadline.data = request;
+    event_timer_start(client->loop, &request->deadline, option.request_timeout);
+}
+
+/*
+ * complete_request() - Sends response of executed request
+ *
+ * Runs in the event loop thread owning the client once the worker has
+ * finished the request. Responses are sent in the order requests complete.
+ */
+
+static void complete_request(void *data)
+{
+    struct request_t *request = data;
+    struct client_t *client = request->client;
+
+    client->pending--;
+    event_timer_stop(client->loop, &request->deadline);
+
+    if (request->state == REQUEST_EXPIRED)
+    {
+        // Client has already been answered
+        if (request->operation.subscription != NULL)
+            free_subscription(request->operation.subscription);
+
+        request->executed = true;
+        if (!request->expiry_queued)
+            release_request(client, request);
+    }
+    else
+    {
+        if (request->operation.subscription != NULL)
+        {
+            // Start sampling before confirming the subscription
+            if (!client->connected || (start_subscription(client, request->operation.subscription) != 0))
             {
-                response_type = RSP_OK;
-                response_size = strlen(response_value);
+                free_subscription(request->operation.subscription);
+                buffer_message(&request->response, RSP_ERROR, "Failed to start subscription", strlen("Failed to start subscription") + 1, request->id);
             }
-            break;
+        }
+
+        if (client->connected)
+            send_response(client, request);
+        else
+            release_request(client, request);
+    }
+
+    if (client->connected)
+    {
+        // Continue with requests held back while client was congested
+        handle_received_messages(client);
+    }
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * decode_operation() - Decodes names or handle of operation
+ *
+ * The payload must stay valid and zero terminated while the operation is
+ * executed.
+ */
+
+static int decode_operation(struct operation_t *operation, unsigned char type, char *payload, unsigned int payload_length)
+{
+    operation->type = type;
+    operation->name[0] = 0;
+    operation->plugin_name[0] = 0;
+    operation->variable_name[0] = 0;
+    operation->handle = 0;
+    operation->payload_length = payload_length;
+    operation->payload = payload;
+    operation->subscription = NULL;
+
+    if (type == SUBSCRIBE)
+    {
+        // Verify that period and first name fit in payload
+        if ((payload_length < sizeof(unsigned int) + 1) ||
+            ((unsigned char) payload[4] >= payload_length - sizeof(unsigned int)))
+            return -1;
+
+        // Plugin of first variable is the plugin of the subscription
+        decode_name(&payload[4], operation->name);
+        decode_tg_string(operation->name, operation->plugin_name, operation->variable_name);
+    }
+    else if ((type == GET_HANDLE) || (type == SET_HANDLE))
+    {
+        // Verify that handle fits in payload
+        if (payload_length < sizeof(unsigned int))
+            return -1;
+
+        // Operations by handle skip name decoding, only the plugin name is
+        // needed to execute them in order with other requests for the plugin
+        memcpy(&operation->handle, payload, sizeof(unsigned int));
+        plugin_handle_name(operation->handle, operation->plugin_name);
+    }
+    else if (type != LIST_PLUGINS)
+    {
+        // Verify that name fits in payload
+        if ((payload_length < 1) ||
+            ((unsigned char) payload[0] >= payload_length))
+            return -1;
+
+        // Decode name part of payload (eg. "fb.xres")
+        decode_name(payload, operation->name);
+
+        // For all message types except plugin load/unload/reload
+        if ((type != PLUGIN_LOAD) &&
+            (type != PLUGIN_UNLOAD) &&
+            (type != PLUGIN_RELOAD))
+        {
+            // Decode plugin name and variable name
+            decode_tg_string(operation->name, operation->plugin_name, operation->variable_name);
+        }
+        else
+        {
+            // Plugin name without plugin file of instance (eg. "psu0=psu")
+            strcpy(operation->plugin_name, operation->name);
+            operation->plugin_name[strcspn(operation->plugin_name, "=")] = 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * operation_strand() - Returns name of strand executing operation
+ *
+ * Operations on the same plugin are executed in order, one at a time.
+ */
 
+static const char * operation_strand(struct operation_t *operation)
+{
+    switch (operation->type)
+    {
+        case LIST_PLUGINS:
+            return NULL;
         case PLUGIN_LOAD:
-            debug_printf("PLUGIN_LOAD(%s)\n", name);
-            if (plugin_load(name))
-            {
-                response_type = RSP_ERROR;
-                sprintf(response_value, "Failed to load %s plugin", name);
-                response_size = strlen(response_value) + 1;
-            }
-            else
-                response_type = RSP_OK;
-            break;
         case PLUGIN_UNLOAD:
-            debug_printf("PLUGIN_UNLOAD(%s)\n", name);
-            if (plugin_unload(name))
-            {
-                response_type = RSP_ERROR;
-                sprintf(response_value, "Failed to unload %s plugin", name);
-                response_size = strlen(response_value) + 1;
-            }
-            else
-                response_type = RSP_OK;
-            break;
-        case PLUGIN_LIST_PROPERTIES:
-            debug_printf("PLUGIN_LIST_PROPERTIES()\n");
-            if (plugin_list_properties(plugin_name, (char *) &response_value))
-            {
-                response_type = RSP_ERROR;
-                sprintf(response_value, "Failed to list plugin properties");
-                response_size = strlen(response_value) + 1;
-            }
-            else
-            {
-                response_type = RSP_OK;
-                response_size = strlen(response_value);
-            }
-            break;
-        case GET_CHAR:
-            debug_printf("GET_CHAR(%s)\n", name);
-            if (plugin_get_char(plugin_name, variable_name, (char *) response_value) == 0)
-            {
-                response_type = RSP_OK;
-                response_size = sizeof(char);
-            }
-            else
-            {
-                response_type = RSP_ERROR;
-                sprintf(response_value, "Variable %s of char type not found", name);
-                response_size = strlen(response_value) + 1;
-            }
-            break;
-        case GET_SHORT:
-            debug_printf("GET_SHORT(%s)\n", name);
-            if (plugin_get_short(plugin_name, variable_name, (short *) response_value) == 0)
-            {
-                response_type = RSP_OK;
+            return operation->plugin_name;
+        case PLUGIN_RELOAD:
+            // Requests for the plugin are executed while it is reloaded
+            return NULL;
+        case GET_HANDLE:
+        case SET_HANDLE:
+            if (operation->plugin_name[0] == 0)
+                return NULL;
+            return operation->plugin_name;
+        default:
+            return operation->plugin_name;
+    }
+}
+
+/*
+ * === Subscriptions ===
+ *
+ * A subscription samples variables of one plugin periodically. A timer in
+ * the event loop of the client submits a sample job to the strand of the
+ * plugin, which reads the variables by handle and hands the SAMPLES message
+ * back to the event loop. Only one sample per subscription is taken and sent
+ * at a time and samples are skipped while the client is congested.
+ */
+
+#define SUBSCRIPTION_VARIABLES_MAX 256
+#define SUBSCRIPTION_PERIOD_MIN 1000 // Microseconds
+#define SAMPLE_VALUE_MAX 65536
+
+struct subscription_t
+{
+    struct job_t job;
+    struct event_call_t completion;
+    struct event_handler_t timer;
+    struct client_t *client;
+    unsigned int id;
+    unsigned int period;
+    char plugin_name[256];
+    bool sampling;  // Sample job in flight
+    bool sending;   // Sample message queued for transmission
+    bool cancelled; // Free when sample job completes and sample is sent
+    bool failed;
+    struct message_buffer_t message;
+    struct client_message_t transmission;
+    struct iovec iov;
+    struct subscription_t *next;
+    unsigned int count;
+    unsigned int handles[];
+};
+
+/*
+ * create_subscription() - Creates subscription from SUBSCRIBE operation
+ *
+ * Runs in a worker thread on the strand of the plugin. Variable names are
+ * resolved to handles once. On failure NULL is returned and the reason is
+ * written to error.
+ */
+
+static struct subscription_t * create_subscription(struct operation_t *operation, unsigned int id, char *error)
+{
+    struct subscription_t *subscription;
+    char *payload = operation->payload;
+    char name[MSG_NAME_LENGTH_MAX];
+    char plugin_name[256];
+    char variable_name[256];
+    unsigned int offset, count = 0;
+    unsigned int period;
+    unsigned int i;
+
+    memcpy(&period, payload, sizeof(unsigned int));
+
+    // Count variables
+    for (offset = sizeof(unsigned int); offset < operation->payload_length; count++)
+    {
+        if ((unsigned char) payload[offset] >= operation->payload_length - offset)
+        {
+            sprintf(error, "Invalid subscription");
+            return NULL;
+        }
+        offset += 1 + (unsigned char) payload[offset];
+    }
+
+    if ((period < SUBSCRIPTION_PERIOD_MIN) || (count > SUBSCRIPTION_VARIABLES_MAX))
+    {
+        sprintf(error, "Invalid subscription");
+        return NULL;
+    }
+
+    subscription = calloc(1, sizeof(struct subscription_t) + count * sizeof(unsigned int));
+    if (subscription == NULL)
+    {
+        sprintf(error, "Out of memory");
+        return NULL;
+    }
+
+    subscription->id = id;
+    subscription->period = period;
+    strcpy(subscription->plugin_name, operation->plugin_name);
+    subscription->count = count;
+
+    // Resolve variables
+    for (offset = sizeof(unsigned int), i = 0; i < count; i++)
+    {
+        decode_name(&payload[offset], name);
+        offset += 1 + (unsigned char) payload[offset];
+
+        decode_tg_string(name, plugin_name, variable_name);
+        if (strcmp(plugin_name, subscription->plugin_name) != 0)
+        {
+            sprintf(error, "Variables of subscription must belong to one plugin");
+            free(subscription);
+            return NULL;
+        }
+
+        if (plugin_resolve(plugin_name, variable_name, &subscription->handles[i]) != 0)
+        {
+            sprintf(error, "Variable %s not found", name);
+            free(subscription);
+            return NULL;
+        }
+    }
+
+    return subscription;
+}
+
+static void free_subscription(struct subscription_t *subscription)
+{
+    free(subscription->message.data);
+    free(subscription);
+}
+
+/*
+ * cancel_subscription() - Stops sampling and removes subscription
+ */
+
+static void cancel_subscription(struct subscription_t *subscription)
+{
+    struct subscription_t **p;
+
+    for (p = &subscription->client->subscriptions; *p != subscription; p = &(*p)->next);
+    *p = subscription->next;
+
+    event_remove(subscription->client->loop, &subscription->timer);
+    close(subscription->timer.fd);
+
+    if (subscription->sampling || subscription->sending)
+        subscription->cancelled = true;
+    else
+        free_subscription(subscription);
+}
+
+/*
+ * cancel_subscriptions() - Cancels all subscriptions of client
+ */
+
+void cancel_subscriptions(struct client_t *client)
+{
+    while (client->subscriptions != NULL)
+        cancel_subscription(client->subscriptions);
+}
+
+/*
+ * sample_subscription() - Samples variables of subscription
+ *
+ * Runs in a worker thread on the strand of the plugin.
+ */
+
+static void sample_subscription(struct job_t *job)
+{
+    struct subscription_t *subscription = (struct subscription_t *) job;
+    struct timespec now;
+    uint64_t timestamp;
+    unsigned int length;
+    unsigned int i;
+    int capacity;
+    int size;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+    // Values are written straight into the reused message buffer
+    memcpy(&subscription->message.data[MSG_HEADER_SIZE], &timestamp, sizeof(uint64_t));
+    length = sizeof(uint64_t);
+
+    for (i=0; i<subscription->count; i++)
+    {
+        // Values are read in place, ending the subscription if one does not fit
+        capacity = (MSG_PAYLOAD_MAX - length < SAMPLE_VALUE_MAX) ? MSG_PAYLOAD_MAX - length : SAMPLE_VALUE_MAX;
+        if ((reserve_message_buffer(&subscription->message, MSG_HEADER_SIZE + length + capacity) != 0) ||
+            (plugin_get_handle(subscription->handles[i], &subscription->message.data[MSG_HEADER_SIZE + length],
+                               &size, capacity) != 0))
+        {
+            subscription->failed = true;
+            break;
+        }
+
+        length += size;
+    }
+
+    if (subscription->failed)
+        buffer_message(&subscription->message, RSP_ERROR, "Subscription ended", strlen("Subscription ended") + 1, subscription->id);
+    else
+        buffer_header(&subscription->message, SAMPLES, length, subscription->id);
+
+    // Hand sample back to event loop of client
+    event_post(subscription->client->loop, &subscription->completion);
+}
+
+static void sample_sent(struct client_t *client, void *data)
+{
+    struct subscription_t *subscription = data;
+
+    subscription->sending = false;
+
+    if (subscription->cancelled)
+        free_subscription(subscription);
+}
+
+/*
+ * complete_sample() - Sends sample to client
+ */
+
+static void complete_sample(void *data)
+{
+    struct subscription_t *subscription = data;
+    struct client_t *client = subscription->client;
+
+    client->pending--;
+    subscription->sampling = false;
+
+    if (subscription->cancelled)
+        free_subscription(subscription);
+    else
+    {
+        if (client->connected && (subscription->message.length >= 0))
+        {
+            subscription->iov.iov_base = subscription->message.data;
+            subscription->iov.iov_len = subscription->message.length;
+            subscription->transmission.iov = &subscription->iov;
+            subscription->transmission.iov_count = 1;
+            subscription->transmission.release = &sample_sent;
+            subscription->transmission.data = subscription;
+            subscription->sending = true;
+            client_send(client, &subscription->transmission);
+        }
+
+        if (subscription->failed && client->connected)
+            cancel_subscription(subscription);
+    }
+
+    if (client->connected)
+        handle_received_messages(client);
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * subscription_timer() - Starts taking sample when timer expires
+ */
+
+static void subscription_timer(int fd, unsigned int events, void *data)
+{
+    struct subscription_t *subscription = data;
+    struct client_t *client = subscription->client;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(uint64_t)) < 0)
+        return;
+
+    if (subscription->sampling || subscription->sending ||
+        !client->connected || client_congested(client))
+    {
+        debug_printf("Skipping sample of subscription %d\n", subscription->id);
+        return;
+    }
+
+    // Sample is skipped if it can not be submitted
+    if (worker_submit(subscription->plugin_name, &subscription->job) != 0)
+        return;
+
+    subscription->sampling = true;
+    client->pending++;
+}
+
+/*
+ * start_subscription() - Starts sampling for client
+ *
+ * Runs in the event loop thread owning the client.
+ */
+
+static int start_subscription(struct client_t *client, struct subscription_t *subscription)
+{
+    struct itimerspec timer;
+    int fd;
+
+    if (reserve_message_buffer(&subscription->message, MSG_HEADER_SIZE + sizeof(uint64_t) + subscription->count * sizeof(double)))
+        return -1;
+
+    fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+    {
+        log_error("timerfd_create() failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    timer.it_interval.tv_sec = subscription->period / 1000000;
+    timer.it_interval.tv_nsec = (subscription->period % 1000000) * 1000;
+    timer.it_value = timer.it_interval;
+    timerfd_settime(fd, 0, &timer, NULL);
+
+    subscription->job.function = &sample_subscription;
+    subscription->completion.callback = &complete_sample;
+    subscription->completion.data = subscription;
+    subscription->timer.fd = fd;
+    subscription->timer.callback = &subscription_timer;
+    subscription->timer.data = subscription;
+    subscription->client = client;
+
+    if (event_add(client->loop, &subscription->timer, EPOLLIN))
+    {
+        close(fd);
+        return -1;
+    }
+
+    subscription->next = client->subscriptions;
+    client->subscriptions = subscription;
+
+    return 0;
+}
+
+/*
+ * handle_unsubscribe() - Cancels subscription of client
+ */
+
+static void handle_unsubscribe(struct client_t *client, struct request_t *request)
+{
+    struct subscription_t *subscription;
+    char response_value[64];
+    unsigned int id;
+
+    memcpy(&id, request->payload, sizeof(unsigned int));
+
+    debug_printf("UNSUBSCRIBE(%d)\n", id);
+
+    for (subscription = client->subscriptions; subscription != NULL; subscription = subscription->next)
+    {
+        if (subscription->id == id)
+            break;
+    }
+
+    if (subscription != NULL)
+    {
+        cancel_subscription(subscription);
+        buffer_message(&request->response, RSP_OK, response_value, 0, request->id);
+    }
+    else
+    {
+        sprintf(response_value, "Subscription %u not found", id);
+        buffer_message(&request->response, RSP_ERROR, response_value, strlen(response_value) + 1, request->id);
+    }
+
+    send_response(client, request);
+}
+
+/*
+ * execute_get_data() - Executes GET_DATA operation
+ *
+ * The chunk is copied by the plugin straight into the response message.
+ * Returns length of response message or -1 on failure.
+ */
+
+static int execute_get_data(struct operation_t *operation, unsigned int id, struct message_buffer_t *response)
+{
+    unsigned int name_length = (unsigned char) operation->payload[0];
+    unsigned long length, size;
+    uint64_t offset, total;
+    uint32_t chunk;
+
+    if (operation->payload_length < 1 + name_length + sizeof(uint64_t) + sizeof(uint32_t))
+        return -1;
+
+    memcpy(&offset, &operation->payload[1 + name_length], sizeof(uint64_t));
+    memcpy(&chunk, &operation->payload[1 + name_length + sizeof(uint64_t)], sizeof(uint32_t));
+    if (chunk > DATA_CHUNK_MAX)
+        chunk = DATA_CHUNK_MAX;
+
+    if (reserve_message_buffer(response, MSG_HEADER_SIZE + sizeof(uint64_t) + chunk))
+        return -1;
+
+    length = chunk;
+    if (plugin_get_data(operation->plugin_name, operation->variable_name, offset,
+                        &response->data[MSG_HEADER_SIZE + sizeof(uint64_t)], &length, &size) != 0)
+        return -1;
+
+    total = size;
+    memcpy(&response->data[MSG_HEADER_SIZE], &total, sizeof(uint64_t));
+
+    return buffer_header(response, RSP_OK, sizeof(uint64_t) + length, id);
+}
+
+/*
+ * execute_set_data() - Executes SET_DATA operation
+ *
+ * The chunk is copied by the plugin straight from the request message.
+ */
+
+static int execute_set_data(struct operation_t *operation)
+{
+    unsigned int name_length = (unsigned char) operation->payload[0];
+    unsigned int header_length = 1 + name_length + 2 * sizeof(uint64_t);
+    uint64_t offset, size;
+
+    if (operation->payload_length < header_length)
+        return -1;
+
+    memcpy(&offset, &operation->payload[1 + name_length], sizeof(uint64_t));
+    memcpy(&size, &operation->payload[1 + name_length + sizeof(uint64_t)], sizeof(uint64_t));
+
+    return plugin_set_data(operation->plugin_name, operation->variable_name, offset,
+                           &operation->payload[header_length], operation->payload_length - header_length, size);
+}
+
+/*
+ * === Metadata cache ===
+ *
+ * Responses listing plugins and properties and describing properties only
+ * change when plugins are loaded or unloaded or the plugin directory
+ * changes, so they are cached as complete encoded messages in a direct
+ * mapped table keyed by message type and name. Entries are tagged with the
+ * plugin generation read before the response was created and are only used
+ * while the generation is unchanged. A cached message is copied into the
+ * response buffer with the ID of the request patched into its header.
+ */
+
+#define METADATA_CACHE_SIZE 1024 // Entries (power of 2)
+
+struct metadata_entry_t
+{
+    unsigned char type;
+    unsigned int generation;
+    char name[MSG_NAME_LENGTH_MAX];
+    struct message_buffer_t message;
+};
+
+static struct metadata_entry_t metadata_cache[METADATA_CACHE_SIZE];
+static pthread_rwlock_t metadata_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static bool metadata_cacheable(struct operation_t *operation)
+{
+    switch (operation->type)
+    {
+        case LIST_PLUGINS:
+            // Files may be added without anyone noticing
+            return plugin_directory_watched();
+        case PLUGIN_LIST_PROPERTIES:
+        case DESCRIBE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static struct metadata_entry_t * metadata_entry(struct operation_t *operation)
+{
+    unsigned int hash = hash_string(operation->name) ^ (operation->type * 2654435761u);
+
+    return &metadata_cache[hash & (METADATA_CACHE_SIZE - 1)];
+}
+
+/*
+ * metadata_lookup() - Creates response message from metadata cache
+ *
+ * Returns length of response message or -1 if not cached.
+ */
+
+static int metadata_lookup(struct operation_t *operation, unsigned int generation,
+                           unsigned int id, struct message_buffer_t *response)
+{
+    struct metadata_entry_t *entry = metadata_entry(operation);
+    int length = -1;
+
+    pthread_rwlock_rdlock(&metadata_lock);
+    if ((entry->message.length > 0) && (entry->type == operation->type) &&
+        (entry->generation == generation) && (strcmp(entry->name, operation->name) == 0) &&
+        (reserve_message_buffer(response, entry->message.length) == 0))
+    {
+        length = entry->message.length;
+        memcpy(response->data, entry->message.data, length);
+        ((struct msg_header_t *) response->data)->id = id;
+        response->length = length;
+    }
+    pthread_rwlock_unlock(&metadata_lock);
+
+    return length;
+}
+
+static void metadata_store(struct operation_t *operation, unsigned int generation,
+                           struct message_buffer_t *response)
+{
+    struct metadata_entry_t *entry = metadata_entry(operation);
+
+    pthread_rwlock_wrlock(&metadata_lock);
+    if (reserve_message_buffer(&entry->message, response->length) == 0)
+    {
+        memcpy(entry->message.data, response->data, response->length);
+        entry->message.length = response->length;
+        entry->type = operation->type;
+        entry->generation = generation;
+        strcpy(entry->name, operation->name);
+    }
+    pthread_rwlock_unlock(&metadata_lock);
+}
+
+/*
+ * response_capacity() - Returns room needed for value of operation response
+ *
+ * Operations answered with plugin defined strings or values get room for the
+ * largest value, all other responses carry at most a scalar or an error
+ * message.
+ */
+
+#define RESPONSE_VALUE_MAX 65536
+#define RESPONSE_ERROR_MAX 512
+
+static unsigned int response_capacity(unsigned char type)
+{
+    switch (type)
+    {
+        case LIST_PLUGINS:
+        case PLUGIN_LIST_PROPERTIES:
+        case GET_STRING:
+        case DESCRIBE:
+        case GET_HANDLE:
+            return RESPONSE_VALUE_MAX;
+        default:
+            return RESPONSE_ERROR_MAX;
+    }
+}
+
+/*
+ * execute_operation() - Executes operation and creates response message
+ *
+ * Returns length of response message or -1 if it could not be created.
+ */
+
+static int execute_operation(struct operation_t *operation, unsigned int id, struct message_buffer_t *response)
+{
+    char *payload = operation->payload;
+    char *name = operation->name;
+    char *plugin_name = operation->plugin_name;
+    char *variable_name = operation->variable_name;
+    int response_type;
+    int response_size = 0;
+    char *response_value;
+    unsigned int capacity;
+    bool cacheable = metadata_cacheable(operation);
+    unsigned int generation = 0;
+    int length;
+
+    if (cacheable)
+    {
+        generation = plugin_generation();
+        length = metadata_lookup(operation, generation, id, response);
+        if (length > 0)
+            return length;
+    }
+
+    // Value is written straight into the response after room for the header
+    capacity = response_capacity(operation->type);
+    if (reserve_message_buffer(response, MSG_HEADER_SIZE + capacity))
+    {
+        response->length = -1;
+        return -1;
+    }
+    response_value = &response->data[MSG_HEADER_SIZE];
+
+    // Only the start of the value buffer needs to be initialized
+    response_value[0] = 0;
+
+    // Execute request
+    switch (operation->type)
+    {
+        case LIST_PLUGINS:
+            debug_printf("LIST_PLUGINS()\n");
+            if (list_plugins(response_value, capacity))
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Failed to list plugins");
+                response_size = strlen(response_value) + 1;
+            }
+            else
+            {
+                response_type = RSP_OK;
+                response_size = strlen(response_value);
+            }
+            break;
+
+        case PLUGIN_LOAD:
+            debug_printf("PLUGIN_LOAD(%s)\n", name);
+            if (plugin_load(name))
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Failed to load %s plugin", name);
+                response_size = strlen(response_value) + 1;
+            }
+            else
+                response_type = RSP_OK;
+            break;
+        case PLUGIN_UNLOAD:
+            debug_printf("PLUGIN_UNLOAD(%s)\n", name);
+            if (plugin_unload(name))
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Failed to unload %s plugin", name);
+                response_size = strlen(response_value) + 1;
+            }
+            else
+                response_type = RSP_OK;
+            break;
+        case PLUGIN_RELOAD:
+            debug_printf("PLUGIN_RELOAD(%s)\n", name);
+            if (plugin_reload(name))
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Failed to reload %s plugin", name);
+                response_size = strlen(response_value) + 1;
+            }
+            else
+                response_type = RSP_OK;
+            break;
+        case PLUGIN_LIST_PROPERTIES:
+            debug_printf("PLUGIN_LIST_PROPERTIES()\n");
+            if (plugin_list_properties(plugin_name, response_value, capacity))
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Failed to list plugin properties");
+                response_size = strlen(response_value) + 1;
+            }
+            else
+            {
+                response_type = RSP_OK;
+                response_size = strlen(response_value);
+            }
+            break;
+        case GET_CHAR:
+            debug_printf("GET_CHAR(%s)\n", name);
+            if (plugin_get_char(plugin_name, variable_name, (char *) response_value) == 0)
+            {
+                response_type = RSP_OK;
+                response_size = sizeof(char);
+            }
+            else
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Variable %s of char type not found", name);
+                response_size = strlen(response_value) + 1;
+            }
+            break;
+        case GET_SHORT:
+            debug_printf("GET_SHORT(%s)\n", name);
+            if (plugin_get_short(plugin_name, variable_name, (short *) response_value) == 0)
+            {
+                response_type = RSP_OK;
                 response_size = sizeof(short);
             }
             else
@@ -799,7 +2352,7 @@ int handle_incoming_message(void)
             break;
         case GET_STRING:
             debug_printf("GET_STRING(%s)\n", name);
-            if (plugin_get_string(plugin_name, variable_name, (char *) &response_value) == 0)
+            if (plugin_get_string(plugin_name, variable_name, response_value, capacity) == 0)
                 response_type = RSP_OK;
             else
             {
@@ -809,6 +2362,13 @@ int handle_incoming_message(void)
             response_size = strlen(response_value) + 1;
             break;
         case GET_DATA:
+            debug_printf("GET_DATA(%s)\n", name);
+            if (execute_get_data(operation, id, response) >= 0)
+                return response->length;
+            response_value = &response->data[MSG_HEADER_SIZE];
+            response_type = RSP_ERROR;
+            sprintf(response_value, "Variable %s of data type not found or invalid offset", name);
+            response_size = strlen(response_value) + 1;
             break;
         case SET_CHAR:
             debug_printf("SET_CHAR(%s)\n", name);
@@ -895,53 +2455,733 @@ int handle_incoming_message(void)
             }
             break;
         case SET_DATA:
+            debug_printf("SET_DATA(%s)\n", name);
+            if (execute_set_data(operation) == 0)
+                response_type = RSP_OK;
+            else
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Variable %s of data type not found or invalid chunk", name);
+                response_size = strlen(response_value) + 1;
+            }
+            break;
+        case RUN:
+            debug_printf("RUN(%s)\n", name);
+            if (plugin_run(plugin_name, variable_name, (int *) response_value) == 0)
+            {
+                response_type = RSP_OK;
+                response_size = sizeof(int);
+            }
+            else
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Command %s not found", name);
+                response_size = strlen(response_value) + 1;
+            }
+            break;
+        case DESCRIBE:
+            debug_printf("DESCRIBE(%s)\n", name);
+            if (plugin_describe(plugin_name, variable_name, response_value, capacity) == 0)
+                response_type = RSP_OK;
+            else
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Variable or command %s not found", name);
+            }
+            response_size = strlen(response_value) + 1;
+            break;
+        case SUBSCRIBE:
+            debug_printf("SUBSCRIBE(%s)\n", name);
+            operation->subscription = create_subscription(operation, id, response_value);
+            if (operation->subscription != NULL)
+            {
+                response_type = RSP_OK;
+                memcpy(response_value, &id, sizeof(unsigned int));
+                response_size = sizeof(unsigned int);
+            }
+            else
+            {
+                response_type = RSP_ERROR;
+                response_size = strlen(response_value) + 1;
+            }
+            break;
+        case RESOLVE:
+            debug_printf("RESOLVE(%s)\n", name);
+            if (plugin_resolve(plugin_name, variable_name, (unsigned int *) response_value) == 0)
+            {
+                response_type = RSP_OK;
+                response_size = sizeof(unsigned int);
+            }
+            else
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Variable %s not found", name);
+                response_size = strlen(response_value) + 1;
+            }
+            break;
+        case GET_HANDLE:
+            debug_printf("GET_HANDLE(%x)\n", operation->handle);
+            if (plugin_get_handle(operation->handle, response_value, &response_size, capacity) == 0)
+                response_type = RSP_OK;
+            else
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Invalid handle %x", operation->handle);
+                response_size = strlen(response_value) + 1;
+            }
+            break;
+        case SET_HANDLE:
+            debug_printf("SET_HANDLE(%x)\n", operation->handle);
+            if (plugin_set_handle(operation->handle, &payload[4], operation->payload_length - 4) == 0)
+                response_type = RSP_OK;
+            else
+            {
+                response_type = RSP_ERROR;
+                sprintf(response_value, "Invalid handle %x or value", operation->handle);
+                response_size = strlen(response_value) + 1;
+            }
+            break;
+         default:
+            response_type = RSP_ERROR;
+            sprintf(response_value, "Unknown message type");
+            response_size = strlen(response_value) + 1;
+            break;
+    }
+
+    // Complete response message
+    length = buffer_header(response, response_type, response_size, id);
+
+    if (cacheable && (response_type == RSP_OK) && (length > 0))
+        metadata_store(operation, generation, response);
+
+    return length;
+}
+
+/*
+ * execute_request() - Executes request
+ *
+ * Runs in a worker thread. Requests for the same plugin are executed in
+ * order, one at a time.
+ */
+
+static void execute_request(struct job_t *job)
+{
+    struct request_t *request = (struct request_t *) job;
+
+    // Answered already if deadline has passed
+    if (claim_request(request, REQUEST_STARTED))
+        execute_operation(&request->operation, request->id, &request->response);
+
+    // Hand request back to event loop of client
+    event_post(request->client->loop, &request->completion);
+}
+
+/*
+ * === Batch requests ===
+ *
+ * The operations of a batch request are grouped by plugin. Each group is
+ * executed as one job on the strand of its plugin, so operations on the same
+ * plugin are executed in batch order while groups of different plugins are
+ * executed in parallel. The group finishing last assembles the response.
+ */
+
+#define BATCH_OPERATIONS_MAX 4096
+
+/* Operation of batch request */
+struct batch_operation_t
+{
+    struct msg_header_t *message;
+    struct message_buffer_t response;
+    int next; // Next operation of same group (-1 if last)
+};
+
+/* Operations of batch request executed on the same strand */
+struct batch_group_t
+{
+    struct job_t job;
+    struct request_t *request;
+    bool ordered;
+    unsigned int hash;
+    char strand_name[256];
+    unsigned int payload_max;
+    int first;
+    int last;
+};
+
+struct batch_t
+{
+    struct batch_operation_t *operations;
+    struct iovec *iov;
+    unsigned int operation_count;
+    struct batch_group_t *groups;
+    unsigned int group_count;
+    unsigned int groups_remaining;
+};
+
+static void free_batch(struct batch_t *batch)
+{
+    unsigned int i;
+
+    if (batch == NULL)
+        return;
+
+    for (i=0; i<batch->operation_count; i++)
+        free(batch->operations[i].response.data);
+    free(batch);
+}
+
+/*
+ * batch_iov() - Describes batch response message for transmission
+ *
+ * The operation responses are sent straight from their own buffers.
+ */
+
+static void batch_iov(struct batch_t *batch, struct message_buffer_t *header, struct client_message_t *message)
+{
+    unsigned int i;
+
+    batch->iov[0].iov_base = header->data;
+    batch->iov[0].iov_len = MSG_HEADER_SIZE;
+
+    for (i=0; i<batch->operation_count; i++)
+    {
+        batch->iov[i + 1].iov_base = batch->operations[i].response.data;
+        batch->iov[i + 1].iov_len = batch->operations[i].response.length;
+    }
+
+    message->iov = batch->iov;
+    message->iov_count = batch->operation_count + 1;
+}
+
+/*
+ * complete_batch() - Creates header of batch response message
+ */
+
+static void complete_batch(struct request_t *request)
+{
+    struct batch_t *batch = request->batch;
+    struct message_buffer_t *response = &request->response;
+    unsigned int length = 0;
+    unsigned int i;
+
+    // Response carries one response per operation or is not sent at all
+    for (i=0; i<batch->operation_count; i++)
+    {
+        if (batch->operations[i].response.length < 0)
             break;
-        case RUN:
-            debug_printf("RUN(%s)\n", name);
-            if (plugin_run(plugin_name, variable_name, (int *) response_value) == 0)
-            {
-                response_type = RSP_OK;
-                response_size = sizeof(int);
-            }
-            else
-            {
-                response_type = RSP_ERROR;
-                sprintf(response_value, "Command %s not found", name);
-                response_size = strlen(response_value) + 1;
-            }
+        length += batch->operations[i].response.length;
+    }
+
+    response->length = -1;
+    if ((i == batch->operation_count) &&
+        (reserve_message_buffer(response, MSG_HEADER_SIZE) == 0))
+        buffer_header(response, RSP_OK, length, request->id);
+    else if (__atomic_load_n(&request->state, __ATOMIC_ACQUIRE) != REQUEST_EXPIRED)
+        log_error("Failed to create batch response");
+
+    // Hand request back to event loop of client
+    event_post(request->client->loop, &request->completion);
+}
+
+/*
+ * execute_batch_group() - Executes operations of batch request group
+ *
+ * Runs in a worker thread.
+ */
+
+static void execute_batch_group(struct job_t *job)
+{
+    struct batch_group_t *group = (struct batch_group_t *) job;
+    struct request_t *request = group->request;
+    struct batch_t *batch = request->batch;
+    struct batch_operation_t *batch_operation;
+    struct msg_header_t *message;
+    struct operation_t operation;
+    char *payload = NULL;
+    bool expired;
+    int i;
+
+    // Batch is started by its first group unless deadline has passed
+    claim_request(request, REQUEST_STARTED);
+    expired = (__atomic_load_n(&request->state, __ATOMIC_ACQUIRE) == REQUEST_EXPIRED);
+
+    // Operations are executed on a zero terminated copy of their payload
+    if (!expired)
+    {
+        payload = malloc(group->payload_max + 1);
+        if (payload == NULL)
+            log_error("malloc() failed");
+    }
+
+    for (i = group->first; i >= 0; i = batch->operations[i].next)
+    {
+        batch_operation = &batch->operations[i];
+        message = batch_operation->message;
+
+        if (payload == NULL)
+        {
+            // Expired batches are answered already
+            if (!expired)
+                buffer_message(&batch_operation->response, RSP_ERROR, "Out of memory",
+                               strlen("Out of memory") + 1, message->id);
+            continue;
+        }
+
+        memcpy(payload, &message->payload, message->payload_length);
+        payload[message->payload_length] = 0;
+
+        // Subscriptions belong to the connection, not to a batch
+        if ((message->type != SUBSCRIBE) && (message->type != UNSUBSCRIBE) &&
+            (decode_operation(&operation, message->type, payload, message->payload_length) == 0))
+        {
+            // Responses are kept until the batch completes, release the
+            // room reserved for their values
+            execute_operation(&operation, message->id, &batch_operation->response);
+            trim_message_buffer(&batch_operation->response);
+        }
+        else
+            buffer_message(&batch_operation->response, RSP_ERROR, "Invalid operation", strlen("Invalid operation") + 1, message->id);
+    }
+
+    free(payload);
+
+    if (__atomic_sub_fetch(&batch->groups_remaining, 1, __ATOMIC_ACQ_REL) == 0)
+        complete_batch(request);
+}
+
+/*
+ * fail_batch_group() - Answers operations of group which can not be executed
+ */
+
+static void fail_batch_group(struct batch_group_t *group)
+{
+    struct request_t *request = group->request;
+    struct batch_t *batch = request->batch;
+    int i;
+
+    for (i = group->first; i >= 0; i = batch->operations[i].next)
+        buffer_message(&batch->operations[i].response, RSP_ERROR, "Failed to submit operation",
+                       strlen("Failed to submit operation") + 1, batch->operations[i].message->id);
+
+    if (__atomic_sub_fetch(&batch->groups_remaining, 1, __ATOMIC_ACQ_REL) == 0)
+        complete_batch(request);
+}
+
+/*
+ * submit_batch() - Splits batch request into groups and submits them
+ *
+ * Returns -1 if the operations are not properly framed.
+ */
+
+static int submit_batch(struct request_t *request)
+{
+    struct batch_t *batch;
+    struct batch_group_t *group;
+    struct msg_header_t *message;
+    struct operation_t operation;
+    const char *strand_name;
+    unsigned int offset, count = 0;
+    unsigned int hash;
+    unsigned int i, j;
+
+    // Count operations
+    for (offset = 0; offset < request->payload_length; count++)
+    {
+        message = (struct msg_header_t *) &request->payload[offset];
+        if ((request->payload_length - offset < MSG_HEADER_SIZE) ||
+            (verify_request(message) != 0) ||
+            (message->payload_length > request->payload_length - offset - MSG_HEADER_SIZE))
+            return -1;
+        offset += MSG_HEADER_SIZE + message->payload_length;
+    }
+
+    if ((count == 0) || (count > BATCH_OPERATIONS_MAX))
+        return -1;
+
+    batch = malloc(sizeof(struct batch_t) +
+                   count * sizeof(struct batch_operation_t) +
+                   count * sizeof(struct batch_group_t) +
+                   (count + 1) * sizeof(struct iovec));
+    if (batch == NULL)
+        return -1;
+
+    batch->operations = (struct batch_operation_t *) (batch + 1);
+    batch->operation_count = count;
+    batch->groups = (struct batch_group_t *) (batch->operations + count);
+    batch->iov = (struct iovec *) (batch->groups + count);
+    batch->group_count = 0;
+
+    // Group operations by strand
+    for (offset = 0, i = 0; i < count; i++)
+    {
+        message = (struct msg_header_t *) &request->payload[offset];
+        offset += MSG_HEADER_SIZE + message->payload_length;
+
+        batch->operations[i].message = message;
+        batch->operations[i].response.data = NULL;
+        batch->operations[i].response.size = 0;
+        batch->operations[i].response.length = -1;
+        batch->operations[i].next = -1;
+
+        // Invalid operations are answered with an error by an unordered group
+        strand_name = NULL;
+        if (decode_operation(&operation, message->type, &message->payload, message->payload_length) == 0)
+            strand_name = operation_strand(&operation);
+        hash = (strand_name != NULL) ? hash_string(strand_name) : 0;
+
+        for (j=0; j<batch->group_count; j++)
+        {
+            group = &batch->groups[j];
+            if ((group->ordered == (strand_name != NULL)) &&
+                (group->hash == hash) &&
+                ((strand_name == NULL) || (strcmp(group->strand_name, strand_name) == 0)))
+                break;
+        }
+
+        if (j == batch->group_count)
+        {
+            group = &batch->groups[batch->group_count++];
+            group->job.function = &execute_batch_group;
+            group->request = request;
+            group->ordered = (strand_name != NULL);
+            group->hash = hash;
+            group->strand_name[0] = 0;
+            if (strand_name != NULL)
+                strcpy(group->strand_name, strand_name);
+            group->payload_max = 0;
+            group->first = i;
+        }
+        else
+            batch->operations[group->last].next = i;
+
+        group->last = i;
+        if (message->payload_length > group->payload_max)
+            group->payload_max = message->payload_length;
+    }
+
+    request->batch = batch;
+    batch->groups_remaining = batch->group_count;
+
+    // Batch may complete as soon as the last group is submitted
+    count = batch->group_count;
+    for (j=0; j<count; j++)
+    {
+        group = &batch->groups[j];
+        if (worker_submit(group->ordered ? group->strand_name : NULL, &group->job) != 0)
+            fail_batch_group(group);
+    }
+
+    return 0;
+}
+
+static void ping_sent(struct client_t *client, void *data)
+{
+    client->ping_queued = false;
+}
+
+/*
+ * send_ping() - Sends PING carrying current time to client
+ *
+ * Skipped if the previous PING has not even been sent yet.
+ */
+
+int send_ping(struct client_t *client)
+{
+    struct timespec now;
+    uint64_t timestamp;
+
+    if (client->ping_queued)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+
+    client->ping_id++;
+    encode_message(client->ping_buffer, PING, NULL, &timestamp, sizeof(timestamp), client->ping_id);
+
+    client->ping_iov.iov_base = client->ping_buffer;
+    client->ping_iov.iov_len = MSG_HEADER_SIZE + sizeof(timestamp);
+    client->ping.iov = &client->ping_iov;
+    client->ping.iov_count = 1;
+    client->ping.release = &ping_sent;
+    client->ping.data = NULL;
+    client->ping_queued = true;
+    client->ping_outstanding = true;
+
+    client_send(client, &client->ping);
+    client_schedule_flush(client);
+
+    return 0;
+}
+
+/*
+ * handle_pong() - Measures round trip time from PONG answering PING
+ */
+
+static void handle_pong(struct client_t *client, struct msg_header_t *msg_header, char *payload)
+{
+    struct timespec now;
+    uint64_t timestamp, sent;
+
+    if (!client->ping_outstanding ||
+        (msg_header->id != client->ping_id) ||
+        (msg_header->payload_length != sizeof(uint64_t)))
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    memcpy(&sent, payload, sizeof(uint64_t));
+
+    client_rtt_sample(client, (timestamp - sent) / 1000);
+}
+
+/*
+ * handle_message() - Decodes one complete request message
+ *
+ * The request is copied out of the receive ring and handed over to the
+ * worker threads for execution.
+ */
+
+static int handle_message(struct client_t *client, struct msg_header_t *msg_header, char *payload)
+{
+    struct request_t *request;
+
+    debug_printf("Received message (id = %d, type = %s, payload size = %d)\n", msg_header->id, message_type(msg_header->type), msg_header->payload_length);
+
+    if (msg_header->type == PONG)
+    {
+        handle_pong(client, msg_header, payload);
+        return 0;
+    }
+
+    request = alloc_request(client, msg_header->payload_length);
+    if (request == NULL)
+    {
+        log_error("malloc() failed");
+        return -1;
+    }
+
+    request->job.function = &execute_request;
+    request->completion.callback = &complete_request;
+    request->completion.data = request;
+    request->client = client;
+    request->id = msg_header->id;
+    request->operation.subscription = NULL;
+    request->batch = NULL;
+    request->response.length = -1;
+    request->state = REQUEST_QUEUED;
+    request->executed = false;
+    request->expiry_queued = false;
+    request->payload_length = msg_header->payload_length;
+    memcpy(request->payload, payload, msg_header->payload_length);
+    request->payload[msg_header->payload_length] = 0;
+
+    if (msg_header->type == UNSUBSCRIBE)
+    {
+        if (msg_header->payload_length < sizeof(unsigned int))
+        {
+            log_error("Invalid message from client (%s), closing connection", client->address);
+            release_request(client, request);
+            client->io->close(client);
+            return -1;
+        }
+        handle_unsubscribe(client, request);
+        return 0;
+    }
+
+    if (msg_header->type == PING)
+    {
+        buffer_message(&request->response, PONG, request->payload, request->payload_length, request->id);
+        send_response(client, request);
+        return 0;
+    }
+
+    if (msg_header->type == BATCH)
+    {
+        if (submit_batch(request) != 0)
+        {
+            log_error("Invalid batch message from client (%s), closing connection", client->address);
+            release_request(client, request);
+            client->io->close(client);
+            return -1;
+        }
+        client->pending++;
+        start_deadline(client, request);
+        return 0;
+    }
+
+    if (decode_operation(&request->operation, msg_header->type, request->payload, request->payload_length) != 0)
+    {
+        log_error("Invalid message from client (%s), closing connection", client->address);
+        release_request(client, request);
+        client->io->close(client);
+        return -1;
+    }
+
+    // Execute request in order with other requests for the same plugin
+    if (worker_submit(operation_strand(&request->operation), &request->job) != 0)
+    {
+        buffer_message(&request->response, RSP_ERROR, "Failed to submit request", strlen("Failed to submit request") + 1, request->id);
+        send_response(client, request);
+        return 0;
+    }
+    client->pending++;
+    start_deadline(client, request);
+
+    return 0;
+}
+
+/*
+ * handle_received_messages() - Handles all complete messages in receive ring
+ *
+ * Handling stops early if too many responses are waiting to be sent, in
+ * which case reading from the client is paused until they are flushed.
+ * Responses are flushed together with those of other requests completing
+ * in the same event loop iteration.
+ */
+
+static int handle_received_messages(struct client_t *client)
+{
+    struct msg_header_t msg_header;
+    unsigned int length, frame_length;
+    char *frame;
+
+    // Handle all complete messages
+    while (client->connected &&
+           (ring_used(&client->rx) >= MSG_HEADER_SIZE) &&
+           !client_congested(client))
+    {
+        // Decode message header
+        ring_peek(&client->rx, &msg_header, MSG_HEADER_SIZE);
+
+        // Verify message header
+        if ((verify_request(&msg_header) != 0) ||
+            (msg_header.payload_length > MSG_PAYLOAD_MAX))
+        {
+            log_error("Invalid message from client (%s), closing connection", client->address);
+            client->io->close(client);
+            return -1;
+        }
+
+        frame_length = MSG_HEADER_SIZE + msg_header.payload_length;
+
+        // Make sure ring can hold the complete message
+        if (ring_grow(&client->rx, frame_length))
+        {
+            log_error("Out of memory, closing connection");
+            client->io->close(client);
+            return -1;
+        }
+
+        // Wait for rest of message
+        if (ring_used(&client->rx) < frame_length)
             break;
-        case DESCRIBE:
-            debug_printf("DESCRIBE(%s)\n", name);
-            if (plugin_describe(plugin_name, variable_name, (char *) &response_value) == 0)
-                response_type = RSP_OK;
-            else
+
+        // Get message as contiguous memory (copy only if it wraps)
+        frame = ring_read_pointer(&client->rx, &length);
+        if (length < frame_length)
+        {
+            if (client_frame_reserve(client, frame_length))
             {
-                response_type = RSP_ERROR;
-                sprintf(response_value, "Variable or command %s not found", name);
+                client->io->close(client);
+                return -1;
             }
-            response_size = strlen(response_value) + 1;
-            break;
-         default:
-            break;
+            ring_peek(&client->rx, client->frame, frame_length);
+            frame = client->frame;
+        }
+
+        handle_message(client, &msg_header, &frame[MSG_HEADER_SIZE]);
+
+        ring_consume(&client->rx, frame_length);
     }
 
-    // Free payload memory
-    if (msg_header.type != LIST_PLUGINS)
-        free(payload);
+    if (!client->connected)
+        return -1;
 
-    // Create response message
-    length = create_message( (void *) &response_message, response_type, NULL, response_value, response_size, id);
-    if (length < 0)
+    // Send all responses once all ready events have been handled
+    client_schedule_flush(client);
+
+    return 0;
+}
+
+/*
+ * handle_incoming_message() - Handles incoming data on client connection
+ *
+ * Data is received in large chunks into the receive ring buffer of the
+ * client. All complete messages found in the ring are then decoded and
+ * executed. Incomplete messages stay in the ring until the rest arrives.
+ */
+
+int handle_incoming_message(struct client_t *client)
+{
+    void *buffer;
+    unsigned int length;
+    int size;
+
+    // Receive as much as fits in one read
+    buffer = ring_write_pointer(&client->rx, &length);
+    if (length == 0)
+    {
+        // Ring is full of requests held back while congested, the flush
+        // stops reading until they can be handled
+        return handle_outgoing_messages(client);
+    }
+    size = client->io->read(client, buffer, length);
+    if (size == 0)
+    {
+        debug_printf("Client closed connection\n");
+        client->io->close(client);
+        return 0;
+    }
+    if (size < 0)
+    {
+        if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))
+            return 0;
+        client->io->close(client);
         return -1;
+    }
+    ring_commit(&client->rx, size);
+    client_received(client);
 
-    debug_printf("Sending %s (%x) message with ID %d\n", message_type(response_type), response_type, id);
+    return handle_received_messages(client);
+}
 
-    // Send response message
-    ret = msg_io->write(response_message, length);
-    if (ret < 0 )
+/*
+ * handle_received_data() - Handles data received by the transport itself
+ *
+ * Used by transports which receive without being asked to read (eg.
+ * io_uring multishot receive). The data is appended to the receive ring,
+ * which grows if needed since reception may not stop immediately when the
+ * client gets congested.
+ */
+
+int handle_received_data(struct client_t *client, const void *data, unsigned int length)
+{
+    if (ring_grow(&client->rx, ring_used(&client->rx) + length))
+    {
+        log_error("Out of memory, closing connection");
+        client->io->close(client);
         return -1;
+    }
+    ring_write(&client->rx, data, length);
+    client_received(client);
 
-    return 0;
+    return handle_received_messages(client);
+}
+
+/*
+ * handle_outgoing_messages() - Sends queued responses to client
+ *
+ * Called when the client connection is writable again. Once the queue of
+ * responses has drained, handling of any buffered requests is resumed.
+ */
+
+int handle_outgoing_messages(struct client_t *client)
+{
+    if (client_flush(client))
+        return -1;
+
+    return handle_received_messages(client);
 }
 
 #endif // SERVER
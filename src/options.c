@@ -37,6 +37,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include "testgear/options.h"
 #include "config.h"
 
@@ -45,9 +46,20 @@ struct option_t option =
     false,  // Daemonize true/false
     TCP,    // Connection type
     8000,   // TCP server listen port
+    "/tmp/testgeard.sock", // UNIX server socket path
     "",     // Serial device
+    115200, // Serial baud rate
     0,      // USB vendor id
-    0       // USB product id
+    0,      // USB product id
+    0,      // Worker threads (0 = one per CPU)
+    EPOLL,  // Event backend
+    1,      // TCP shards
+    false,  // Pin shards to CPUs true/false
+    0,      // Idle timeout in seconds (0 = none)
+    0,      // Heartbeat interval in seconds (0 = none)
+    0,      // Request timeout in milliseconds (0 = none)
+    false,  // Run plugins in host processes true/false
+    0       // Plugin host timeout in seconds (0 = none)
 };
 
 void print_options_help(char *argv[])
@@ -55,10 +67,21 @@ void print_options_help(char *argv[])
     printf("Usage: %s [options]\n", argv[0]);
     printf("\n");
     printf("Options:\n");
-    printf("  -c, --connection tcp|usb|serial  Connection type (default: tcp)\n");
+    printf("  -c, --connection <type>          Connection type tcp|unix|shm|usb|serial (default: tcp)\n");
     printf("  -p, --tcp-port <port>            TCP listen port (default: %d)\n", option.tcp_port);
+    printf("  -u, --unix-socket <path>         UNIX/shm socket path (default: %s)\n", option.unix_socket);
     printf("  -d, --serial-device <device>     Serial device\n");
+    printf("  -b, --baud <rate>                Serial baud rate (default: %d)\n", option.serial_baud);
     printf("  -i, --usb-id <vendor>:<product>  USB vendor and product id\n");
+    printf("  -w, --workers <count>            Worker threads (default: one per CPU)\n");
+    printf("  -e, --event-backend <backend>    Event backend epoll|uring (default: epoll)\n");
+    printf("  -s, --shards <count>             TCP listener threads (default: 1)\n");
+    printf("  -a, --affinity                   Pin TCP listener threads to CPUs\n");
+    printf("  -t, --idle-timeout <seconds>     Close connections idle for this long\n");
+    printf("  -H, --heartbeat <seconds>        PING clients at this interval\n");
+    printf("  -T, --request-timeout <ms>       Fail requests not started in time\n");
+    printf("  -I, --isolate                    Run each plugin in a process of its own\n");
+    printf("  -k, --host-timeout <seconds>     Kill plugin hosts not answering for this long\n");
     printf("  -D, --daemon                     Daemonize\n");
     printf("  -v, --version                    Display version\n");
     printf("  -h, --help                       Display help\n");
@@ -75,8 +98,19 @@ void parse_options(int argc, char *argv[])
         {
             {"connection",    required_argument, 0, 'c'},
             {"tcp-port",      required_argument, 0, 'p'},
+            {"unix-socket",   required_argument, 0, 'u'},
             {"serial-device", required_argument, 0, 'd'},
+            {"baud",          required_argument, 0, 'b'},
             {"usb-id",        required_argument, 0, 'i'},
+            {"workers",       required_argument, 0, 'w'},
+            {"event-backend", required_argument, 0, 'e'},
+            {"shards",        required_argument, 0, 's'},
+            {"affinity",      no_argument,       0, 'a'},
+            {"idle-timeout",  required_argument, 0, 't'},
+            {"heartbeat",     required_argument, 0, 'H'},
+            {"request-timeout", required_argument, 0, 'T'},
+            {"isolate",       no_argument,       0, 'I'},
+            {"host-timeout",  required_argument, 0, 'k'},
             {"daemon",        no_argument,       0, 'D'},
             {"version",       no_argument,       0, 'v'},
             {"help",          no_argument,       0, 'h'},
@@ -87,7 +121,7 @@ void parse_options(int argc, char *argv[])
         int option_index = 0;
 
         // Parse argument using getopt_long
-        c = getopt_long (argc, argv, "c:p:d:i:Dvh", long_options, &option_index);
+        c = getopt_long (argc, argv, "c:p:u:d:b:i:w:e:s:at:H:T:Ik:Dvh", long_options, &option_index);
 
         // Detect the end of the options
         if (c == -1)
@@ -108,6 +142,10 @@ void parse_options(int argc, char *argv[])
             case 'c':
                 if (strcmp("tcp", optarg) == 0)
                     option.connection = TCP;
+                else if (strcmp("unix", optarg) == 0)
+                    option.connection = UNIX;
+                else if (strcmp("shm", optarg) == 0)
+                    option.connection = SHM;
                 else if (strcmp("usb", optarg) == 0)
                 {
                     option.connection = USB;
@@ -115,11 +153,7 @@ void parse_options(int argc, char *argv[])
                     exit(EXIT_FAILURE);
                 }
                 else if (strcmp("serial", optarg) == 0)
-                {
                     option.connection = SERIAL;
-                    printf("Sorry, serial is not supported yet.\n");
-                    exit(EXIT_FAILURE);
-                }
                 else
                 {
                     printf("Error: Invalid connection type.\n");
@@ -131,12 +165,100 @@ void parse_options(int argc, char *argv[])
                 option.tcp_port = atoi(optarg);
                 break;
 
+            case 'u':
+                if (strlen(optarg) >= sizeof(option.unix_socket))
+                {
+                    printf("Error: UNIX socket path too long.\n");
+                    exit(EXIT_FAILURE);
+                }
+                strcpy(option.unix_socket, optarg);
+                break;
+
             case 'd':
+                if (strlen(optarg) >= sizeof(option.serial_device))
+                {
+                    printf("Error: Serial device path too long.\n");
+                    exit(EXIT_FAILURE);
+                }
+                strcpy(option.serial_device, optarg);
+                break;
+
+            case 'b':
+                option.serial_baud = atoi(optarg);
                 break;
 
             case 'i':
                 break;
 
+            case 'w':
+                option.workers = atoi(optarg);
+                break;
+
+            case 'e':
+                if (strcmp("epoll", optarg) == 0)
+                    option.event_backend = EPOLL;
+                else if (strcmp("uring", optarg) == 0)
+                    option.event_backend = URING;
+                else
+                {
+                    printf("Error: Invalid event backend.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 's':
+                option.shards = atoi(optarg);
+                if (option.shards < 1)
+                {
+                    printf("Error: Invalid number of shards.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'a':
+                option.affinity = true;
+                break;
+
+            case 't':
+                option.idle_timeout = atoi(optarg);
+                if ((option.idle_timeout < 0) || (option.idle_timeout > INT_MAX / 1000))
+                {
+                    printf("Error: Invalid idle timeout.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'H':
+                option.heartbeat = atoi(optarg);
+                if ((option.heartbeat < 0) || (option.heartbeat > INT_MAX / 1000))
+                {
+                    printf("Error: Invalid heartbeat interval.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'T':
+                option.request_timeout = atoi(optarg);
+                if (option.request_timeout < 0)
+                {
+                    printf("Error: Invalid request timeout.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'I':
+                option.isolate = true;
+                break;
+
+            case 'k':
+                option.host_timeout = atoi(optarg);
+                if ((option.host_timeout < 0) || (option.host_timeout > INT_MAX / 1000))
+                {
+                    printf("Error: Invalid host timeout.\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
             case 'D':
                 option.daemon = true;
                 break;
@@ -0,0 +1,409 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "testgear/plugin.h"
+#include "testgear/plugin-catalog.h"
+#include "testgear/debug.h"
+#include "testgear/log.h"
+
+/*
+ * The plugin catalog holds the plugins found in the plugin directory,
+ * sorted by name. Metadata of each plugin is read from its struct plugin,
+ * which requires opening it, so it is kept in an index file together with
+ * the modification time and size of the plugin file. Plugins are only
+ * opened again when their file has changed.
+ *
+ * A scan builds a new catalog and replaces the old one under the catalog
+ * lock. Scans are serialized by the scan lock.
+ */
+
+#define INDEX_FILE CACHEDIR "/plugins.index"
+#define INDEX_HEADER "testgear-plugin-index 1\n"
+
+static struct plugin_entry_t *catalog = NULL;
+static unsigned int catalog_count = 0;
+static pthread_rwlock_t catalog_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int compare_entries(const void *a, const void *b)
+{
+    return strcmp(((const struct plugin_entry_t *) a)->name,
+                  ((const struct plugin_entry_t *) b)->name);
+}
+
+/* Finds entry by name (caller holds catalog lock) */
+static struct plugin_entry_t * find_entry(const char *name)
+{
+    struct plugin_entry_t key;
+
+    strncpy(key.name, name, sizeof(key.name) - 1);
+    key.name[sizeof(key.name) - 1] = 0;
+
+    return bsearch(&key, catalog, catalog_count, sizeof(struct plugin_entry_t), &compare_entries);
+}
+
+/* Copies metadata string, keeping the index file one line per plugin */
+static void copy_field(char *field, const char *string, size_t size)
+{
+    size_t i;
+
+    if (string == NULL)
+        string = "";
+
+    for (i=0; (i < size - 1) && string[i]; i++)
+        field[i] = ((string[i] == '\t') || (string[i] == '\n')) ? ' ' : string[i];
+    field[i] = 0;
+}
+
+/*
+ * probe_plugin() - Reads metadata of plugin
+ *
+ * The plugin is opened and registered like when it is loaded, but not
+ * initialized.
+ */
+
+static int probe_plugin(const char *filename, struct plugin_entry_t *entry)
+{
+    void *handle;
+    struct plugin * (*plugin_register)(void);
+    struct plugin *plugin;
+    int i;
+
+    entry->version[0] = 0;
+    entry->description[0] = 0;
+    entry->properties = -1;
+
+    handle = dlopen(filename, RTLD_LAZY | RTLD_LOCAL);
+    if (handle == NULL)
+    {
+        log_error("Unable to probe plugin (%s)", dlerror());
+        return -1;
+    }
+
+    plugin_register = dlsym(handle, "plugin_register");
+    if (plugin_register == NULL)
+    {
+        log_error("Unable to probe plugin (%s)", dlerror());
+        dlclose(handle);
+        return -1;
+    }
+
+    plugin = (*plugin_register)();
+    copy_field(entry->version, plugin->version, sizeof(entry->version));
+    copy_field(entry->description, plugin->description, sizeof(entry->description));
+    for (i=0; plugin->properties && plugin->properties[i].name; i++);
+    entry->properties = i;
+
+    dlclose(handle);
+
+    debug_printf("Probed plugin %s v%s (%d properties)\n", entry->name, entry->version, entry->properties);
+
+    return 0;
+}
+
+/*
+ * load_index() - Loads catalog from index file
+ */
+
+static void load_index(void)
+{
+    FILE *file;
+    char line[1024];
+    char *p, *field[7];
+    struct plugin_entry_t *entries = NULL, *more;
+    unsigned int count = 0, size = 0;
+    int i;
+
+    file = fopen(INDEX_FILE, "r");
+    if (file == NULL)
+        return;
+
+    if ((fgets(line, sizeof(line), file) == NULL) || (strcmp(line, INDEX_HEADER) != 0))
+    {
+        fclose(file);
+        return;
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line[strcspn(line, "\n")] = 0;
+
+        // name, mtime, mtime nanoseconds, size, properties, version, description
+        p = line;
+        for (i=0; i<7; i++)
+        {
+            field[i] = strsep(&p, "\t");
+            if (field[i] == NULL)
+                break;
+        }
+        if ((i < 7) || (field[0][0] == 0))
+            continue;
+
+        if (count == size)
+        {
+            size = size ? size * 2 : 256;
+            more = realloc(entries, size * sizeof(struct plugin_entry_t));
+            if (more == NULL)
+                break;
+            entries = more;
+        }
+
+        copy_field(entries[count].name, field[0], sizeof(entries[count].name));
+        entries[count].mtime = strtoll(field[1], NULL, 10);
+        entries[count].mtime_nsec = strtol(field[2], NULL, 10);
+        entries[count].size = strtoll(field[3], NULL, 10);
+        entries[count].properties = strtol(field[4], NULL, 10);
+        copy_field(entries[count].version, field[5], sizeof(entries[count].version));
+        copy_field(entries[count].description, field[6], sizeof(entries[count].description));
+        count++;
+    }
+
+    fclose(file);
+
+    qsort(entries, count, sizeof(struct plugin_entry_t), &compare_entries);
+
+    catalog = entries;
+    catalog_count = count;
+}
+
+/*
+ * save_index() - Saves catalog to index file (caller holds scan lock)
+ *
+ * The index is written to a temporary file which then replaces the old
+ * one, so an interrupted write never leaves a truncated index behind.
+ */
+
+static void save_index(void)
+{
+    FILE *file;
+    unsigned int i;
+    int status;
+
+    status = mkpath(CACHEDIR, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    if ((status != 0) && (errno != EEXIST))
+    {
+        log_error("Unable to create cache directory (%s)", strerror(errno));
+        return;
+    }
+
+    file = fopen(INDEX_FILE ".tmp", "w");
+    if (file == NULL)
+    {
+        log_error("Unable to write plugin index (%s)", strerror(errno));
+        return;
+    }
+
+    fputs(INDEX_HEADER, file);
+    for (i=0; i<catalog_count; i++)
+    {
+        fprintf(file, "%s\t%lld\t%ld\t%lld\t%d\t%s\t%s\n", catalog[i].name,
+                (long long) catalog[i].mtime, catalog[i].mtime_nsec,
+                (long long) catalog[i].size, catalog[i].properties,
+                catalog[i].version, catalog[i].description);
+    }
+
+    if ((fclose(file) != 0) || (rename(INDEX_FILE ".tmp", INDEX_FILE) != 0))
+    {
+        log_error("Unable to write plugin index (%s)", strerror(errno));
+        unlink(INDEX_FILE ".tmp");
+    }
+}
+
+/*
+ * plugin_catalog_scan() - Updates catalog from plugin directory
+ *
+ * Returns number of plugins added, changed or removed, or -1 if the
+ * directory could not be read.
+ */
+
+int plugin_catalog_scan(void)
+{
+    DIR *dir;
+    struct dirent *dirent;
+    struct stat st;
+    struct plugin_entry_t *entries = NULL, *more, *entry, *old;
+    struct plugin_entry_t *old_catalog;
+    unsigned int count = 0, size = 0, kept = 0;
+    char filename[PATH_MAX];
+    size_t length;
+    int changed = 0;
+
+    pthread_mutex_lock(&scan_lock);
+
+    dir = opendir(PLUGINDIR);
+    if (dir == NULL)
+    {
+        log_error("Unable to open plugin directory (%s)", strerror(errno));
+        pthread_mutex_unlock(&scan_lock);
+        return -1;
+    }
+
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        length = strlen(dirent->d_name);
+        if ((dirent->d_name[0] == '.') || (length <= 3) ||
+            (strcmp(&dirent->d_name[length - 3], ".so") != 0))
+            continue;
+
+        if ((fstatat(dirfd(dir), dirent->d_name, &st, 0) != 0) || !S_ISREG(st.st_mode))
+            continue;
+
+        if (count == size)
+        {
+            size = size ? size * 2 : 256;
+            more = realloc(entries, size * sizeof(struct plugin_entry_t));
+            if (more == NULL)
+                break;
+            entries = more;
+        }
+
+        entry = &entries[count++];
+        memcpy(entry->name, dirent->d_name, length - 3);
+        entry->name[length - 3] = 0;
+
+        // Only this thread replaces the catalog, so it can be read unlocked
+        old = find_entry(entry->name);
+        if ((old != NULL) &&
+            (old->mtime == st.st_mtim.tv_sec) &&
+            (old->mtime_nsec == st.st_mtim.tv_nsec) &&
+            (old->size == st.st_size))
+        {
+            *entry = *old;
+            kept++;
+            continue;
+        }
+
+        entry->mtime = st.st_mtim.tv_sec;
+        entry->mtime_nsec = st.st_mtim.tv_nsec;
+        entry->size = st.st_size;
+        snprintf(filename, sizeof(filename), PLUGINDIR "/%s", dirent->d_name);
+        probe_plugin(filename, entry);
+        changed++;
+    }
+
+    closedir(dir);
+
+    // Plugins not found again have been removed
+    changed += catalog_count - kept;
+
+    qsort(entries, count, sizeof(struct plugin_entry_t), &compare_entries);
+
+    pthread_rwlock_wrlock(&catalog_lock);
+    old_catalog = catalog;
+    catalog = entries;
+    catalog_count = count;
+    pthread_rwlock_unlock(&catalog_lock);
+    free(old_catalog);
+
+    if (changed)
+        save_index();
+
+    pthread_mutex_unlock(&scan_lock);
+
+    return changed;
+}
+
+/*
+ * plugin_catalog_start() - Builds catalog from index file and plugin directory
+ */
+
+void plugin_catalog_start(void)
+{
+    int changed;
+
+    load_index();
+
+    changed = plugin_catalog_scan();
+    if (changed >= 0)
+        log_info("Found %u plugins (%d probed or removed)", catalog_count, changed);
+}
+
+/*
+ * plugin_catalog_list() - Lists plugins by name
+ *
+ * Names are listed in alphabetical order and separated by ','. Fails if
+ * the list does not fit in size bytes including zero termination.
+ */
+
+int plugin_catalog_list(char *plugins, unsigned int size)
+{
+    unsigned int i, length = 0, name_length;
+    int status = 0;
+
+    plugins[0] = 0;
+
+    pthread_rwlock_rdlock(&catalog_lock);
+    for (i=0; i<catalog_count; i++)
+    {
+        name_length = strlen(catalog[i].name);
+        if (length + (i ? 1 : 0) + name_length + 1 > size)
+        {
+            status = -1;
+            break;
+        }
+        if (i)
+            plugins[length++] = ',';
+        memcpy(&plugins[length], catalog[i].name, name_length + 1);
+        length += name_length;
+    }
+    pthread_rwlock_unlock(&catalog_lock);
+
+    return status;
+}
+
+/*
+ * plugin_catalog_find() - Copies catalog entry of plugin
+ */
+
+int plugin_catalog_find(const char *name, struct plugin_entry_t *entry)
+{
+    struct plugin_entry_t *found;
+
+    pthread_rwlock_rdlock(&catalog_lock);
+    found = find_entry(name);
+    if (found != NULL)
+        *entry = *found;
+    pthread_rwlock_unlock(&catalog_lock);
+
+    return (found != NULL) ? 0 : -1;
+}
@@ -0,0 +1,920 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include "testgear/debug.h"
+#include "testgear/log.h"
+#include "testgear/options.h"
+#include "testgear/message.h"
+#include "testgear/shm.h"
+#include "testgear/plugin-manager.h"
+#include "testgear/plugin-host.h"
+
+/*
+ * === Plugin hosts ===
+ *
+ * With the isolate option each loaded plugin instance runs in a process of
+ * its own, so a plugin crashing or hanging does not take the daemon down
+ * with it. The host process is the daemon itself started as
+ *
+ *   testgeard --plugin-host <memfd> <log fd> <name>
+ *
+ * which loads the plugin under name like PLUGIN_LOAD does and then serves
+ * calls into it until the daemon unloads it or exits.
+ *
+ * Calls are passed through two single producer single consumer rings in
+ * memory shared with the host, laid out like for the shm transport (see
+ * shm.c): a control page followed by the request ring and the response
+ * ring. A request record holds the message type of the call (eg. GET_INT),
+ * the variable name or property index and the value set. The response
+ * record holds the return value and the value read. Records are 8 byte
+ * aligned and never wrap, a record of length 0 pads the rest of the ring.
+ * The daemon makes one call at a time per host, so records always find
+ * room. When loaded the host answers with a response of its own.
+ *
+ * A side waiting for a record spins for a while if there are several CPUs
+ * to run the other side meanwhile, then sets consumer_waiting and sleeps
+ * on the head index with futex(). The producer only wakes it if it clears
+ * the flag, so no system call is made while both sides are busy.
+ *
+ * Hosts exit with the daemon. A host which has died fails all calls until
+ * the plugin is reloaded, which starts new hosts. A host not answering a
+ * call within the request timeout is considered hung and killed.
+ */
+
+#define PLUGIN_HOST_RING_SIZE (4 * 1024 * 1024) // Holds two largest records
+#define PLUGIN_HOST_SPIN 4096                   // Polls before sleeping (if several CPUs)
+#define PLUGIN_HOST_POLL 10                     // Sleep between checks of peer (ms)
+
+#define RECORD_ALIGN(length) (((length) + 7) & ~7U)
+
+struct plugin_host_record_t
+{
+    uint32_t length;        // Length of record (0 pads rest of ring)
+    int32_t type;           // Message type of call
+    int32_t status;         // Return value of call
+    int32_t index;          // Property index, command return value or property size
+    uint64_t offset;        // Data offset
+    uint64_t data_length;   // Data chunk length
+    uint64_t size;          // Data size
+    uint32_t name_length;   // Length of name following record, including zero
+    uint32_t value_length;  // Length of value following name
+};
+
+/* Plugin host as seen by the daemon */
+struct plugin_host_t
+{
+    char name[256];
+    pid_t pid;
+    bool dead;              // Host has exited and is reaped
+    pthread_mutex_t lock;   // Serializes calls, one producer per ring
+    struct shm_control_t *control;
+    char *requests;
+    char *responses;
+    size_t size;
+};
+
+// Spinning only pays off if the peer runs meanwhile
+static int record_spin = -1;
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+#endif
+}
+
+static void futex_wait(uint32_t *address, uint32_t value, int timeout)
+{
+    struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000 };
+
+    syscall(SYS_futex, address, FUTEX_WAIT, value, &ts, NULL, 0);
+}
+
+static void futex_wake(uint32_t *address)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+ * record_start() - Returns room for record of length bytes at head of ring
+ *
+ * The head is only moved by record_commit(). Returns NULL if the ring has
+ * no room.
+ */
+
+static struct plugin_host_record_t * record_start(struct shm_ring_t *ring, char *data, uint32_t length, uint32_t *head)
+{
+    uint32_t offset, tail;
+
+    length = RECORD_ALIGN(length);
+    *head = ring->head;
+    offset = *head & (PLUGIN_HOST_RING_SIZE - 1);
+
+    if (PLUGIN_HOST_RING_SIZE - offset < length)
+    {
+        ((struct plugin_host_record_t *) &data[offset])->length = 0;
+        *head += PLUGIN_HOST_RING_SIZE - offset;
+        offset = 0;
+    }
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (*head + length - tail > PLUGIN_HOST_RING_SIZE)
+        return NULL;
+
+    return (struct plugin_host_record_t *) &data[offset];
+}
+
+/*
+ * record_commit() - Publishes record written at head of ring
+ */
+
+static void record_commit(struct shm_ring_t *ring, uint32_t head, struct plugin_host_record_t *record)
+{
+    __atomic_store_n(&ring->head, head + RECORD_ALIGN(record->length), __ATOMIC_SEQ_CST);
+
+    // Wake consumer if it sleeps
+    if (__atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+        futex_wake(&ring->head);
+}
+
+/*
+ * record_next() - Returns record at tail of ring, NULL if ring is empty
+ *
+ * Records are checked to lie within the ring, the peer may be broken.
+ * Returns MAP_FAILED if they do not.
+ */
+
+static struct plugin_host_record_t * record_next(struct shm_ring_t *ring, char *data)
+{
+    struct plugin_host_record_t *record;
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t offset;
+
+    while (head != tail)
+    {
+        if (head - tail > PLUGIN_HOST_RING_SIZE)
+            return MAP_FAILED;
+
+        offset = tail & (PLUGIN_HOST_RING_SIZE - 1);
+        record = (struct plugin_host_record_t *) &data[offset];
+        if (record->length != 0)
+        {
+            if ((record->length < sizeof(struct plugin_host_record_t)) ||
+                (record->length > PLUGIN_HOST_RING_SIZE - offset) ||
+                ((uint64_t) record->name_length + record->value_length >
+                 record->length - sizeof(struct plugin_host_record_t)))
+                return MAP_FAILED;
+            return record;
+        }
+
+        // Skip padding
+        tail += PLUGIN_HOST_RING_SIZE - offset;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+static void record_consume(struct shm_ring_t *ring, struct plugin_host_record_t *record)
+{
+    __atomic_store_n(&ring->tail, ring->tail + RECORD_ALIGN(record->length), __ATOMIC_RELEASE);
+}
+
+/*
+ * record_wait() - Waits up to timeout ms for record at tail of ring
+ */
+
+static struct plugin_host_record_t * record_wait(struct shm_ring_t *ring, char *data, int timeout)
+{
+    struct plugin_host_record_t *record;
+    uint32_t head;
+    int spin = __atomic_load_n(&record_spin, __ATOMIC_RELAXED);
+    int i;
+
+    if (spin < 0)
+    {
+        spin = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? PLUGIN_HOST_SPIN : 0;
+        __atomic_store_n(&record_spin, spin, __ATOMIC_RELAXED);
+    }
+
+    for (i=0; i<spin; i++)
+    {
+        record = record_next(ring, data);
+        if (record != NULL)
+            return record;
+        cpu_relax();
+    }
+
+    // Ask producer for a wake up, then check again before sleeping
+    __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+    head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+    if (head == ring->tail)
+        futex_wait(&ring->head, head, timeout);
+
+    return record_next(ring, data);
+}
+
+static int map_rings(int fd, size_t size, struct shm_control_t **control)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    if (memory == MAP_FAILED)
+    {
+        log_error("mmap() failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    *control = memory;
+
+    return 0;
+}
+
+static uint64_t milliseconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * host_reap() - Waits for host process to exit
+ */
+
+static void host_reap(struct plugin_host_t *host, bool block)
+{
+    int status;
+
+    if (host->dead)
+        return;
+
+    if (waitpid(host->pid, &status, block ? 0 : WNOHANG) != host->pid)
+        return;
+
+    host->dead = true;
+
+    if (WIFSIGNALED(status))
+        log_error("Plugin host of %s killed by signal %d", host->name, WTERMSIG(status));
+    else if (WEXITSTATUS(status) != 0)
+        log_error("Plugin host of %s exited with status %d", host->name, WEXITSTATUS(status));
+}
+
+static void host_kill(struct plugin_host_t *host)
+{
+    if (host->dead)
+        return;
+
+    kill(host->pid, SIGKILL);
+    host_reap(host, true);
+}
+
+/*
+ * host_wait() - Waits for response of host (caller holds host lock)
+ *
+ * Returns NULL if the host has died or did not answer in time.
+ */
+
+static struct plugin_host_record_t * host_wait(struct plugin_host_t *host)
+{
+    struct plugin_host_record_t *response;
+    uint64_t start = milliseconds();
+
+    while (1)
+    {
+        response = record_wait(&host->control->responses, host->responses, PLUGIN_HOST_POLL);
+        if (response == MAP_FAILED)
+        {
+            log_error("Plugin host of %s sent broken response, killing it", host->name);
+            host_kill(host);
+            return NULL;
+        }
+        if (response != NULL)
+            return response;
+
+        host_reap(host, false);
+        if (host->dead)
+            return NULL;
+
+        if ((option.host_timeout > 0) && (milliseconds() - start > (uint64_t) option.host_timeout * 1000))
+        {
+            log_error("Plugin host of %s does not answer, killing it", host->name);
+            host_kill(host);
+            return NULL;
+        }
+    }
+}
+
+/*
+ * host_call() - Makes call into plugin host and waits for its answer
+ *
+ * The request is made of call, name (may be NULL) and value_length bytes
+ * of value. The answer is returned in call and its value copied to result,
+ * which holds size bytes. Returns return value of the call, or -1 if the
+ * host is gone or the value does not fit.
+ */
+
+static int host_call(struct plugin_host_t *host, struct plugin_host_record_t *call, const char *name,
+                     const void *value, void *result, unsigned long size)
+{
+    struct plugin_host_record_t *request, *response;
+    uint32_t name_length = (name != NULL) ? strlen(name) + 1 : 0;
+    uint32_t head;
+    int status = -1;
+
+    pthread_mutex_lock(&host->lock);
+
+    if (host->dead)
+    {
+        log_error("Plugin host of %s has exited, reload plugin to restart it", host->name);
+        goto out;
+    }
+
+    call->length = sizeof(struct plugin_host_record_t) + name_length + call->value_length;
+    call->name_length = name_length;
+
+    request = record_start(&host->control->requests, host->requests, call->length, &head);
+    if (request == NULL)
+    {
+        log_error("No room for call into plugin host of %s", host->name);
+        goto out;
+    }
+    *request = *call;
+    if (name_length > 0)
+        memcpy(request + 1, name, name_length);
+    if (call->value_length > 0)
+        memcpy((char *) (request + 1) + name_length, value, call->value_length);
+    record_commit(&host->control->requests, head, request);
+
+    response = host_wait(host);
+    if (response == NULL)
+        goto out;
+
+    *call = *response;
+    if (call->value_length > size)
+    {
+        log_error("Value from plugin host of %s exceeds %lu bytes", host->name, size);
+        call->value_length = 0;
+        status = -1;
+    }
+    else
+    {
+        if (call->value_length > 0)
+            memcpy(result, (char *) (response + 1) + response->name_length, call->value_length);
+        status = call->status;
+    }
+
+    record_consume(&host->control->responses, response);
+
+out:
+    pthread_mutex_unlock(&host->lock);
+
+    return status;
+}
+
+/*
+ * plugin_host_start() - Starts host process for plugin loaded under name
+ *
+ * Returns once the plugin is loaded by the host.
+ */
+
+struct plugin_host_t * plugin_host_start(const char *name)
+{
+    struct plugin_host_t *host;
+    struct plugin_host_record_t *response;
+    char fd_argument[16], log_argument[16];
+    char *argv[] = { "testgeard", PLUGIN_HOST_ARGUMENT, fd_argument, log_argument, (char *) name, NULL };
+    pid_t parent = getpid();
+    int log_fd = fileno(log_file);
+    int fd;
+
+    host = calloc(1, sizeof(struct plugin_host_t));
+    if (host == NULL)
+    {
+        log_error("malloc() failed");
+        return NULL;
+    }
+    strncpy(host->name, name, sizeof(host->name) - 1);
+    pthread_mutex_init(&host->lock, NULL);
+    host->size = SHM_DATA_OFFSET + 2 * PLUGIN_HOST_RING_SIZE;
+
+    fd = memfd_create("testgeard-plugin", MFD_CLOEXEC);
+    if ((fd < 0) || (ftruncate(fd, host->size) < 0))
+    {
+        log_error("Creating shared memory failed (%s)", strerror(errno));
+        goto error;
+    }
+    if (map_rings(fd, host->size, &host->control))
+        goto error;
+    host->requests = (char *) host->control + SHM_DATA_OFFSET;
+    host->responses = host->requests + PLUGIN_HOST_RING_SIZE;
+
+    snprintf(fd_argument, sizeof(fd_argument), "%d", fd);
+    snprintf(log_argument, sizeof(log_argument), "%d", log_fd);
+
+    host->pid = fork();
+    if (host->pid < 0)
+    {
+        log_error("fork() failed (%s)", strerror(errno));
+        goto error;
+    }
+
+    if (host->pid == 0)
+    {
+        // Only async-signal-safe calls until exec in child of threaded process
+        prctl(PR_SET_PDEATHSIG, SIGKILL);
+        if (getppid() != parent)
+            _exit(EXIT_FAILURE);
+        fcntl(fd, F_SETFD, 0);
+        fcntl(log_fd, F_SETFD, 0);
+        execv("/proc/self/exe", argv);
+        _exit(127);
+    }
+
+    close(fd);
+    fd = -1;
+
+    // Host answers once it has loaded plugin
+    pthread_mutex_lock(&host->lock);
+    response = host_wait(host);
+    if ((response == NULL) || (response->status != 0))
+    {
+        if (response != NULL)
+            record_consume(&host->control->responses, response);
+        pthread_mutex_unlock(&host->lock);
+        host_kill(host);
+        goto error;
+    }
+    record_consume(&host->control->responses, response);
+    pthread_mutex_unlock(&host->lock);
+
+    debug_printf("Started plugin host of %s (pid %d)\n", name, host->pid);
+
+    return host;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    if (host->control != NULL)
+        munmap(host->control, host->size);
+    pthread_mutex_destroy(&host->lock);
+    free(host);
+    return NULL;
+}
+
+/*
+ * plugin_host_stop() - Unloads plugin and stops its host process
+ */
+
+int plugin_host_stop(struct plugin_host_t *host)
+{
+    struct plugin_host_record_t call = { .type = PLUGIN_UNLOAD };
+    int status = 0;
+
+    // Nothing left to unload of a host which has died
+    if (!host->dead)
+    {
+        status = host_call(host, &call, NULL, NULL, NULL, 0);
+        host_reap(host, true);
+    }
+
+    munmap(host->control, host->size);
+    pthread_mutex_destroy(&host->lock);
+    free(host);
+
+    return status;
+}
+
+/*
+ * plugin_host_get() - Gets value of up to size bytes from plugin
+ *
+ * Used for GET_<type>, GET_STRING, DESCRIBE and PLUGIN_LIST_PROPERTIES.
+ */
+
+int plugin_host_get(struct plugin_host_t *host, int type, char *name, void *value, unsigned int size)
+{
+    struct plugin_host_record_t call = { .type = type };
+
+    return host_call(host, &call, name, NULL, value, size);
+}
+
+/*
+ * plugin_host_set() - Sets value of size bytes in plugin
+ *
+ * Used for SET_<type> and SET_STRING.
+ */
+
+int plugin_host_set(struct plugin_host_t *host, int type, char *name, const void *value, unsigned int size)
+{
+    struct plugin_host_record_t call = { .type = type, .value_length = size };
+
+    return host_call(host, &call, name, value, NULL, 0);
+}
+
+int plugin_host_get_data(struct plugin_host_t *host, char *name, unsigned long offset, void *value, unsigned long *length, unsigned long *size)
+{
+    struct plugin_host_record_t call = { .type = GET_DATA, .offset = offset };
+    int status;
+
+    call.data_length = (*length < PLUGIN_HOST_CHUNK_MAX) ? *length : PLUGIN_HOST_CHUNK_MAX;
+
+    status = host_call(host, &call, name, NULL, value, call.data_length);
+    if (status == 0)
+    {
+        *length = call.value_length;
+        *size = call.size;
+    }
+
+    return status;
+}
+
+/*
+ * plugin_host_set_data() - Sets chunk of DATA variable in plugin
+ *
+ * Chunks larger than what fits in the ring are passed on in pieces.
+ */
+
+int plugin_host_set_data(struct plugin_host_t *host, char *name, unsigned long offset, const void *value, unsigned long length, unsigned long size)
+{
+    struct plugin_host_record_t call;
+    unsigned long done = 0, chunk;
+    int status;
+
+    do
+    {
+        chunk = (length - done < PLUGIN_HOST_CHUNK_MAX) ? length - done : PLUGIN_HOST_CHUNK_MAX;
+
+        memset(&call, 0, sizeof(call));
+        call.type = SET_DATA;
+        call.offset = offset + done;
+        call.size = size;
+        call.value_length = chunk;
+
+        status = host_call(host, &call, name, (const char *) value + done, NULL, 0);
+        done += chunk;
+    } while ((status == 0) && (done < length));
+
+    return status;
+}
+
+int plugin_host_run(struct plugin_host_t *host, char *name, int *return_value)
+{
+    struct plugin_host_record_t call = { .type = RUN };
+    int status;
+
+    status = host_call(host, &call, name, NULL, NULL, 0);
+    if (status == 0)
+        *return_value = call.index;
+
+    return status;
+}
+
+/*
+ * plugin_host_resolve() - Returns index of property in plugin, -1 if none
+ */
+
+int plugin_host_resolve(struct plugin_host_t *host, char *name)
+{
+    struct plugin_host_record_t call = { .type = RESOLVE };
+
+    if (host_call(host, &call, name, NULL, NULL, 0) != 0)
+        return -1;
+
+    return call.index;
+}
+
+int plugin_host_get_property(struct plugin_host_t *host, int index, void *value, int *size, int capacity)
+{
+    struct plugin_host_record_t call = { .type = GET_HANDLE, .index = index };
+    int status;
+
+    status = host_call(host, &call, NULL, NULL, value, capacity);
+    if (status == 0)
+        *size = call.value_length;
+
+    return status;
+}
+
+int plugin_host_set_property(struct plugin_host_t *host, int index, const void *value, int size)
+{
+    struct plugin_host_record_t call = { .type = SET_HANDLE, .index = index, .value_length = size };
+
+    return host_call(host, &call, NULL, value, NULL, 0);
+}
+
+/*
+ * === Host process ===
+ */
+
+static char host_instance[256];
+static unsigned int host_handle_base;   // Handle of property 0 once resolved
+static bool host_handle_known = false;
+
+/*
+ * host_execute() - Executes call into plugin
+ *
+ * The value answered is written to the response following its record.
+ */
+
+static void host_execute(struct plugin_host_record_t *request, struct plugin_host_record_t *response)
+{
+    char *name = (char *) (request + 1);
+    char *value = name + request->name_length;
+    char *result = (char *) (response + 1);
+    unsigned long length, size;
+    unsigned int handle;
+    int status = -1;
+    int return_value;
+    union
+    {
+        char c;
+        short s;
+        int i;
+        long l;
+        float f;
+        double d;
+    } scalar;
+
+    // Name is a zero terminated string when present
+    if ((request->name_length > 0) && (name[request->name_length - 1] != 0))
+    {
+        response->status = -1;
+        return;
+    }
+    if (request->name_length == 0)
+        name = "";
+
+    if (request->value_length <= sizeof(scalar))
+        memcpy(&scalar, value, request->value_length);
+
+    switch (request->type)
+    {
+        case PLUGIN_LIST_PROPERTIES:
+            status = plugin_list_properties(host_instance, result, PLUGIN_HOST_VALUE_MAX);
+            if (status == 0)
+                response->value_length = strlen(result) + 1;
+            break;
+        case GET_CHAR:
+            status = plugin_get_char(host_instance, name, (char *) result);
+            response->value_length = sizeof(char);
+            break;
+        case GET_SHORT:
+            status = plugin_get_short(host_instance, name, &scalar.s);
+            memcpy(result, &scalar.s, sizeof(short));
+            response->value_length = sizeof(short);
+            break;
+        case GET_INT:
+            status = plugin_get_int(host_instance, name, &scalar.i);
+            memcpy(result, &scalar.i, sizeof(int));
+            response->value_length = sizeof(int);
+            break;
+        case GET_LONG:
+            status = plugin_get_long(host_instance, name, &scalar.l);
+            memcpy(result, &scalar.l, sizeof(long));
+            response->value_length = sizeof(long);
+            break;
+        case GET_FLOAT:
+            status = plugin_get_float(host_instance, name, &scalar.f);
+            memcpy(result, &scalar.f, sizeof(float));
+            response->value_length = sizeof(float);
+            break;
+        case GET_DOUBLE:
+            status = plugin_get_double(host_instance, name, &scalar.d);
+            memcpy(result, &scalar.d, sizeof(double));
+            response->value_length = sizeof(double);
+            break;
+        case GET_STRING:
+            status = plugin_get_string(host_instance, name, result, PLUGIN_HOST_VALUE_MAX);
+            if (status == 0)
+                response->value_length = strlen(result) + 1;
+            break;
+        case SET_CHAR:
+            if (request->value_length == sizeof(char))
+                status = plugin_set_char(host_instance, name, scalar.c);
+            break;
+        case SET_SHORT:
+            if (request->value_length == sizeof(short))
+                status = plugin_set_short(host_instance, name, scalar.s);
+            break;
+        case SET_INT:
+            if (request->value_length == sizeof(int))
+                status = plugin_set_int(host_instance, name, scalar.i);
+            break;
+        case SET_LONG:
+            if (request->value_length == sizeof(long))
+                status = plugin_set_long(host_instance, name, scalar.l);
+            break;
+        case SET_FLOAT:
+            if (request->value_length == sizeof(float))
+                status = plugin_set_float(host_instance, name, scalar.f);
+            break;
+        case SET_DOUBLE:
+            if (request->value_length == sizeof(double))
+                status = plugin_set_double(host_instance, name, scalar.d);
+            break;
+        case SET_STRING:
+            if ((request->value_length > 0) && (value[request->value_length - 1] == 0))
+                status = plugin_set_string(host_instance, name, value);
+            break;
+        case GET_DATA:
+            length = request->data_length;
+            status = plugin_get_data(host_instance, name, request->offset, result, &length, &size);
+            if (status == 0)
+            {
+                response->value_length = length;
+                response->size = size;
+            }
+            break;
+        case SET_DATA:
+            status = plugin_set_data(host_instance, name, request->offset, value,
+                                     request->value_length, request->size);
+            break;
+        case RUN:
+            status = plugin_run(host_instance, name, &return_value);
+            response->index = return_value;
+            break;
+        case DESCRIBE:
+            status = plugin_describe(host_instance, name, result, PLUGIN_HOST_VALUE_MAX);
+            if (status == 0)
+                response->value_length = strlen(result) + 1;
+            break;
+        case RESOLVE:
+            status = plugin_resolve(host_instance, name, &handle);
+            if (status == 0)
+            {
+                // Handles of the only plugin loaded in host differ by index only
+                host_handle_base = handle & ~0xFFFFU;
+                host_handle_known = true;
+                response->index = handle & 0xFFFF;
+            }
+            break;
+        case GET_HANDLE:
+            if (host_handle_known && (request->index >= 0) && (request->index <= 0xFFFF))
+            {
+                status = plugin_get_handle(host_handle_base | request->index, result, &return_value, PLUGIN_HOST_VALUE_MAX);
+                if (status == 0)
+                    response->value_length = return_value;
+            }
+            break;
+        case SET_HANDLE:
+            if (host_handle_known && (request->index >= 0) && (request->index <= 0xFFFF))
+                status = plugin_set_handle(host_handle_base | request->index, value, request->value_length);
+            break;
+        case PLUGIN_UNLOAD:
+            status = plugin_unload(host_instance);
+            break;
+        default:
+            log_error("Plugin host of %s received unknown call %d", host_instance, request->type);
+            break;
+    }
+
+    if (status != 0)
+        response->value_length = 0;
+    response->status = status;
+}
+
+/*
+ * plugin_host_main() - Runs plugin host process
+ *
+ * Started by plugin_host_start() with the descriptors of the shared memory
+ * and of the log file of the daemon, and the name to load the plugin under.
+ */
+
+int plugin_host_main(int argc, char *argv[])
+{
+    struct shm_control_t *control;
+    struct plugin_host_record_t *request, *response;
+    char *requests, *responses;
+    char *separator;
+    pid_t parent = getppid();
+    uint32_t head, length;
+    int type, fd;
+
+    if (argc != 5)
+    {
+        fprintf(stderr, "Error: Invalid plugin host arguments\n");
+        exit(EXIT_FAILURE);
+    }
+
+    log_file = fdopen(atoi(argv[3]), "a");
+    if (log_file == NULL)
+    {
+        fprintf(stderr, "Error: Unable to open log file (%s)\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    setbuf(log_file, NULL);
+
+    // Ctrl-c is for the daemon, the host exits with it
+    signal(SIGINT, SIG_IGN);
+
+    fd = atoi(argv[2]);
+    if (map_rings(fd, SHM_DATA_OFFSET + 2 * PLUGIN_HOST_RING_SIZE, &control))
+        exit(EXIT_FAILURE);
+    close(fd);
+    requests = (char *) control + SHM_DATA_OFFSET;
+    responses = requests + PLUGIN_HOST_RING_SIZE;
+
+    strncpy(host_instance, argv[4], sizeof(host_instance) - 1);
+    separator = strchr(host_instance, '=');
+    if (separator != NULL)
+        *separator = 0;
+
+    // Load plugin and tell daemon how it went
+    plugin_manager_start_host();
+    response = record_start(&control->responses, responses, sizeof(struct plugin_host_record_t), &head);
+    memset(response, 0, sizeof(struct plugin_host_record_t));
+    response->status = plugin_load(argv[4]);
+    response->length = sizeof(struct plugin_host_record_t);
+    record_commit(&control->responses, head, response);
+    if (response->status != 0)
+        exit(EXIT_FAILURE);
+
+    while (1)
+    {
+        request = record_wait(&control->requests, requests, PLUGIN_HOST_POLL);
+        if (request == MAP_FAILED)
+        {
+            log_error("Plugin host of %s received broken request", host_instance);
+            exit(EXIT_FAILURE);
+        }
+        if (request == NULL)
+        {
+            // Should the death signal of the daemon get lost
+            if (getppid() != parent)
+                exit(EXIT_FAILURE);
+            continue;
+        }
+
+        length = sizeof(struct plugin_host_record_t) + PLUGIN_HOST_VALUE_MAX;
+        if ((request->type == GET_DATA) && (request->data_length > PLUGIN_HOST_CHUNK_MAX))
+            request->data_length = PLUGIN_HOST_CHUNK_MAX;
+        if (request->type == GET_DATA)
+            length = sizeof(struct plugin_host_record_t) + request->data_length;
+
+        response = record_start(&control->responses, responses, length, &head);
+        if (response == NULL)
+        {
+            log_error("Plugin host of %s has no room for response", host_instance);
+            exit(EXIT_FAILURE);
+        }
+        memset(response, 0, sizeof(struct plugin_host_record_t));
+        response->type = type = request->type;
+
+        host_execute(request, response);
+        record_consume(&control->requests, request);
+        response->length = sizeof(struct plugin_host_record_t) + response->value_length;
+        record_commit(&control->responses, head, response);
+
+        if (type == PLUGIN_UNLOAD)
+            exit(response->status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+}
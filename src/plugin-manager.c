@@ -30,27 +30,480 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <dlfcn.h>
 #include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/inotify.h>
 #include "testgear/plugin-manager.h"
 #include "testgear/plugin.h"
 #include "testgear/debug.h"
-#include "testgear/list.h"
+#include "testgear/hash.h"
 #include "testgear/log.h"
+#include "testgear/event.h"
+#include "testgear/plugin-catalog.h"
+#include "testgear/epoch.h"
+#include "testgear/options.h"
+#include "testgear/message.h"
+#include "testgear/plugin-host.h"
+#include "testgear/worker.h"
 
 static struct init_data data;
 
-static list_p plugin_list;
+/* Plugin entry points, resolved once when plugin is opened */
+struct plugin_dispatch_t
+{
+    struct plugin_instance * (*create_instance)(const char *name);
+    void (*destroy_instance)(struct plugin_instance *instance);
+    int (*instance_list_properties)(struct plugin_instance *instance, char *properties, unsigned int size);
+    int (*instance_get_char)(struct plugin_instance *instance, char *name, char *value);
+    int (*instance_get_short)(struct plugin_instance *instance, char *name, short *value);
+    int (*instance_get_int)(struct plugin_instance *instance, char *name, int *value);
+    int (*instance_get_long)(struct plugin_instance *instance, char *name, long *value);
+    int (*instance_get_float)(struct plugin_instance *instance, char *name, float *value);
+    int (*instance_get_double)(struct plugin_instance *instance, char *name, double *value);
+    char * (*instance_get_string)(struct plugin_instance *instance, char *name);
+    int (*instance_set_char)(struct plugin_instance *instance, char *name, char value);
+    int (*instance_set_short)(struct plugin_instance *instance, char *name, short value);
+    int (*instance_set_int)(struct plugin_instance *instance, char *name, int value);
+    int (*instance_set_long)(struct plugin_instance *instance, char *name, long value);
+    int (*instance_set_float)(struct plugin_instance *instance, char *name, float value);
+    int (*instance_set_double)(struct plugin_instance *instance, char *name, double value);
+    int (*instance_set_string)(struct plugin_instance *instance, char *name, char *value);
+    int (*instance_get_data)(struct plugin_instance *instance, char *name, unsigned long offset, void *value, unsigned long *length, unsigned long *size);
+    int (*instance_set_data)(struct plugin_instance *instance, char *name, unsigned long offset, void *value, unsigned long length, unsigned long size);
+    int (*instance_run)(struct plugin_instance *instance, char *name, int *return_value);
+    char * (*instance_describe)(struct plugin_instance *instance, char *name);
+    int (*instance_resolve_property)(struct plugin_instance *instance, char *name);
+    int (*instance_get_property)(struct plugin_instance *instance, int index, void *value, int *size, int capacity);
+    int (*instance_set_property)(struct plugin_instance *instance, int index, void *value, int size);
+};
+
+#define DISPATCH_ENTRY(symbol) { #symbol, offsetof(struct plugin_dispatch_t, symbol) }
+
+static const struct
+{
+    const char *symbol;
+    size_t offset;
+} dispatch_entries[] =
+{
+    DISPATCH_ENTRY(create_instance),
+    DISPATCH_ENTRY(destroy_instance),
+    DISPATCH_ENTRY(instance_list_properties),
+    DISPATCH_ENTRY(instance_get_char),
+    DISPATCH_ENTRY(instance_get_short),
+    DISPATCH_ENTRY(instance_get_int),
+    DISPATCH_ENTRY(instance_get_long),
+    DISPATCH_ENTRY(instance_get_float),
+    DISPATCH_ENTRY(instance_get_double),
+    DISPATCH_ENTRY(instance_get_string),
+    DISPATCH_ENTRY(instance_set_char),
+    DISPATCH_ENTRY(instance_set_short),
+    DISPATCH_ENTRY(instance_set_int),
+    DISPATCH_ENTRY(instance_set_long),
+    DISPATCH_ENTRY(instance_set_float),
+    DISPATCH_ENTRY(instance_set_double),
+    DISPATCH_ENTRY(instance_set_string),
+    DISPATCH_ENTRY(instance_get_data),
+    DISPATCH_ENTRY(instance_set_data),
+    DISPATCH_ENTRY(instance_run),
+    DISPATCH_ENTRY(instance_describe),
+    DISPATCH_ENTRY(instance_resolve_property),
+    DISPATCH_ENTRY(instance_get_property),
+    DISPATCH_ENTRY(instance_set_property),
+};
 
+/*
+ * Plugin file opened by the dynamic linker. A plugin may be loaded several
+ * times under different names, each loaded plugin being an instance of the
+ * plugin with its own property values. Instances share the opened file.
+ * With the isolate option the file is opened by the host process of each
+ * instance instead (see plugin-host.c) and only the record is kept here.
+ */
+struct plugin_object_t
+{
+    char name[256];     // File name without .so
+    int fd;             // Plugin file, kept open while opened
+    void *handle;
+    struct plugin *plugin;
+    struct plugin_dispatch_t dispatch;
+    unsigned int instances;
+    struct plugin_object_t *next;
+};
+
+/* Loaded plugin record */
 struct plugin_item_t
 {
     char name[256];
-    void *handle;
+    unsigned int hash;
+    unsigned int id;
+    struct plugin_object_t *object;
+    struct plugin_dispatch_t *dispatch;
+    struct plugin_instance *instance;
+    struct plugin_host_t *host;     // Process running instance, if isolated
 };
 
-static struct plugin_item_t plugin_item;
-static struct plugin_item_t *plugin_item_p;
+/*
+ * Loaded plugins are indexed by name in an open addressing hash table with
+ * linear probing. Unloaded plugins leave a deleted marker behind so probe
+ * sequences stay intact. The table is rebuilt when it gets half full.
+ */
+
+#define PLUGIN_TABLE_SIZE_MIN 64
+#define PLUGIN_DELETED ((struct plugin_item_t *) -1)
+
+static struct plugin_item_t **plugin_table;
+static unsigned int plugin_table_size;
+static unsigned int plugin_table_used; // Including deleted markers
+static unsigned int plugin_count;
+
+/*
+ * Loaded plugins are also numbered so that properties can be referred to by
+ * a numeric handle holding plugin number and property index. Numbers are
+ * handed out round robin to make reuse of a stale handle unlikely.
+ */
+
+#define PLUGIN_ID_MAX 4096
+#define HANDLE(id, index) (((id) << 16) | (index))
+#define HANDLE_ID(handle) ((handle) >> 16)
+#define HANDLE_INDEX(handle) ((handle) & 0xFFFF)
+
+static struct plugin_item_t **plugin_ids;
+static unsigned int plugin_next_id;
+
+/*
+ * Requests are executed by several worker threads. Calls into a plugin are
+ * serialized per plugin by the workers, but the table of loaded plugins is
+ * shared and protected by this lock.
+ */
+static pthread_rwlock_t plugin_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * Loading, unloading and reloading of plugins is serialized by this lock.
+ * Reloads are not executed in order with the requests for the plugin, so
+ * requests are not held up by them. The lock is not held while waiting for
+ * calls into a removed plugin to return, so a plugin with a long running
+ * call does not hold up changes to other plugins.
+ */
+static pthread_mutex_t plugin_change_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Opened plugin files (protected by plugin change lock) */
+static struct plugin_object_t *plugin_objects = NULL;
+
+/*
+ * Responses describing plugins (lists of plugins and properties,
+ * descriptions) are cached by the message handler. The generation counter
+ * tells when they may have changed: it is incremented whenever a plugin is
+ * loaded, unloaded or reloaded, and whenever the plugin directory changes, which is
+ * watched by inotify. It is incremented after the change, so a response
+ * created from the old state is never taken to belong to the new
+ * generation.
+ *
+ * Scanning the directory may open plugins, so it is done by a worker. The
+ * event loop runs one scan at a time and starts another if the directory
+ * changed meanwhile.
+ */
+static unsigned int plugin_generation_count;
+static int plugin_watch_fd = -1;
+static bool plugin_watching = false;
+static struct event_handler_t plugin_watch_handler;
+static struct event_loop_t *plugin_watch_loop;
+static struct job_t plugin_scan_job;
+static struct event_call_t plugin_scan_completion;
+static int plugin_scan_result;
+static bool plugin_scan_running = false;
+static bool plugin_scan_again = false;
+
+static void plugin_changed(void)
+{
+    __atomic_add_fetch(&plugin_generation_count, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ * plugin_generation() - Returns generation of plugin metadata
+ */
+
+unsigned int plugin_generation(void)
+{
+    return __atomic_load_n(&plugin_generation_count, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * plugin_directory_watched() - Tells if plugin directory changes are noticed
+ */
+
+bool plugin_directory_watched(void)
+{
+    return __atomic_load_n(&plugin_watching, __ATOMIC_ACQUIRE);
+}
+
+static void start_scan(void);
+
+/*
+ * execute_scan() - Scans plugin directory in worker thread
+ */
+
+static void execute_scan(struct job_t *job)
+{
+    plugin_scan_result = plugin_catalog_scan();
+
+    // Hand result back to event loop
+    event_post(plugin_watch_loop, &plugin_scan_completion);
+}
+
+/*
+ * complete_scan() - Publishes result of scan in event loop thread
+ */
+
+static void complete_scan(void *data)
+{
+    plugin_scan_running = false;
+
+    if (plugin_scan_result > 0)
+        plugin_changed();
+
+    if (plugin_scan_again)
+        start_scan();
+}
+
+static void start_scan(void)
+{
+    if (plugin_scan_running)
+    {
+        plugin_scan_again = true;
+        return;
+    }
+
+    plugin_scan_running = true;
+    plugin_scan_again = false;
+    plugin_scan_job.function = &execute_scan;
+    plugin_scan_completion.callback = &complete_scan;
+    plugin_scan_completion.data = NULL;
+    worker_submit(NULL, &plugin_scan_job);
+}
+
+static void plugin_watch_event(int fd, unsigned int events, void *data)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    // Details do not matter, the catalog finds what changed
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+
+    debug_printf("Plugin directory changed\n");
+    start_scan();
+}
+
+/*
+ * plugin_manager_watch() - Watches plugin directory from event loop
+ */
+
+void plugin_manager_watch(struct event_loop_t *loop)
+{
+    plugin_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (plugin_watch_fd < 0)
+    {
+        log_error("inotify_init1() failed (%s)", strerror(errno));
+        return;
+    }
+
+    if (inotify_add_watch(plugin_watch_fd, PLUGINDIR,
+                          IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                          IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF) < 0)
+    {
+        log_info("Not watching plugin directory %s (%s)", PLUGINDIR, strerror(errno));
+        close(plugin_watch_fd);
+        plugin_watch_fd = -1;
+        return;
+    }
+
+    plugin_watch_loop = loop;
+    plugin_watch_handler.fd = plugin_watch_fd;
+    plugin_watch_handler.callback = &plugin_watch_event;
+    plugin_watch_handler.data = NULL;
+    if (event_add(loop, &plugin_watch_handler, EPOLLIN))
+    {
+        close(plugin_watch_fd);
+        plugin_watch_fd = -1;
+        return;
+    }
+
+    __atomic_store_n(&plugin_watching, true, __ATOMIC_RELEASE);
+
+    // Catch up with changes made before the watch was added
+    start_scan();
+}
+
+/*
+ * find_plugin() - Finds loaded plugin by name (caller holds plugin lock)
+ */
+
+static struct plugin_item_t * find_plugin(const char *name)
+{
+    unsigned int hash = hash_string(name);
+    unsigned int mask = plugin_table_size - 1;
+    unsigned int i = hash & mask;
+    struct plugin_item_t *item;
+
+    while ((item = plugin_table[i]) != NULL)
+    {
+        if ((item != PLUGIN_DELETED) &&
+            (item->hash == hash) &&
+            (strcmp(item->name, name) == 0))
+            return item;
+        i = (i + 1) & mask;
+    }
+
+    return NULL;
+}
+
+static void insert_plugin(struct plugin_item_t **table, unsigned int size, struct plugin_item_t *item)
+{
+    unsigned int mask = size - 1;
+    unsigned int i = item->hash & mask;
+
+    while ((table[i] != NULL) && (table[i] != PLUGIN_DELETED))
+        i = (i + 1) & mask;
+
+    if (table[i] == NULL)
+        plugin_table_used++;
+    table[i] = item;
+}
+
+/*
+ * resize_plugin_table() - Rebuilds plugin table (caller holds plugin lock)
+ *
+ * Drops deleted markers and doubles the size if still more than a quarter
+ * full.
+ */
+
+static int resize_plugin_table(void)
+{
+    struct plugin_item_t **table;
+    unsigned int size = plugin_table_size;
+    unsigned int i;
+
+    if ((plugin_count + 1) * 4 > size)
+        size *= 2;
+
+    table = calloc(size, sizeof(struct plugin_item_t *));
+    if (table == NULL)
+        return -1;
+
+    plugin_table_used = 0;
+    for (i=0; i<plugin_table_size; i++)
+    {
+        if ((plugin_table[i] != NULL) && (plugin_table[i] != PLUGIN_DELETED))
+            insert_plugin(table, size, plugin_table[i]);
+    }
+
+    free(plugin_table);
+    plugin_table = table;
+    plugin_table_size = size;
+
+    return 0;
+}
+
+static int assign_id(struct plugin_item_t *item)
+{
+    unsigned int i;
+
+    // Find free plugin number
+    for (i=0; i<PLUGIN_ID_MAX; i++)
+    {
+        item->id = (plugin_next_id + i) % PLUGIN_ID_MAX;
+        if (plugin_ids[item->id] == NULL)
+            break;
+    }
+    if (i == PLUGIN_ID_MAX)
+        return -1;
+
+    plugin_next_id = (item->id + 1) % PLUGIN_ID_MAX;
+
+    return 0;
+}
+
+static int add_plugin(struct plugin_item_t *item)
+{
+    if (assign_id(item))
+        return -1;
+
+    // Keep table at most half full
+    if ((plugin_table_used + 1) * 2 > plugin_table_size)
+    {
+        if (resize_plugin_table())
+            return -1;
+    }
+
+    insert_plugin(plugin_table, plugin_table_size, item);
+    plugin_count++;
+
+    plugin_ids[item->id] = item;
+
+    return 0;
+}
+
+static void remove_plugin(struct plugin_item_t *item)
+{
+    unsigned int mask = plugin_table_size - 1;
+    unsigned int i = item->hash & mask;
+
+    while (plugin_table[i] != item)
+        i = (i + 1) & mask;
+
+    plugin_table[i] = PLUGIN_DELETED;
+    plugin_count--;
+
+    plugin_ids[item->id] = NULL;
+}
+
+static bool same_properties(struct plugin *a, struct plugin *b)
+{
+    int i;
+
+    for (i=0; a->properties[i].name && b->properties[i].name; i++)
+    {
+        if ((a->properties[i].type != b->properties[i].type) ||
+            (strcmp(a->properties[i].name, b->properties[i].name) != 0))
+            return false;
+    }
+
+    return (a->properties[i].name == NULL) && (b->properties[i].name == NULL);
+}
+
+/*
+ * replace_plugin() - Puts reloaded plugin in place of old one
+ *
+ * The plugin number, and thereby handles of its properties, is kept if
+ * properties are indexed the same by both. Otherwise the new plugin is
+ * given a new number so that old handles do not refer to the wrong
+ * property. Properties of plugins run by hosts are not known here, so these
+ * are always given a new number.
+ */
+
+static int replace_plugin(struct plugin_item_t *old, struct plugin_item_t *item)
+{
+    unsigned int mask = plugin_table_size - 1;
+    unsigned int i = old->hash & mask;
+
+    if ((old->host == NULL) && (item->host == NULL) &&
+        same_properties(old->object->plugin, item->object->plugin))
+        item->id = old->id;
+    else if (assign_id(item))
+        return -1;
+
+    plugin_ids[old->id] = NULL;
+    plugin_ids[item->id] = item;
+
+    while (plugin_table[i] != old)
+        i = (i + 1) & mask;
+    plugin_table[i] = item;
+
+    return 0;
+}
 
 static void plugin_print_info(struct plugin *plugin)
 {
@@ -79,348 +532,1023 @@ static void plugin_print_info(struct plugin *plugin)
     }
 }
 
-int list_plugins(char *plugins)
+/*
+ * resolve_dispatch() - Resolves all plugin entry points
+ */
+
+static int resolve_dispatch(void *handle, struct plugin_dispatch_t *dispatch)
 {
-    FILE *fp;
-    char line_buffer[256];
+    unsigned int i;
+    void *symbol_handle;
+    char *error;
 
-    fp = popen("cd " PLUGINDIR "; ls *.so", "r");
-    if (fp == NULL)
+    for (i=0; i<sizeof(dispatch_entries)/sizeof(dispatch_entries[0]); i++)
     {
-         printf("Error: %s\n", strerror(errno));
-         return -1;
+        dlerror();
+        symbol_handle = dlsym(handle, dispatch_entries[i].symbol);
+        if ((error = dlerror()) != NULL)
+        {
+            log_error("%s", error);
+            return -1;
+        }
+        *(void **) ((char *) dispatch + dispatch_entries[i].offset) = symbol_handle;
     }
 
-    while (fgets(line_buffer, 256, fp) != NULL)
+    return 0;
+}
+
+/*
+ * list_plugins() - Lists plugins in plugin directory
+ *
+ * Plugins are listed by name, without .so suffix, in alphabetical order
+ * and separated by ','. Fails if the list does not fit in size bytes.
+ */
+
+int list_plugins(char *plugins, unsigned int size)
+{
+    // Without directory watch the catalog is only current when rescanned
+    if (!plugin_directory_watched() && (plugin_catalog_scan() > 0))
+        plugin_changed();
+
+    return plugin_catalog_list(plugins, size);
+}
+
+/*
+ * discard_object() - Closes plugin file
+ */
+
+static int discard_object(struct plugin_object_t *object)
+{
+    int status = 0;
+
+    if ((object->handle != NULL) && dlclose(object->handle))
     {
-        int length = strlen(line_buffer);
-        line_buffer[length-1-3] = ',';
-        line_buffer[length-3] = 0;
-        strcat(plugins, line_buffer);
+        fprintf(stderr, "%s\n", dlerror());
+        status = -1;
     }
 
-    plugins[strlen(plugins)-1] = 0;
+    if (object->fd >= 0)
+        close(object->fd);
+    free(object);
 
-    pclose(fp);
-
-    return 0;
+    return status;
 }
 
-int plugin_load(char *name)
+/*
+ * open_object() - Opens and initializes plugin file
+ *
+ * The dynamic linker never opens a file again under a name it has already
+ * loaded, so the plugin is opened through a descriptor of its file instead,
+ * which is kept open and thereby unique while the plugin is opened. This
+ * way a rebuilt plugin file can be opened next to the plugin opened from
+ * the old file. If the file turns out to be the one of the opened plugin
+ * given, nothing is initialized and 1 is returned.
+ */
+
+static int open_object(char *name, struct plugin_object_t *opened, struct plugin_object_t **result)
 {
-    char filename[256];
+    char filename[PATH_MAX];
     struct plugin * (*plugin_register)(void);
-    int (*plugin_load)();
+    const int *plugin_abi;
     struct plugin *plugin;
-    struct plugin_command_table *commands;
+    struct plugin_object_t *object;
     char *error;
 
-    log_info("Loading %s plugin", name);
-
-    // Fill in name in list element
-    strcpy(plugin_item.name, name);
+    // Create plugin file record
+    object = calloc(1, sizeof(struct plugin_object_t));
+    if (object == NULL)
+    {
+        log_error("malloc() failed");
+        return -1;
+    }
+    strncpy(object->name, name, sizeof(object->name) - 1);
 
-    // Check that plugin is not already loaded
-    list_iter_p iter = list_iterator(plugin_list, FRONT);
-    while (list_next(iter) != NULL)
+    // Plugin hosts open the file themselves, each reload starts new ones
+    if (option.isolate)
     {
-        plugin_item_p = (struct plugin_item_t *)list_current(iter);
-        if (strcmp(plugin_item_p->name, name) == 0)
-        {
-            log_error("Plugin already loaded!");
-            return -1;
-        }
+        object->fd = -1;
+        object->next = plugin_objects;
+        plugin_objects = object;
+        *result = object;
+        return 0;
     }
 
     // Add location
-    sprintf(filename, PLUGINDIR "/%s.so", name);
+    snprintf(filename, sizeof(filename), PLUGINDIR "/%s.so", name);
 
     // Open plugin
-    plugin_item.handle = dlopen(filename, RTLD_LAZY);
-    if (!plugin_item.handle)
+    object->fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (object->fd < 0)
     {
-        fprintf(stderr, "%s\n", dlerror());
+        log_error("Unable to open %s (%s)", filename, strerror(errno));
+        free(object);
         return -1;
     }
-    else
+    snprintf(filename, sizeof(filename), "/proc/self/fd/%d", object->fd);
+    object->handle = dlopen(filename, RTLD_LAZY);
+    if (!object->handle)
     {
-        // Add plugin to list of loaded plugins
-        list_add(plugin_list, &plugin_item, sizeof(plugin_item));
+        fprintf(stderr, "%s\n", dlerror());
+        close(object->fd);
+        free(object);
+        return -1;
+    }
 
-        // Call plugin_register()
-        plugin_register = dlsym(plugin_item.handle, "plugin_register");
-        if ((error = dlerror()) != NULL)
-            fprintf(stderr, "%s\n", error);
-        plugin = (*plugin_register)();
+    if ((opened != NULL) && (object->handle == opened->handle))
+    {
+        discard_object(object);
+        return 1;
+    }
 
-        // Initialize plugin
-        data.log_file = log_file;
-        plugin->init(&data);
+    // Check that plugin implements the plugin interface of the daemon
+    plugin_abi = dlsym(object->handle, "plugin_abi");
+    if ((plugin_abi == NULL) || (*plugin_abi != PLUGIN_ABI))
+    {
+        log_error("Plugin %s is built for another plugin interface, rebuild it", name);
+        discard_object(object);
+        return -1;
+    }
 
-        // Print plugin information
-        plugin_print_info(plugin);
+    // Call plugin_register()
+    plugin_register = dlsym(object->handle, "plugin_register");
+    if ((error = dlerror()) != NULL)
+    {
+        fprintf(stderr, "%s\n", error);
+        discard_object(object);
+        return -1;
+    }
+    plugin = (*plugin_register)();
+    object->plugin = plugin;
 
-        // Call plugin load callback (if defined)
-        if (plugin->load != NULL)
-        {
-            plugin_load = plugin->load;
-            (*plugin_load)();
-        }
+    // Resolve plugin entry points
+    if (resolve_dispatch(object->handle, &object->dispatch))
+    {
+        discard_object(object);
+        return -1;
     }
 
+    // Initialize plugin
+    data.log_file = log_file;
+    plugin->init(&data);
+
+    // Print plugin information
+    plugin_print_info(plugin);
+
+    object->next = plugin_objects;
+    plugin_objects = object;
+
+    *result = object;
+
     return 0;
 }
 
-int plugin_unload(char *name)
+/*
+ * create_item() - Creates record of plugin instance
+ *
+ * The plugin load callback is called for the new instance, which is run by
+ * a host process of its own with the isolate option.
+ */
+
+static struct plugin_item_t * create_item(char *name, struct plugin_object_t *object)
 {
-    struct plugin * (*plugin_register)(void);
-    int (*plugin_unload)(void);
-    struct plugin *plugin;
-    char *error;
-    bool found = false;
+    struct plugin_item_t *plugin_item_p;
+    char host_name[512];
 
-    debug_printf("Unloading plugin %s\n", name);
+    plugin_item_p = calloc(1, sizeof(struct plugin_item_t));
+    if (plugin_item_p == NULL)
+    {
+        log_error("malloc() failed");
+        return NULL;
+    }
+    strncpy(plugin_item_p->name, name, sizeof(plugin_item_p->name) - 1);
+    plugin_item_p->hash = hash_string(plugin_item_p->name);
+    plugin_item_p->object = object;
+    plugin_item_p->dispatch = &object->dispatch;
 
-    // Check that the plugin is loaded
-    list_iter_p iter = list_iterator(plugin_list, FRONT);
-    while (list_next(iter) != NULL)
+    if (option.isolate)
     {
-        plugin_item_p = (struct plugin_item_t *)list_current(iter);
-        if (strcmp(plugin_item_p->name, name) == 0)
-        {
-            found = true;
-            break;
-        }
+        snprintf(host_name, sizeof(host_name), "%s=%s", name, object->name);
+        plugin_item_p->host = plugin_host_start(host_name);
+    }
+    else
+        plugin_item_p->instance = object->dispatch.create_instance(name);
+    if ((plugin_item_p->instance == NULL) && (plugin_item_p->host == NULL))
+    {
+        log_error("Failed to create instance %s of plugin %s", name, object->name);
+        free(plugin_item_p);
+        return NULL;
+    }
+    object->instances++;
+
+    return plugin_item_p;
+}
+
+/*
+ * destroy_item() - Destroys plugin instance
+ *
+ * The plugin unload callback is called for the instance. The plugin file is
+ * closed with its last instance.
+ */
+
+static int destroy_item(struct plugin_item_t *plugin_item_p)
+{
+    struct plugin_object_t *object = plugin_item_p->object;
+    struct plugin_object_t **p;
+    int status = 0;
+
+    if (plugin_item_p->host != NULL)
+        status = plugin_host_stop(plugin_item_p->host);
+    else
+        object->dispatch.destroy_instance(plugin_item_p->instance);
+    free(plugin_item_p);
+
+    if (--object->instances > 0)
+        return status;
+
+    for (p = &plugin_objects; *p != object; p = &(*p)->next);
+    *p = object->next;
+
+    if (discard_object(object))
+        status = -1;
+
+    return status;
+}
+
+/*
+ * split_name() - Splits name plugin is loaded under
+ *
+ * A plugin is loaded under the name of its file, or as a named instance of
+ * a plugin file given as "<instance>=<plugin>", eg. "psu0=psu".
+ */
+
+static int split_name(char *name, char *instance_name, char *object_name)
+{
+    char *separator = strchr(name, '=');
+
+    if (separator == NULL)
+    {
+        strcpy(instance_name, name);
+        strcpy(object_name, name);
+    }
+    else
+    {
+        memcpy(instance_name, name, separator - name);
+        instance_name[separator - name] = 0;
+        strcpy(object_name, separator + 1);
     }
 
-    if (!found)
+    if ((instance_name[0] == 0) || (object_name[0] == 0) || (strchr(instance_name, '.') != NULL))
     {
-        printf("Error: Plugin not found!\n");
+        log_error("Invalid plugin name %s", name);
         return -1;
     }
 
-    // Call plugin_register()
-    plugin_register = dlsym(plugin_item_p->handle, "plugin_register");
-    if ((error = dlerror()) != NULL)
+    return 0;
+}
+
+int plugin_load(char *name)
+{
+    char instance_name[256], object_name[256];
+    struct plugin_object_t *object;
+    struct plugin_item_t *plugin_item_p;
+
+    log_info("Loading %s plugin", name);
+
+    if ((strlen(name) >= sizeof(instance_name)) || split_name(name, instance_name, object_name))
+        return -1;
+
+    pthread_mutex_lock(&plugin_change_lock);
+
+    // Check that plugin is not already loaded
+    pthread_rwlock_rdlock(&plugin_lock);
+    plugin_item_p = find_plugin(instance_name);
+    pthread_rwlock_unlock(&plugin_lock);
+    if (plugin_item_p != NULL)
     {
-        fprintf(stderr, "%s\n", error);
+        pthread_mutex_unlock(&plugin_change_lock);
+        log_error("Plugin already loaded!");
         return -1;
     }
-    plugin = (*plugin_register)();
 
-    // Call plugin unload callback (if defined)
-    if (plugin->unload != NULL)
+    // Instances share the plugin file
+    for (object = plugin_objects; object != NULL; object = object->next)
     {
-        plugin_unload = plugin->unload;
-        (*plugin_unload)();
+        if (strcmp(object->name, object_name) == 0)
+            break;
+    }
+    if ((object == NULL) && open_object(object_name, NULL, &object))
+    {
+        pthread_mutex_unlock(&plugin_change_lock);
+        return -1;
     }
 
-    // Unload plugin
-    if (dlclose(plugin_item_p->handle))
+    plugin_item_p = create_item(instance_name, object);
+    if (plugin_item_p == NULL)
     {
-        fprintf(stderr, "%s\n", error);
+        // Close plugin file if not used by other instances
+        if (object->instances == 0)
+        {
+            plugin_objects = object->next;
+            discard_object(object);
+        }
+        pthread_mutex_unlock(&plugin_change_lock);
         return -1;
     }
 
-    // Remove plugin from list of loaded plugins
-    list_pluck(plugin_list, iter->current);
+    // Add plugin to table of loaded plugins
+    pthread_rwlock_wrlock(&plugin_lock);
+    if (add_plugin(plugin_item_p))
+    {
+        pthread_rwlock_unlock(&plugin_lock);
+        log_error("Failed to add plugin to table of loaded plugins");
+        destroy_item(plugin_item_p);
+        pthread_mutex_unlock(&plugin_change_lock);
+        return -1;
+    }
+    pthread_rwlock_unlock(&plugin_lock);
+    pthread_mutex_unlock(&plugin_change_lock);
+    plugin_changed();
 
     return 0;
 }
 
-void plugin_manager_start(void)
+int plugin_unload(char *name)
 {
-    // Initialize plugins list
-    plugin_list = create_list();
+    struct plugin_item_t *plugin_item_p;
+    int status;
+
+    debug_printf("Unloading plugin %s\n", name);
+
+    pthread_mutex_lock(&plugin_change_lock);
+
+    // Check that the plugin is loaded
+    pthread_rwlock_wrlock(&plugin_lock);
+    plugin_item_p = find_plugin(name);
+    if (plugin_item_p == NULL)
+    {
+        pthread_rwlock_unlock(&plugin_lock);
+        pthread_mutex_unlock(&plugin_change_lock);
+        printf("Error: Plugin not found!\n");
+        return -1;
+    }
+
+    // Remove plugin from table of loaded plugins
+    remove_plugin(plugin_item_p);
+    pthread_rwlock_unlock(&plugin_lock);
+    pthread_mutex_unlock(&plugin_change_lock);
+    plugin_changed();
+
+    // Wait for calls into the plugin to return, other changes may proceed
+    epoch_synchronize();
+
+    // Unload plugin
+    pthread_mutex_lock(&plugin_change_lock);
+    status = destroy_item(plugin_item_p);
+    pthread_mutex_unlock(&plugin_change_lock);
+
+    return status;
 }
 
-void * get_symbol_handle(char *plugin_name, char *symbol)
+/*
+ * plugin_reload() - Replaces loaded plugin by plugin of its current file
+ *
+ * The new plugin is opened next to the old one and new instances of it
+ * take the place of all instances of the old one in the table of loaded
+ * plugins, so requests for them are served throughout. The old plugin is
+ * closed once calls already made into it have returned. If the new plugin
+ * can not be opened the old one stays in place. Reloading a file which has
+ * not been replaced does nothing, except with the isolate option where new
+ * host processes are always started. This also revives instances whose
+ * host has died.
+ */
+
+int plugin_reload(char *name)
 {
-    bool found = false;
-    char *error;
-    void *symbol_handle;
+    struct plugin_object_t *old, *object;
+    struct plugin_item_t **old_items, **items, *plugin_item_p;
+    unsigned int count, created, i;
+    int status;
+
+    log_info("Reloading %s plugin", name);
+
+    pthread_mutex_lock(&plugin_change_lock);
+
+    pthread_rwlock_rdlock(&plugin_lock);
+    plugin_item_p = find_plugin(name);
+    pthread_rwlock_unlock(&plugin_lock);
+    if (plugin_item_p == NULL)
+    {
+        pthread_mutex_unlock(&plugin_change_lock);
+        log_error("Plugin %s is not loaded", name);
+        return -1;
+    }
+    old = plugin_item_p->object;
+
+    status = open_object(old->name, old, &object);
+    if (status != 0)
+    {
+        pthread_mutex_unlock(&plugin_change_lock);
+        if (status > 0)
+            log_info("Plugin %s is unchanged", old->name);
+        return (status > 0) ? 0 : -1;
+    }
 
-    // Find plugin handle
-    list_iter_p iter = list_iterator(plugin_list, FRONT);
-    while (list_next(iter) != NULL)
+    // Find all instances of old plugin, the table does not change meanwhile.
+    // Instances being unloaded are counted by the plugin but not found.
+    old_items = calloc(old->instances, sizeof(struct plugin_item_t *));
+    items = calloc(old->instances, sizeof(struct plugin_item_t *));
+    count = 0;
+    if ((old_items != NULL) && (items != NULL))
     {
-        plugin_item_p = (struct plugin_item_t *)list_current(iter);
-        if (strcmp(plugin_item_p->name, plugin_name) == 0)
+        for (i=0; i<plugin_table_size; i++)
         {
-            found = true;
+            plugin_item_p = plugin_table[i];
+            if ((plugin_item_p != NULL) && (plugin_item_p != PLUGIN_DELETED) &&
+                (plugin_item_p->object == old))
+                old_items[count++] = plugin_item_p;
+        }
+    }
+
+    // Create new instances
+    for (created=0; created<count; created++)
+    {
+        items[created] = create_item(old_items[created]->name, object);
+        if (items[created] == NULL)
             break;
+    }
+
+    // Publish new instances
+    status = -1;
+    if ((count > 0) && (created == count))
+    {
+        pthread_rwlock_wrlock(&plugin_lock);
+        for (i=0; i<count; i++)
+        {
+            if (replace_plugin(old_items[i], items[i]))
+                break;
         }
+        if (i == count)
+            status = 0;
+        else
+        {
+            while (i-- > 0)
+                replace_plugin(items[i], old_items[i]);
+        }
+        pthread_rwlock_unlock(&plugin_lock);
     }
 
-    if (found)
-        debug_printf("Found plugin %s\n", plugin_name);
+    if (status)
+    {
+        log_error("Failed to reload plugin %s", old->name);
+
+        // Close new plugin again, with its last instance if any
+        if (created == 0)
+        {
+            plugin_objects = object->next;
+            discard_object(object);
+        }
+        else
+        {
+            pthread_mutex_unlock(&plugin_change_lock);
+            epoch_synchronize();
+            pthread_mutex_lock(&plugin_change_lock);
+            for (i=0; i<created; i++)
+                destroy_item(items[i]);
+        }
+    }
     else
     {
-        printf("Error: Plugin %s is not found!\n", plugin_name);
-        return NULL;
+        plugin_changed();
+
+        // Wait for calls into the old plugin to return, other changes may proceed
+        pthread_mutex_unlock(&plugin_change_lock);
+        epoch_synchronize();
+        pthread_mutex_lock(&plugin_change_lock);
+
+        for (i=0; i<count; i++)
+        {
+            if (destroy_item(old_items[i]))
+                status = -1;
+        }
     }
 
-    // Resolve symbol handle for plugin
-    symbol_handle = dlsym(plugin_item_p->handle, symbol);
-    if ((error = dlerror()) != NULL)
+    pthread_mutex_unlock(&plugin_change_lock);
+    free(old_items);
+    free(items);
+
+    return status;
+}
+
+static void plugin_table_start(void)
+{
+    // Initialize table of loaded plugins
+    plugin_table_size = PLUGIN_TABLE_SIZE_MIN;
+    plugin_table = calloc(plugin_table_size, sizeof(struct plugin_item_t *));
+    plugin_ids = calloc(PLUGIN_ID_MAX, sizeof(struct plugin_item_t *));
+    if ((plugin_table == NULL) || (plugin_ids == NULL))
     {
-        fprintf(stderr, "%s\n", error);
-        return NULL;
+        printf("Error: malloc() failed\n");
+        exit(EXIT_FAILURE);
     }
+}
 
-    return symbol_handle;
+void plugin_manager_start(void)
+{
+    plugin_table_start();
+
+    // Find available plugins
+    plugin_catalog_start();
 }
 
-int plugin_list_properties(char *plugin_name, char *properties)
+/*
+ * plugin_manager_start_host() - Starts plugin manager of plugin host
+ *
+ * A plugin host only loads the plugin it is started for and does without
+ * the catalog.
+ */
+
+void plugin_manager_start_host(void)
+{
+    plugin_table_start();
+}
+
+/*
+ * get_plugin() - Returns loaded plugin instance
+ *
+ * The caller must be in an epoch. The returned instance and its entry
+ * points stay valid until it exits the epoch, plugins are not destroyed
+ * before that even if they are unloaded or reloaded meanwhile.
+ */
+
+static struct plugin_item_t * get_plugin(char *plugin_name)
 {
-    int (*list__properties)(char *properties);
+    struct plugin_item_t *plugin_item_p;
+
+    // Find plugin
+    pthread_rwlock_rdlock(&plugin_lock);
+    plugin_item_p = find_plugin(plugin_name);
+    pthread_rwlock_unlock(&plugin_lock);
+
+    if (plugin_item_p == NULL)
+    {
+        log_error("Plugin %s is not loaded", plugin_name);
+        return NULL;
+    }
 
-    list__properties = get_symbol_handle(plugin_name, "list_properties");
-    return (*list__properties)(properties);
+    debug_printf("Found plugin %s\n", plugin_name);
+
+    return plugin_item_p;
 }
 
-int plugin_get_char(char *plugin_name, char *variable_name, char *value)
+int plugin_list_properties(char *plugin_name, char *properties, unsigned int size)
 {
-    int (*get__char)(char *name, char *value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, PLUGIN_LIST_PROPERTIES, NULL, properties, size);
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_list_properties(plugin_item_p->instance, properties, size);
+    epoch_exit();
+
+    return ret;
+}
 
-    get__char = get_symbol_handle(plugin_name, "get__char");
-    return (*get__char)(variable_name, value);
+int plugin_get_char(char *plugin_name, char *variable_name, char *value)
+{
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, GET_CHAR, variable_name, value, sizeof(char));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_char(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_get_short(char *plugin_name, char *variable_name, short *value)
 {
-    int (*get__short)(char *name, short *value);
-
-    get__short = get_symbol_handle(plugin_name, "get__short");
-    return (*get__short)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, GET_SHORT, variable_name, value, sizeof(short));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_short(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_get_int(char *plugin_name, char *variable_name, int *value)
 {
-    int (*get__int)(char *name, int *value);
-
-    get__int = get_symbol_handle(plugin_name, "get__int");
-    return (*get__int)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, GET_INT, variable_name, value, sizeof(int));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_int(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_get_long(char *plugin_name, char *variable_name, long *value)
 {
-    int (*get__long)(char *name, long *value);
-
-    get__long = get_symbol_handle(plugin_name, "get__long");
-    return (*get__long)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, GET_LONG, variable_name, value, sizeof(long));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_long(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_get_float(char *plugin_name, char *variable_name, float *value)
 {
-    int (*get__float)(char *name, float *value);
-
-    get__float = get_symbol_handle(plugin_name, "get__float");
-    return (*get__float)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, GET_FLOAT, variable_name, value, sizeof(float));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_float(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_get_double(char *plugin_name, char *variable_name, double *value)
 {
-    int (*get__double)(char *name, double *value);
-
-    get__double = get_symbol_handle(plugin_name, "get__double");
-    return (*get__double)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, GET_DOUBLE, variable_name, value, sizeof(double));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_double(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
-int plugin_get_string(char *plugin_name, char *variable_name, char *value)
-{
-    char *string;
-    char * (*get_string)(char *name);
+/*
+ * copy_string() - Copies string to value of size bytes
+ *
+ * Fails if string is NULL or does not fit.
+ */
 
-    get_string = get_symbol_handle(plugin_name, "get_string");
-    string = (*get_string)(variable_name);
+static int copy_string(char *value, const char *string, unsigned int size)
+{
+    size_t length;
 
     if (string == NULL)
         return -1;
-    else
+
+    length = strlen(string) + 1;
+    if (length > size)
     {
-        strcpy(value, string);
-        return 0;
+        log_error("String of %zu bytes does not fit in %u bytes", length, size);
+        return -1;
     }
+
+    memcpy(value, string, length);
+
+    return 0;
 }
 
-int plugin_set_char(char *plugin_name, char *variable_name, char value)
+int plugin_get_string(char *plugin_name, char *variable_name, char *value, unsigned int size)
 {
-    int (*set_char)(char *name, char value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, GET_STRING, variable_name, value, size);
+    else if (plugin_item_p != NULL)
+        ret = copy_string(value, plugin_item_p->dispatch->instance_get_string(plugin_item_p->instance, variable_name), size);
+    epoch_exit();
+
+    return ret;
+}
 
-    set_char = get_symbol_handle(plugin_name, "set_char");
-    return (*set_char)(variable_name, value);
+int plugin_set_char(char *plugin_name, char *variable_name, char value)
+{
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set(plugin_item_p->host, SET_CHAR, variable_name, &value, sizeof(char));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_char(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_set_short(char *plugin_name, char *variable_name, short value)
 {
-    int (*set_short)(char *name, short value);
-
-    set_short = get_symbol_handle(plugin_name, "set_short");
-    return (*set_short)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set(plugin_item_p->host, SET_SHORT, variable_name, &value, sizeof(short));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_short(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_set_int(char *plugin_name, char *variable_name, int value)
 {
-    int (*set_int)(char *name, int value);
-
-    set_int = get_symbol_handle(plugin_name, "set_int");
-    return (*set_int)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set(plugin_item_p->host, SET_INT, variable_name, &value, sizeof(int));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_int(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_set_long(char *plugin_name, char *variable_name, long value)
 {
-    int (*set_long)(char *name, long value);
-
-    set_long = get_symbol_handle(plugin_name, "set_long");
-    return (*set_long)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set(plugin_item_p->host, SET_LONG, variable_name, &value, sizeof(long));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_long(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_set_float(char *plugin_name, char *variable_name, float value)
 {
-    int (*set_float)(char *name, float value);
-
-    set_float = get_symbol_handle(plugin_name, "set_float");
-    return (*set_float)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set(plugin_item_p->host, SET_FLOAT, variable_name, &value, sizeof(float));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_float(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_set_double(char *plugin_name, char *variable_name, double value)
 {
-    int (*set_double)(char *name, double value);
-
-    set_double = get_symbol_handle(plugin_name, "set_double");
-    return (*set_double)(variable_name, value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set(plugin_item_p->host, SET_DOUBLE, variable_name, &value, sizeof(double));
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_double(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_set_string(char *plugin_name, char *variable_name, char *value)
 {
-    int (*set_string)(char *name, char *value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set(plugin_item_p->host, SET_STRING, variable_name, value, strlen(value) + 1);
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_string(plugin_item_p->instance, variable_name, value);
+    epoch_exit();
+
+    return ret;
+}
 
-    set_string = get_symbol_handle(plugin_name, "set_string");
-    return (*set_string)(variable_name, value);
+int plugin_get_data(char *plugin_name, char *variable_name, unsigned long offset, void *value, unsigned long *length, unsigned long *size)
+{
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get_data(plugin_item_p->host, variable_name, offset, value, length, size);
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_data(plugin_item_p->instance, variable_name, offset, value, length, size);
+    epoch_exit();
+
+    return ret;
+}
+
+int plugin_set_data(char *plugin_name, char *variable_name, unsigned long offset, void *value, unsigned long length, unsigned long size)
+{
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set_data(plugin_item_p->host, variable_name, offset, value, length, size);
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_data(plugin_item_p->instance, variable_name, offset, value, length, size);
+    epoch_exit();
+
+    return ret;
 }
 
 int plugin_run(char *plugin_name, char *command_name, int *return_value)
 {
-    int (*run)(char *name, int *return_value);
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_run(plugin_item_p->host, command_name, return_value);
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_run(plugin_item_p->instance, command_name, return_value);
+    epoch_exit();
+
+    return ret;
+}
+
+int plugin_describe(char *plugin_name, char *name, char *value, unsigned int size)
+{
+    struct plugin_item_t *plugin_item_p;
+    struct plugin_entry_t entry;
+    bool loaded;
+    int ret = -1;
+
+    // Plugins which are not loaded are described by the catalog
+    if (name[0] == 0)
+    {
+        pthread_rwlock_rdlock(&plugin_lock);
+        loaded = (find_plugin(plugin_name) != NULL);
+        pthread_rwlock_unlock(&plugin_lock);
+
+        if (!loaded)
+        {
+            if (plugin_catalog_find(plugin_name, &entry) || (entry.properties < 0))
+                return -1;
+            return copy_string(value, entry.description, size);
+        }
+    }
 
-    run = get_symbol_handle(plugin_name, "run");
-    return (*run)(command_name, return_value);
+    epoch_enter();
+    plugin_item_p = get_plugin(plugin_name);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get(plugin_item_p->host, DESCRIBE, name, value, size);
+    else if (plugin_item_p != NULL)
+        ret = copy_string(value, plugin_item_p->dispatch->instance_describe(plugin_item_p->instance, name), size);
+    epoch_exit();
+
+    return ret;
 }
 
-int plugin_describe(char *plugin_name, char *name, char *value)
+int plugin_resolve(char *plugin_name, char *variable_name, unsigned int *handle)
 {
-    char *string;
-    char * (*describe)(char *name);
+    struct plugin_item_t *plugin_item_p;
+    int index;
+    int ret = -1;
 
-    describe = get_symbol_handle(plugin_name, "describe");
-    string = (*describe)(name);
+    epoch_enter();
 
-    if (string == NULL)
-        return -1;
+    // Find plugin
+    pthread_rwlock_rdlock(&plugin_lock);
+    plugin_item_p = find_plugin(plugin_name);
+    pthread_rwlock_unlock(&plugin_lock);
+
+    if (plugin_item_p == NULL)
+        log_error("Plugin %s is not loaded", plugin_name);
     else
     {
-        strcpy(value, string);
-        return 0;
+        if (plugin_item_p->host != NULL)
+            index = plugin_host_resolve(plugin_item_p->host, variable_name);
+        else
+            index = plugin_item_p->dispatch->instance_resolve_property(plugin_item_p->instance, variable_name);
+        if ((index >= 0) && (index <= 0xFFFF))
+        {
+            *handle = HANDLE(plugin_item_p->id, index);
+            ret = 0;
+        }
     }
+
+    epoch_exit();
+
+    return ret;
+}
+
+/*
+ * find_handle() - Returns loaded plugin referred to by handle
+ *
+ * The caller must be in an epoch, like for get_dispatch().
+ */
+
+static struct plugin_item_t * find_handle(unsigned int handle)
+{
+    struct plugin_item_t *plugin_item_p = NULL;
+
+    pthread_rwlock_rdlock(&plugin_lock);
+    if (HANDLE_ID(handle) < PLUGIN_ID_MAX)
+        plugin_item_p = plugin_ids[HANDLE_ID(handle)];
+    pthread_rwlock_unlock(&plugin_lock);
+
+    return plugin_item_p;
+}
+
+/*
+ * plugin_handle_name() - Returns name of plugin referred to by handle
+ */
+
+int plugin_handle_name(unsigned int handle, char *plugin_name)
+{
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    pthread_rwlock_rdlock(&plugin_lock);
+    if (HANDLE_ID(handle) < PLUGIN_ID_MAX)
+    {
+        plugin_item_p = plugin_ids[HANDLE_ID(handle)];
+        if (plugin_item_p != NULL)
+        {
+            strcpy(plugin_name, plugin_item_p->name);
+            ret = 0;
+        }
+    }
+    pthread_rwlock_unlock(&plugin_lock);
+
+    return ret;
+}
+
+int plugin_get_handle(unsigned int handle, void *value, int *size, int capacity)
+{
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = find_handle(handle);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_get_property(plugin_item_p->host, HANDLE_INDEX(handle), value, size, capacity);
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_get_property(plugin_item_p->instance, HANDLE_INDEX(handle), value, size, capacity);
+    epoch_exit();
+
+    return ret;
+}
+
+int plugin_set_handle(unsigned int handle, void *value, int size)
+{
+    struct plugin_item_t *plugin_item_p;
+    int ret = -1;
+
+    epoch_enter();
+    plugin_item_p = find_handle(handle);
+    if ((plugin_item_p != NULL) && (plugin_item_p->host != NULL))
+        ret = plugin_host_set_property(plugin_item_p->host, HANDLE_INDEX(handle), value, size);
+    else if (plugin_item_p != NULL)
+        ret = plugin_item_p->dispatch->instance_set_property(plugin_item_p->instance, HANDLE_INDEX(handle), value, size);
+    epoch_exit();
+
+    return ret;
 }
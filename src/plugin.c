@@ -33,170 +33,378 @@
 #include <stdarg.h>
 #include <string.h>
 #include "testgear/plugin.h"
+#include "testgear/hash.h"
 
 static struct plugin *plugin;
-static struct plugin_properties *property;
 static FILE *log_file;
 
+const int plugin_abi = PLUGIN_ABI;
+
+/*
+ * Each instance has its own copy of the property table of the plugin, so
+ * values of different instances are stored apart. Instances are used by
+ * one thread at a time, but different instances may be used in parallel.
+ */
+struct plugin_instance
+{
+    char name[256];
+    struct plugin_properties *property;
+    int property_count;
+
+    /*
+     * Property names are indexed in an open addressing hash table (linear
+     * probing) built once when the instance is created. Each slot holds a
+     * property index or -1 if empty.
+     */
+    int *property_index;
+    unsigned int property_index_mask;
+
+    /* Size of DATA property buffers, indexed like the properties */
+    unsigned long *data_size;
+
+    /* Scalar property values, packed by initialize_properties() */
+    void *values;
+
+    void *data; // Instance data of plugin
+};
+
+/* Instance the calling thread acts on, set by the entry points below */
+static __thread struct plugin_instance *instance = NULL;
+
+/*
+ * instance_name() - Returns name of current instance
+ */
+
+const char * instance_name(void)
+{
+    return (instance != NULL) ? instance->name : plugin->name;
+}
+
+void * get_instance_data(void)
+{
+    return (instance != NULL) ? instance->data : NULL;
+}
+
+void set_instance_data(void *data)
+{
+    if (instance != NULL)
+        instance->data = data;
+}
+
 void log_info(const char *format, ...)
 {
     va_list args;
-    fprintf(log_file, "[%s] ", plugin->name);
+    flockfile(log_file);
+    fprintf(log_file, "[%s] ", instance_name());
     va_start(args, format);
     vfprintf(log_file, format, args);
     va_end(args);
     fprintf(log_file, "\n");
+    funlockfile(log_file);
 }
 
 void log_warning(const char *format, ...)
 {
     va_list args;
-    fprintf(log_file, "[%s] Warning: ", plugin->name);
+    flockfile(log_file);
+    fprintf(log_file, "[%s] Warning: ", instance_name());
     va_start(args, format);
     vfprintf(log_file, format, args);
     va_end(args);
     fprintf(log_file, "\n");
+    funlockfile(log_file);
 }
 
 void log_error(const char *format, ...)
 {
     va_list args;
-    fprintf(log_file, "[%s] Error: ", plugin->name);
+    flockfile(log_file);
+    fprintf(log_file, "[%s] Error: ", instance_name());
     va_start(args, format);
     vfprintf(log_file, format, args);
     va_end(args);
     fprintf(log_file, "\n");
+    funlockfile(log_file);
 }
 
-static void verify_properties(struct plugin_properties *property)
+/*
+ * index_properties() - Builds property name index
+ *
+ * Duplicate property names are detected while building the index. As
+ * before, the first property of a given name is the one found.
+ */
+
+static void index_properties(void)
 {
-    int i,j;
+    unsigned int count, size, slot;
+    int i;
+
+    for (count=0; instance->property[count].name; count++);
+    instance->property_count = count;
+
+    instance->data_size = calloc(count + 1, sizeof(unsigned long));
+    if (instance->data_size == NULL)
+        log_error("malloc() failed");
+
+    // Keep index at most half full
+    for (size=16; size < count * 2; size <<= 1);
 
-    // Check for duplicate property names
-    for (i=0; property[i].name; i++)
+    instance->property_index = malloc(size * sizeof(int));
+    if (instance->property_index == NULL)
     {
-        for (j=0; property[j].name; j++)
+        log_error("malloc() failed");
+        return;
+    }
+    memset(instance->property_index, 0xff, size * sizeof(int));
+    instance->property_index_mask = size - 1;
+
+    for (i=0; instance->property[i].name; i++)
+    {
+        slot = hash_string(instance->property[i].name) & instance->property_index_mask;
+        while (instance->property_index[slot] >= 0)
         {
-            // Do not compare itself
-            if (i != j)
+            if (strcmp(instance->property[instance->property_index[slot]].name, instance->property[i].name) == 0)
             {
-                if (strcmp(property[i].name, property[j].name) == 0)
-                    log_warning("Duplicate property name found! (%s)\n", property[i].name);
+                log_warning("Duplicate property name found! (%s)\n", instance->property[i].name);
+                break;
             }
+            slot = (slot + 1) & instance->property_index_mask;
         }
+        if (instance->property_index[slot] < 0)
+            instance->property_index[slot] = i;
     }
 }
 
-static void initialize_properties(struct plugin_properties *property)
+/*
+ * Values of CHAR, SHORT, INT, LONG, FLOAT and DOUBLE properties of an
+ * instance are packed in one cache line aligned block, grouped by type from
+ * the widest type down so that every value is naturally aligned without
+ * padding. Values of a type are in property order, so a bank of registers
+ * declared together is stored together and may be copied as a range.
+ */
+
+#define VALUES_ALIGN 64
+
+static const enum property_type value_types[] = { DOUBLE, LONG, FLOAT, INT, SHORT, CHAR };
+
+static size_t value_size(enum property_type type)
 {
+    switch (type)
+    {
+        case CHAR:
+            return sizeof(char);
+        case SHORT:
+            return sizeof(short);
+        case INT:
+            return sizeof(int);
+        case LONG:
+            return sizeof(long);
+        case FLOAT:
+            return sizeof(float);
+        case DOUBLE:
+            return sizeof(double);
+        default:
+            return 0;
+    }
+}
+
+static int initialize_properties(void)
+{
+    char *value;
+    size_t size = 0;
+    unsigned int t;
     int i;
 
-    for (i=0; property[i].name; i++)
+    for (i=0; instance->property[i].name; i++)
     {
-        switch (property[i].type)
+        switch (instance->property[i].type)
         {
-            case CHAR:
-                property[i].data = malloc(sizeof(char));
-                *((char *)property[i].data) = 0;
-                break;
-            case SHORT:
-                property[i].data = malloc(sizeof(short));
-                *((short *)property[i].data) = 0;
-                break;
-            case INT:
-                property[i].data = malloc(sizeof(int));
-                *((int *)property[i].data) = 0;
-                break;
-            case LONG:
-                property[i].data = malloc(sizeof(long));
-                *((long *)property[i].data) = 0;
-                break;
-            case FLOAT:
-                property[i].data = malloc(sizeof(float));
-                *((float *)property[i].data) = 0;
-                break;
-            case DOUBLE:
-                property[i].data = malloc(sizeof(double));
-                *((double *)property[i].data) = 0;
-                break;
             case STRING:
-                property[i].data = malloc(4);
-                strcpy(property[i].data, "");
+                instance->property[i].data = malloc(4);
+                strcpy(instance->property[i].data, "");
                 break;
             case DATA:
-                property[i].data = NULL;
+                instance->property[i].data = NULL;
                 break;
-            case COMMAND:
             default:
                 break;
         }
     }
+
+    // Lay out scalar values, all zero initially
+    for (i=0; instance->property[i].name; i++)
+        size += value_size(instance->property[i].type);
+    size = (size + VALUES_ALIGN - 1) & ~((size_t) VALUES_ALIGN - 1);
+
+    instance->values = aligned_alloc(VALUES_ALIGN, size > 0 ? size : VALUES_ALIGN);
+    if (instance->values == NULL)
+    {
+        log_error("malloc() failed");
+        return -1;
+    }
+    memset(instance->values, 0, size);
+
+    value = instance->values;
+    for (t=0; t<sizeof(value_types)/sizeof(value_types[0]); t++)
+    {
+        for (i=0; instance->property[i].name; i++)
+        {
+            if (instance->property[i].type == value_types[t])
+            {
+                instance->property[i].data = value;
+                value += value_size(value_types[t]);
+            }
+        }
+    }
+
+    return 0;
 }
 
 int init(struct init_data *data)
 {
     log_file = data->log_file;
-    verify_properties(plugin->properties);
-    initialize_properties(plugin->properties);
     return 0;
 }
 
 void register_plugin(struct plugin *plug)
 {
     plugin = plug;
-    property = plug->properties;
     plug->init = &init;
 }
 
-int list_properties(char *properties)
+static void free_properties(void)
 {
     int i;
-    char buffer[4096] = "";
 
-    // Traverse all variables and commands
-    for (i=0; property[i].name; i++)
+    for (i=0; i<instance->property_count; i++)
     {
-        if (property[i].type != COMMAND)
-        {
-            // Variable found
-            sprintf(buffer, "%s:", property[i].name);
-            strcat(properties, buffer);
-            sprintf(buffer, "%d,", property[i].type);
-            strcat(properties, buffer);
-        } else
+        if ((instance->property[i].type == STRING) || (instance->property[i].type == DATA))
+            free(instance->property[i].data);
+    }
+
+    free(instance->values);
+    free(instance->property);
+    free(instance->property_index);
+    free(instance->data_size);
+}
+
+/*
+ * create_instance() - Creates instance of plugin with own property values
+ *
+ * The load callback of the plugin is called for the new instance.
+ */
+
+struct plugin_instance * create_instance(const char *name)
+{
+    struct plugin_instance *created;
+    int count;
+
+    created = calloc(1, sizeof(struct plugin_instance));
+    if (created == NULL)
+        return NULL;
+    strncpy(created->name, name, sizeof(created->name) - 1);
+
+    for (count=0; plugin->properties[count].name; count++);
+    created->property = malloc((count + 1) * sizeof(struct plugin_properties));
+    if (created->property == NULL)
+    {
+        free(created);
+        return NULL;
+    }
+    memcpy(created->property, plugin->properties, (count + 1) * sizeof(struct plugin_properties));
+
+    instance = created;
+    index_properties();
+    if (initialize_properties())
+    {
+        free_properties();
+        free(created);
+        instance = NULL;
+        return NULL;
+    }
+
+    if (plugin->load != NULL)
+        plugin->load();
+
+    return created;
+}
+
+/*
+ * destroy_instance() - Destroys instance of plugin
+ *
+ * The unload callback of the plugin is called for the instance first.
+ */
+
+void destroy_instance(struct plugin_instance *destroyed)
+{
+    instance = destroyed;
+
+    if (plugin->unload != NULL)
+        plugin->unload();
+
+    free_properties();
+    free(destroyed);
+
+    instance = NULL;
+}
+
+/*
+ * list_properties() - Lists properties as "<name>:<type>" separated by ','
+ *
+ * Fails if the list does not fit in size bytes.
+ */
+
+static int list_properties(char *properties, unsigned int size)
+{
+    unsigned int length = 0;
+    int i, n;
+
+    if (size == 0)
+        return -1;
+    properties[0] = 0;
+
+    // Traverse all variables and commands, appending at end of list
+    for (i=0; instance->property[i].name; i++)
+    {
+        n = snprintf(&properties[length], size - length, "%s%s:%d", length ? "," : "",
+                     instance->property[i].name, instance->property[i].type);
+        if ((n < 0) || ((unsigned int) n >= size - length))
         {
-            // Command found
-            sprintf(buffer, "%s:%d,", property[i].name, COMMAND);
-            strcat(properties, buffer);
+            log_error("Property list does not fit in %u bytes", size);
+            return -1;
         }
+        length += n;
     }
 
-    // Remove trailing ','
-    properties[strlen(properties)-1] = 0;
-
     return 0;
 }
 
 static int find_property(char *name, int type)
 {
+    unsigned int slot;
     int i;
 
+    if ((instance == NULL) || (instance->property_index == NULL))
+        return -1;
+
     // Find property matching name
-    for (i=0; property[i].name; i++)
+    slot = hash_string(name) & instance->property_index_mask;
+    while ((i = instance->property_index[slot]) >= 0)
     {
-        if (strcmp(name, property[i].name) == 0)
+        if (strcmp(name, instance->property[i].name) == 0)
         {
             if (type != -1)
             {
                 // Check matching type
-                if (property[i].type != type)
+                if (instance->property[i].type != type)
                 {
-                    log_warning("Property %s has different type\n", property[i].name);
+                    log_warning("Property %s has different type\n", instance->property[i].name);
                     return -1;
                 }
             }
             return i;
         }
+        slot = (slot + 1) & instance->property_index_mask;
     }
 
     log_error("Property %s not found\n", name);
@@ -205,9 +413,9 @@ static int find_property(char *name, int type)
 
 static int get(int index)
 {
-    if (property[index].get != NULL)
+    if (instance->property[index].get != NULL)
     {
-        if (property[index].get() != 0)
+        if (instance->property[index].get() != 0)
             return -1;
     }
     return 0;
@@ -215,20 +423,20 @@ static int get(int index)
 
 static int set(int index)
 {
-    if (property[index].set != NULL)
+    if (instance->property[index].set != NULL)
     {
-        if (property[index].set() != 0)
+        if (instance->property[index].set() != 0)
             return -1;
     }
     return 0;
 }
 
-int get__char(char *name, char *value)
+static int get__char(char *name, char *value)
 {
     int i = find_property(name, CHAR);
     if (i >= 0)
     {
-        *value = *((char *)property[i].data);
+        *value = *((char *)instance->property[i].data);
         return get(i);
     }
 
@@ -251,19 +459,19 @@ int set_char(char *name, char value)
     int i = find_property(name, CHAR);
     if (i >= 0)
     {
-        *((char *)property[i].data) = value;
+        *((char *)instance->property[i].data) = value;
         return set(i);
     }
 
     return -1;
 }
 
-int get__short(char *name, short *value)
+static int get__short(char *name, short *value)
 {
     int i = find_property(name, SHORT);
     if (i >= 0)
     {
-        *value = *((short *)property[i].data);
+        *value = *((short *)instance->property[i].data);
         return get(i);
     }
 
@@ -286,19 +494,19 @@ int set_short(char *name, short value)
     int i = find_property(name, SHORT);
     if (i >= 0)
     {
-        *((short *)property[i].data) = value;
+        *((short *)instance->property[i].data) = value;
         return set(i);
     }
 
     return -1;
 }
 
-int get__int(char *name, int *value)
+static int get__int(char *name, int *value)
 {
     int i = find_property(name, INT);
     if (i >= 0)
     {
-        *value = *((int *)property[i].data);
+        *value = *((int *)instance->property[i].data);
         return get(i);
     }
 
@@ -321,19 +529,19 @@ int set_int(char *name, int value)
     int i = find_property(name, INT);
     if (i >= 0)
     {
-        *((int *)property[i].data) = value;
+        *((int *)instance->property[i].data) = value;
         return set(i);
     }
 
     return -1;
 }
 
-int get__long(char *name, long *value)
+static int get__long(char *name, long *value)
 {
     int i = find_property(name, LONG);
     if (i >= 0)
     {
-        *value = *((long *)property[i].data);
+        *value = *((long *)instance->property[i].data);
         return get(i);
     }
 
@@ -356,19 +564,19 @@ int set_long(char *name, long value)
     int i = find_property(name, LONG);
     if (i >= 0)
     {
-        *((long *)property[i].data) = value;
+        *((long *)instance->property[i].data) = value;
         return set(i);
     }
 
     return -1;
 }
 
-int get__float(char *name, float *value)
+static int get__float(char *name, float *value)
 {
     int i = find_property(name, FLOAT);
     if (i >= 0)
     {
-        *value = *((float *)property[i].data);
+        *value = *((float *)instance->property[i].data);
         return get(i);
     }
 
@@ -391,19 +599,19 @@ int set_float(char *name, float value)
     int i = find_property(name, FLOAT);
     if (i >= 0)
     {
-        *((float *)property[i].data) = value;
+        *((float *)instance->property[i].data) = value;
         return set(i);
     }
 
     return -1;
 }
 
-int get__double(char *name, double *value)
+static int get__double(char *name, double *value)
 {
     int i = find_property(name, DOUBLE);
     if (i >= 0)
     {
-        *value = *((double *)property[i].data);
+        *value = *((double *)instance->property[i].data);
         return get(i);
     }
 
@@ -426,7 +634,7 @@ int set_double(char *name, double value)
     int i = find_property(name, DOUBLE);
     if (i >= 0)
     {
-        *((double *)property[i].data) = value;
+        *((double *)instance->property[i].data) = value;
         return set(i);
     }
 
@@ -450,7 +658,7 @@ char * get_string(char *name)
     // Lookup property
     int i = find_property(name, STRING);
     if (i >= 0)
-        return (char *)property[i].data;
+        return (char *)instance->property[i].data;
 
     // Property not found
     return NULL;
@@ -470,18 +678,25 @@ int set_string(char *name, char *value)
     if (strcmp(name, "license") == 0)
         return -1;
 
+    // Reject strings which can not be returned to clients
+    if (strlen(value) >= PLUGIN_STRING_MAX)
+    {
+        log_error("String value for %s exceeds %d bytes", name, PLUGIN_STRING_MAX - 1);
+        return -1;
+    }
+
     // Lookup variable
     int i = find_property(name, STRING);
     if (i >= 0)
     {
         // Free previously allocated memory
-        free(property[i].data);
+        free(instance->property[i].data);
 
         // Reallocate new memory
-        property[i].data = malloc(strlen(value)+1);
+        instance->property[i].data = malloc(strlen(value)+1);
 
         // Set new string
-        strcpy(property[i].data, value);
+        strcpy(instance->property[i].data, value);
 
         return 0;
     }
@@ -489,14 +704,218 @@ int set_string(char *name, char *value)
     return -1;
 }
 
-int run(char *command_name, int *return_value)
+/*
+ * resolve_property() - Returns index of variable for handle based access
+ */
+
+static int resolve_property(char *name)
+{
+    int i = find_property(name, -1);
+
+    if ((i < 0) || (instance->property[i].type == COMMAND) || (instance->property[i].type == DATA))
+        return -1;
+
+    return i;
+}
+
+static int property_size(int index)
+{
+    switch (instance->property[index].type)
+    {
+        case CHAR:
+            return sizeof(char);
+        case SHORT:
+            return sizeof(short);
+        case INT:
+            return sizeof(int);
+        case LONG:
+            return sizeof(long);
+        case FLOAT:
+            return sizeof(float);
+        case DOUBLE:
+            return sizeof(double);
+        default:
+            return 0;
+    }
+}
+
+/*
+ * get__property() - Gets variable by index
+ *
+ * The value is copied to value, which holds capacity bytes, and its size
+ * returned in size. Strings are copied including the terminating zero.
+ */
+
+static int get__property(int index, void *value, int *size, int capacity)
+{
+    int length;
+
+    if ((index < 0) || (index >= instance->property_count))
+        return -1;
+
+    switch (instance->property[index].type)
+    {
+        case STRING:
+            length = strlen(instance->property[index].data) + 1;
+            if (length > capacity)
+                return -1;
+            memcpy(value, instance->property[index].data, length);
+            *size = length;
+            return 0;
+        case DATA:
+        case COMMAND:
+            return -1;
+        default:
+            if (property_size(index) > capacity)
+                return -1;
+            *size = property_size(index);
+            memcpy(value, instance->property[index].data, *size);
+            return get(index);
+    }
+}
+
+/*
+ * set__property() - Sets variable by index
+ *
+ * Strings are taken up to their terminating zero or size bytes and must be
+ * shorter than PLUGIN_STRING_MAX, other values must match the size of the
+ * variable type.
+ */
+
+static int set__property(int index, void *value, int size)
+{
+    size_t length;
+    char *string;
+
+    if ((index < 0) || (index >= instance->property_count))
+        return -1;
+
+    switch (instance->property[index].type)
+    {
+        case STRING:
+            // String ends at its terminating zero or at size
+            if (size < 0)
+                return -1;
+            length = strnlen(value, size);
+            if (length >= PLUGIN_STRING_MAX)
+                return -1;
+            string = malloc(length + 1);
+            if (string == NULL)
+                return -1;
+            memcpy(string, value, length);
+            string[length] = 0;
+            free(instance->property[index].data);
+            instance->property[index].data = string;
+            return 0;
+        case DATA:
+        case COMMAND:
+            return -1;
+        default:
+            if (size != property_size(index))
+                return -1;
+            memcpy(instance->property[index].data, value, size);
+            return set(index);
+    }
+}
+
+/*
+ * get__data() - Gets chunk of DATA variable
+ *
+ * Copies up to *length bytes starting at offset to value. The number of
+ * bytes copied is returned in length and the total size of the data in
+ * size. The get callback is called when a transfer starts (offset 0).
+ */
+
+static int get__data(char *name, unsigned long offset, void *value, unsigned long *length, unsigned long *size)
+{
+    int i = find_property(name, DATA);
+    if (i < 0)
+        return -1;
+
+    if ((offset == 0) && (get(i) != 0))
+        return -1;
+
+    *size = instance->data_size[i];
+    if (offset > *size)
+        return -1;
+    if (*length > *size - offset)
+        *length = *size - offset;
+
+    memcpy(value, (char *) instance->property[i].data + offset, *length);
+
+    return 0;
+}
+
+/*
+ * set__data() - Sets chunk of DATA variable
+ *
+ * A transfer starts at offset 0, which (re)allocates the data to the given
+ * total size of up to PLUGIN_DATA_MAX bytes. The set callback is called when
+ * the last chunk is written.
+ */
+
+static int set__data(char *name, unsigned long offset, void *value, unsigned long length, unsigned long size)
+{
+    void *data;
+
+    int i = find_property(name, DATA);
+    if (i < 0)
+        return -1;
+
+    if (offset == 0)
+    {
+        if (size > PLUGIN_DATA_MAX)
+        {
+            log_error("Size of %s exceeds %lu bytes", name, (unsigned long) PLUGIN_DATA_MAX);
+            return -1;
+        }
+
+        data = realloc(instance->property[i].data, size > 0 ? size : 1);
+        if (data == NULL)
+        {
+            log_error("malloc() failed");
+            return -1;
+        }
+        instance->property[i].data = data;
+        instance->data_size[i] = size;
+    }
+    else if (size != instance->data_size[i])
+        return -1;
+
+    if ((offset > size) || (length > size - offset))
+        return -1;
+
+    memcpy((char *) instance->property[i].data + offset, value, length);
+
+    if (offset + length == size)
+        return set(i);
+
+    return 0;
+}
+
+void * get_data(char *name, unsigned long *size)
+{
+    int i = find_property(name, DATA);
+    if (i < 0)
+        return NULL;
+
+    *size = instance->data_size[i];
+    return instance->property[i].data;
+}
+
+int set_data(char *name, void *value, unsigned long size)
+{
+    return set__data(name, 0, value, size, size);
+}
+
+static int run(char *command_name, int *return_value)
 {
     int (*function)(void);
 
     int i = find_property(command_name, COMMAND);
     if (i >= 0)
     {
-        function = property[i].function;
+        function = instance->property[i].function;
         *return_value = (*function)();
         return 0;
     }
@@ -505,7 +924,7 @@ int run(char *command_name, int *return_value)
     return -1;
 }
 
-char * describe(char *name)
+static char * describe(char *name)
 {
     int i;
 
@@ -526,8 +945,148 @@ char * describe(char *name)
     // Lookup property
     i = find_property(name, -1);
     if (i >= 0)
-        return (char *)property[i].description;
+        return (char *)instance->property[i].description;
 
     // Variable or command not found
     return NULL;
 }
+
+/*
+ * === Entry points ===
+ *
+ * The daemon calls into an instance through these. They make the instance
+ * current for the calling thread, for the functions above and for the
+ * callbacks of the plugin.
+ */
+
+int instance_list_properties(struct plugin_instance *context, char *properties, unsigned int size)
+{
+    instance = context;
+    return list_properties(properties, size);
+}
+
+int instance_get_char(struct plugin_instance *context, char *name, char *value)
+{
+    instance = context;
+    return get__char(name, value);
+}
+
+int instance_get_short(struct plugin_instance *context, char *name, short *value)
+{
+    instance = context;
+    return get__short(name, value);
+}
+
+int instance_get_int(struct plugin_instance *context, char *name, int *value)
+{
+    instance = context;
+    return get__int(name, value);
+}
+
+int instance_get_long(struct plugin_instance *context, char *name, long *value)
+{
+    instance = context;
+    return get__long(name, value);
+}
+
+int instance_get_float(struct plugin_instance *context, char *name, float *value)
+{
+    instance = context;
+    return get__float(name, value);
+}
+
+int instance_get_double(struct plugin_instance *context, char *name, double *value)
+{
+    instance = context;
+    return get__double(name, value);
+}
+
+char * instance_get_string(struct plugin_instance *context, char *name)
+{
+    instance = context;
+    return get_string(name);
+}
+
+int instance_set_char(struct plugin_instance *context, char *name, char value)
+{
+    instance = context;
+    return set_char(name, value);
+}
+
+int instance_set_short(struct plugin_instance *context, char *name, short value)
+{
+    instance = context;
+    return set_short(name, value);
+}
+
+int instance_set_int(struct plugin_instance *context, char *name, int value)
+{
+    instance = context;
+    return set_int(name, value);
+}
+
+int instance_set_long(struct plugin_instance *context, char *name, long value)
+{
+    instance = context;
+    return set_long(name, value);
+}
+
+int instance_set_float(struct plugin_instance *context, char *name, float value)
+{
+    instance = context;
+    return set_float(name, value);
+}
+
+int instance_set_double(struct plugin_instance *context, char *name, double value)
+{
+    instance = context;
+    return set_double(name, value);
+}
+
+int instance_set_string(struct plugin_instance *context, char *name, char *value)
+{
+    instance = context;
+    return set_string(name, value);
+}
+
+int instance_get_data(struct plugin_instance *context, char *name, unsigned long offset, void *value, unsigned long *length, unsigned long *size)
+{
+    instance = context;
+    return get__data(name, offset, value, length, size);
+}
+
+int instance_set_data(struct plugin_instance *context, char *name, unsigned long offset, void *value, unsigned long length, unsigned long size)
+{
+    instance = context;
+    return set__data(name, offset, value, length, size);
+}
+
+int instance_run(struct plugin_instance *context, char *name, int *return_value)
+{
+    instance = context;
+    return run(name, return_value);
+}
+
+char * instance_describe(struct plugin_instance *context, char *name)
+{
+    instance = context;
+    return describe(name);
+}
+
+int instance_resolve_property(struct plugin_instance *context, char *name)
+{
+    instance = context;
+    return resolve_property(name);
+}
+
+int instance_get_property(struct plugin_instance *context, int index, void *value, int *size, int capacity)
+{
+    instance = context;
+    return get__property(index, value, size, capacity);
+}
+
+int instance_set_property(struct plugin_instance *context, int index, void *value, int size)
+{
+    instance = context;
+    return set__property(index, value, size);
+}
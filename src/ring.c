@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "testgear/ring.h"
+
+static unsigned int round_up_power_of_two(unsigned int size)
+{
+    unsigned int power = 1;
+
+    while (power < size)
+        power <<= 1;
+
+    return power;
+}
+
+int ring_init(struct ring_t *ring, unsigned int size)
+{
+    ring->size = round_up_power_of_two(size);
+    ring->head = 0;
+    ring->tail = 0;
+
+    ring->data = malloc(ring->size);
+    if (ring->data == NULL)
+        return -1;
+
+    return 0;
+}
+
+void ring_destroy(struct ring_t *ring)
+{
+    free(ring->data);
+    ring->data = NULL;
+}
+
+/*
+ * ring_grow() - Grows ring buffer to hold at least size bytes
+ *
+ * Buffered data is linearized at the start of the new buffer.
+ */
+
+int ring_grow(struct ring_t *ring, unsigned int size)
+{
+    struct ring_t new_ring;
+    unsigned int used = ring_used(ring);
+
+    if (size <= ring->size)
+        return 0;
+
+    if (ring_init(&new_ring, size))
+        return -1;
+
+    ring_peek(ring, new_ring.data, used);
+    new_ring.head = used;
+
+    free(ring->data);
+    *ring = new_ring;
+
+    return 0;
+}
+
+unsigned int ring_used(struct ring_t *ring)
+{
+    return ring->head - ring->tail;
+}
+
+unsigned int ring_available(struct ring_t *ring)
+{
+    return ring->size - ring_used(ring);
+}
+
+/*
+ * ring_write_pointer() - Returns contiguous free space at head of ring
+ */
+
+void * ring_write_pointer(struct ring_t *ring, unsigned int *length)
+{
+    unsigned int offset = ring->head & (ring->size - 1);
+    unsigned int contiguous = ring->size - offset;
+
+    if (contiguous > ring_available(ring))
+        contiguous = ring_available(ring);
+
+    *length = contiguous;
+
+    return &ring->data[offset];
+}
+
+void ring_commit(struct ring_t *ring, unsigned int length)
+{
+    ring->head += length;
+}
+
+/*
+ * ring_write() - Copies data to head of ring (caller checks for room)
+ */
+
+void ring_write(struct ring_t *ring, const void *buffer, unsigned int length)
+{
+    unsigned int offset = ring->head & (ring->size - 1);
+    unsigned int first = ring->size - offset;
+
+    if (first >= length)
+        memcpy(&ring->data[offset], buffer, length);
+    else
+    {
+        memcpy(&ring->data[offset], buffer, first);
+        memcpy(ring->data, (const char *) buffer + first, length - first);
+    }
+
+    ring->head += length;
+}
+
+/*
+ * ring_read_pointer() - Returns contiguous buffered data at tail of ring
+ */
+
+void * ring_read_pointer(struct ring_t *ring, unsigned int *length)
+{
+    unsigned int offset = ring->tail & (ring->size - 1);
+    unsigned int contiguous = ring->size - offset;
+
+    if (contiguous > ring_used(ring))
+        contiguous = ring_used(ring);
+
+    *length = contiguous;
+
+    return &ring->data[offset];
+}
+
+/*
+ * ring_peek() - Copies data from tail of ring without consuming it
+ */
+
+void ring_peek(struct ring_t *ring, void *buffer, unsigned int length)
+{
+    unsigned int offset = ring->tail & (ring->size - 1);
+    unsigned int first = ring->size - offset;
+
+    if (first >= length)
+        memcpy(buffer, &ring->data[offset], length);
+    else
+    {
+        memcpy(buffer, &ring->data[offset], first);
+        memcpy((char *) buffer + first, ring->data, length - first);
+    }
+}
+
+void ring_consume(struct ring_t *ring, unsigned int length)
+{
+    ring->tail += length;
+
+    // Rewind empty ring so next read gets maximum contiguous space
+    if (ring->tail == ring->head)
+    {
+        ring->tail = 0;
+        ring->head = 0;
+    }
+}
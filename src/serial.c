@@ -0,0 +1,757 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <termios.h>
+#include "testgear/debug.h"
+#include "testgear/log.h"
+#include "testgear/event.h"
+#include "testgear/client.h"
+#include "testgear/message.h"
+#include "testgear/ring.h"
+#include "testgear/crc32c.h"
+#include "testgear/serial.h"
+
+/*
+ * === Serial transport ===
+ *
+ * Each message is sent as one frame:
+ *
+ *   COBS(message, CRC-32C of message (4 bytes)), 0x00
+ *
+ * COBS encoding removes all zero bytes from the frame, so the zero
+ * delimiter can always be found again after line noise or a restart of
+ * either side. Frames which do not decode to a message starting with the
+ * message prefix and matching its CRC and length are dropped, and
+ * reception continues with the next frame.
+ *
+ * The device is served as one client connection. Decoded messages are
+ * queued until read by the message handler, which is woken up through an
+ * eventfd while messages are waiting. Reading from the device is paused
+ * while too many decoded messages are waiting, and responses are held back
+ * while too many encoded frames are waiting to be written.
+ */
+
+#define SERIAL_CRC_SIZE 4
+#define SERIAL_FRAME_MAX (MSG_HEADER_SIZE + MSG_PAYLOAD_MAX + SERIAL_CRC_SIZE + (MSG_HEADER_SIZE + MSG_PAYLOAD_MAX + SERIAL_CRC_SIZE) / 254 + 1)
+#define SERIAL_RX_HIGH (256 * 1024) // Stop reading device when exceeded
+#define SERIAL_TX_HIGH (256 * 1024) // Stop taking responses when exceeded
+#define SERIAL_REOPEN_PERIOD 1      // Seconds between attempts to reopen device
+
+/* Serial port state */
+struct serial_port_t
+{
+    struct event_loop_t *loop;
+    struct message_io_t *io;
+    const char *device;
+    speed_t speed;
+    struct event_handler_t handler;
+    struct event_handler_t reopen;
+    unsigned int events;
+    struct client_t *client;
+
+    // Frame being received
+    unsigned char *frame;
+    unsigned int frame_length;
+    unsigned int frame_size;
+    bool discarding; // Frame too long, skip to next delimiter
+    struct ring_t rx; // Decoded messages
+
+    // Message being taken from client for transmission
+    unsigned char *message;
+    unsigned int message_length;
+    unsigned int message_size;
+    unsigned char *encoded;
+    unsigned int encoded_size;
+    struct ring_t tx; // Encoded frames
+
+    unsigned long errors;
+};
+
+static struct serial_port_t port;
+
+static const struct
+{
+    int baud;
+    speed_t speed;
+} serial_speeds[] =
+{
+    {     9600,     B9600 },
+    {    19200,    B19200 },
+    {    38400,    B38400 },
+    {    57600,    B57600 },
+    {   115200,   B115200 },
+    {   230400,   B230400 },
+    {   460800,   B460800 },
+    {   500000,   B500000 },
+    {   576000,   B576000 },
+    {   921600,   B921600 },
+    {  1000000,  B1000000 },
+    {  1152000,  B1152000 },
+    {  1500000,  B1500000 },
+    {  2000000,  B2000000 },
+    {  2500000,  B2500000 },
+    {  3000000,  B3000000 },
+    {  3500000,  B3500000 },
+    {  4000000,  B4000000 },
+};
+
+/*
+ * cobs_encode() - Encodes data with Consistent Overhead Byte Stuffing
+ *
+ * The destination must hold length + length / 254 + 1 bytes. Returns
+ * encoded length.
+ */
+
+static unsigned int cobs_encode(const unsigned char *source, unsigned int length, unsigned char *destination)
+{
+    unsigned int read = 0, write = 1, code_index = 0;
+    unsigned char code = 1;
+
+    while (read < length)
+    {
+        if (source[read] == 0)
+        {
+            destination[code_index] = code;
+            code = 1;
+            code_index = write++;
+            read++;
+        }
+        else
+        {
+            destination[write++] = source[read++];
+            if (++code == 0xff)
+            {
+                destination[code_index] = code;
+                code = 1;
+                code_index = write++;
+            }
+        }
+    }
+
+    destination[code_index] = code;
+
+    return write;
+}
+
+/*
+ * cobs_decode() - Decodes COBS encoded data (may be done in place)
+ *
+ * Returns decoded length or -1 if data is not validly encoded.
+ */
+
+static int cobs_decode(const unsigned char *source, unsigned int length, unsigned char *destination)
+{
+    unsigned int read = 0, write = 0;
+    unsigned char code;
+    unsigned int i;
+
+    while (read < length)
+    {
+        code = source[read++];
+        if ((code == 0) || (code - 1 > length - read))
+            return -1;
+
+        for (i=1; i<code; i++)
+            destination[write++] = source[read++];
+
+        if ((code < 0xff) && (read < length))
+            destination[write++] = 0;
+    }
+
+    return write;
+}
+
+static void serial_update_events(void)
+{
+    unsigned int events = 0;
+
+    if (ring_used(&port.rx) < SERIAL_RX_HIGH)
+        events |= EPOLLIN;
+    if (ring_used(&port.tx) > 0)
+        events |= EPOLLOUT;
+
+    if (events != port.events)
+    {
+        port.events = events;
+        event_modify(port.loop, &port.handler, events);
+    }
+}
+
+/*
+ * serial_frame_received() - Verifies received frame and queues its message
+ */
+
+static void serial_frame_received(void)
+{
+    unsigned int payload_length;
+    uint32_t crc;
+    int length;
+
+    if (port.discarding || (port.frame_length == 0))
+        return;
+
+    length = cobs_decode(port.frame, port.frame_length, port.frame);
+    if (length < MSG_HEADER_SIZE + SERIAL_CRC_SIZE)
+        goto invalid;
+
+    length -= SERIAL_CRC_SIZE;
+    memcpy(&crc, &port.frame[length], SERIAL_CRC_SIZE);
+    memcpy(&payload_length, &port.frame[6], sizeof(unsigned int));
+
+    if ((crc != crc32c(0, port.frame, length)) ||
+        (port.frame[0] != MSG_PREFIX) ||
+        (payload_length != (unsigned int) length - MSG_HEADER_SIZE))
+        goto invalid;
+
+    if ((ring_available(&port.rx) < (unsigned int) length) &&
+        ring_grow(&port.rx, ring_used(&port.rx) + length))
+    {
+        log_error("malloc() failed");
+        return;
+    }
+    ring_write(&port.rx, port.frame, length);
+
+    return;
+
+invalid:
+    port.errors++;
+    debug_printf("Dropping invalid serial frame (%lu dropped)\n", port.errors);
+}
+
+/*
+ * serial_add_frame_data() - Appends received data to current frame
+ */
+
+static void serial_add_frame_data(const unsigned char *data, unsigned int length)
+{
+    unsigned char *frame;
+    unsigned int size;
+
+    if (port.discarding)
+        return;
+
+    if (port.frame_length + length > SERIAL_FRAME_MAX)
+    {
+        port.discarding = true;
+        port.errors++;
+        return;
+    }
+
+    if (port.frame_length + length > port.frame_size)
+    {
+        size = port.frame_size ? port.frame_size : 4096;
+        while (size < port.frame_length + length)
+            size *= 2;
+        frame = realloc(port.frame, size);
+        if (frame == NULL)
+        {
+            log_error("malloc() failed");
+            port.discarding = true;
+            return;
+        }
+        port.frame = frame;
+        port.frame_size = size;
+    }
+
+    memcpy(&port.frame[port.frame_length], data, length);
+    port.frame_length += length;
+}
+
+static void serial_hangup(struct client_t *client);
+
+/*
+ * serial_receive() - Receives and decodes frames from device
+ */
+
+static void serial_receive(struct client_t *client)
+{
+    unsigned char buffer[4096];
+    unsigned char *data, *delimiter;
+    bool waiting = ring_used(&port.rx) > 0;
+    int size;
+
+    while (ring_used(&port.rx) < SERIAL_RX_HIGH)
+    {
+        size = read(port.handler.fd, buffer, sizeof(buffer));
+        if (size < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if (errno == EINTR)
+                continue;
+        }
+        if (size <= 0)
+        {
+            serial_hangup(client);
+            return;
+        }
+
+        // Split data into frames
+        data = buffer;
+        while ((delimiter = memchr(data, 0, size)) != NULL)
+        {
+            serial_add_frame_data(data, delimiter - data);
+            serial_frame_received();
+            port.frame_length = 0;
+            port.discarding = false;
+            size -= delimiter - data + 1;
+            data = delimiter + 1;
+        }
+        serial_add_frame_data(data, size);
+    }
+
+    // Wake up message handler
+    if (!waiting && (ring_used(&port.rx) > 0))
+    {
+        if (eventfd_write(client->fd, 1) < 0)
+            log_error("eventfd_write() failed (%s)", strerror(errno));
+    }
+
+    serial_update_events();
+}
+
+/*
+ * serial_transmit() - Writes encoded frames to device
+ */
+
+static int serial_transmit(struct client_t *client)
+{
+    void *buffer;
+    unsigned int length;
+    int size;
+
+    while (ring_used(&port.tx) > 0)
+    {
+        buffer = ring_read_pointer(&port.tx, &length);
+        size = write(port.handler.fd, buffer, length);
+        if (size < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if (errno == EINTR)
+                continue;
+            serial_hangup(client);
+            return -1;
+        }
+        ring_consume(&port.tx, size);
+    }
+
+    serial_update_events();
+
+    return 0;
+}
+
+/*
+ * serial_encode_message() - Encodes complete message into frame
+ */
+
+static int serial_encode_message(void)
+{
+    unsigned int length = port.message_length + SERIAL_CRC_SIZE;
+    unsigned int size = length + length / 254 + 2;
+    unsigned char *encoded;
+    uint32_t crc;
+
+    crc = crc32c(0, port.message, port.message_length);
+    memcpy(&port.message[port.message_length], &crc, SERIAL_CRC_SIZE);
+
+    if (size > port.encoded_size)
+    {
+        encoded = realloc(port.encoded, size);
+        if (encoded == NULL)
+            return -1;
+        port.encoded = encoded;
+        port.encoded_size = size;
+    }
+
+    length = cobs_encode(port.message, length, port.encoded);
+    port.encoded[length++] = 0;
+
+    if ((ring_available(&port.tx) < length) &&
+        ring_grow(&port.tx, ring_used(&port.tx) + length))
+        return -1;
+    ring_write(&port.tx, port.encoded, length);
+
+    return 0;
+}
+
+/*
+ * serial_reserve_message() - Makes room for message and CRC
+ */
+
+static int serial_reserve_message(unsigned int size)
+{
+    unsigned char *message;
+
+    size += SERIAL_CRC_SIZE;
+    if (size <= port.message_size)
+        return 0;
+
+    message = realloc(port.message, size);
+    if (message == NULL)
+        return -1;
+
+    port.message = message;
+    port.message_size = size;
+
+    return 0;
+}
+
+/*
+ * serial_writev() - Takes messages from client for transmission
+ *
+ * The message stream is split into messages again, each of which is
+ * encoded into one frame.
+ */
+
+int serial_writev(struct client_t *client, const struct iovec *iov, int count)
+{
+    unsigned int payload_length, expected, length;
+    const unsigned char *data;
+    unsigned int remaining;
+    int size = 0;
+    int i;
+
+    if (ring_used(&port.tx) >= SERIAL_TX_HIGH)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (i=0; i<count; i++)
+    {
+        data = iov[i].iov_base;
+        remaining = iov[i].iov_len;
+
+        while (remaining > 0)
+        {
+            // Message length is known once header is complete
+            expected = MSG_HEADER_SIZE;
+            if (port.message_length >= MSG_HEADER_SIZE)
+            {
+                memcpy(&payload_length, &port.message[6], sizeof(unsigned int));
+                expected += payload_length;
+            }
+
+            length = expected - port.message_length;
+            if (length > remaining)
+                length = remaining;
+
+            if (serial_reserve_message(expected))
+            {
+                log_error("malloc() failed");
+                errno = ENOMEM;
+                return -1;
+            }
+
+            memcpy(&port.message[port.message_length], data, length);
+            port.message_length += length;
+            data += length;
+            remaining -= length;
+            size += length;
+
+            if (port.message_length < MSG_HEADER_SIZE)
+                continue;
+
+            memcpy(&payload_length, &port.message[6], sizeof(unsigned int));
+            if (port.message_length == MSG_HEADER_SIZE + payload_length)
+            {
+                if (serial_encode_message())
+                {
+                    log_error("malloc() failed");
+                    errno = ENOMEM;
+                    return -1;
+                }
+                port.message_length = 0;
+            }
+        }
+    }
+
+    if (serial_transmit(client))
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    return size;
+}
+
+/*
+ * serial_read() - Reads decoded messages
+ */
+
+int serial_read(struct client_t *client, void *buffer, int length)
+{
+    eventfd_t value;
+
+    if ((ring_used(&port.rx) == 0) || (length == 0))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if ((unsigned int) length > ring_used(&port.rx))
+        length = ring_used(&port.rx);
+
+    ring_peek(&port.rx, buffer, length);
+    ring_consume(&port.rx, length);
+
+    // All messages read, wait for next wake up
+    if (ring_used(&port.rx) == 0)
+        eventfd_read(client->fd, &value);
+
+    serial_update_events();
+
+    return length;
+}
+
+int serial_close(struct client_t *client)
+{
+    struct itimerspec timer;
+
+    // Already closed on hang up
+    if (!client->connected)
+        return 0;
+
+    event_remove(client->loop, &client->handler);
+    event_remove(client->loop, &port.handler);
+    close(client->fd);
+    close(port.handler.fd);
+    client->connected = false;
+
+    // Drop partial frames and messages of closed connection
+    port.client = NULL;
+    port.frame_length = 0;
+    port.discarding = false;
+    port.message_length = 0;
+    ring_consume(&port.rx, ring_used(&port.rx));
+    ring_consume(&port.tx, ring_used(&port.tx));
+
+    // Try to reopen device periodically
+    memset(&timer, 0, sizeof(timer));
+    timer.it_interval.tv_sec = SERIAL_REOPEN_PERIOD;
+    timer.it_value.tv_sec = SERIAL_REOPEN_PERIOD;
+    timerfd_settime(port.reopen.fd, 0, &timer, NULL);
+
+    return 0;
+}
+
+static void serial_hangup(struct client_t *client)
+{
+    debug_printf("Serial device %s hung up\n", port.device);
+    serial_close(client);
+}
+
+static void serial_client_event(int fd, unsigned int events, void *data)
+{
+    struct client_t *client = data;
+
+    if (events & EPOLLIN)
+        handle_incoming_message(client);
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+static void serial_device_event(int fd, unsigned int events, void *data)
+{
+    struct client_t *client = port.client;
+
+    if (events & EPOLLOUT)
+    {
+        // Resume taking responses once frames have been written
+        if ((serial_transmit(client) == 0) &&
+            (ring_used(&port.tx) < SERIAL_TX_HIGH) &&
+            (client->tx_length > 0))
+            handle_outgoing_messages(client);
+    }
+
+    if (client->connected && (events & EPOLLIN))
+        serial_receive(client);
+    else if (client->connected && (events & (EPOLLHUP | EPOLLERR)))
+        serial_hangup(client);
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * serial_open() - Opens and configures device and creates its connection
+ */
+
+static int serial_open(void)
+{
+    struct termios tio;
+    struct client_t *client;
+    int fd, wakeup_fd;
+
+    fd = open(port.device, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+    {
+        debug_printf("Opening serial device %s failed (%s)\n", port.device, strerror(errno));
+        return -1;
+    }
+
+    // Raw 8N1 without modem control
+    if (tcgetattr(fd, &tio) < 0)
+    {
+        log_error("tcgetattr() failed (%s)", strerror(errno));
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    cfsetispeed(&tio, port.speed);
+    cfsetospeed(&tio, port.speed);
+    if (tcsetattr(fd, TCSANOW, &tio) < 0)
+    {
+        log_error("tcsetattr() failed (%s)", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Discard anything received before we were ready
+    tcflush(fd, TCIOFLUSH);
+
+    wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakeup_fd < 0)
+    {
+        log_error("eventfd() failed (%s)", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    client = client_create(port.loop, wakeup_fd, port.io, &serial_client_event);
+    if (client == NULL)
+    {
+        close(wakeup_fd);
+        close(fd);
+        return -1;
+    }
+    client->tx_events = 0; // Device writability is handled here
+    snprintf(client->address, sizeof(client->address), "%s", port.device);
+
+    port.client = client;
+    port.handler.fd = fd;
+    port.handler.callback = &serial_device_event;
+    port.handler.data = NULL;
+    port.events = EPOLLIN;
+    if (event_add(port.loop, &port.handler, port.events))
+    {
+        serial_close(client);
+        client_destroy(client);
+        return -1;
+    }
+
+    log_info("Serving serial device %s\n", port.device);
+
+    return 0;
+}
+
+static void serial_reopen_event(int fd, unsigned int events, void *data)
+{
+    struct itimerspec timer;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0)
+        return;
+
+    if ((port.client == NULL) && (serial_open() == 0))
+    {
+        memset(&timer, 0, sizeof(timer));
+        timerfd_settime(fd, 0, &timer, NULL);
+    }
+}
+
+/*
+ * serial_server_start() - Starts serving serial device
+ *
+ * The device is opened in raw mode at the given baud rate. If it goes
+ * away (eg. USB serial adapter unplugged) it is reopened once available
+ * again.
+ */
+
+void serial_server_start(struct event_loop_t *loop, const char *device, int baud, struct message_io_t *io)
+{
+    unsigned int i;
+
+    port.loop = loop;
+    port.io = io;
+    port.device = device;
+
+    for (i=0; i<sizeof(serial_speeds)/sizeof(serial_speeds[0]); i++)
+    {
+        if (serial_speeds[i].baud == baud)
+            break;
+    }
+    if (i == sizeof(serial_speeds)/sizeof(serial_speeds[0]))
+    {
+        printf("Error: Unsupported baud rate %d\n", baud);
+        exit(EXIT_FAILURE);
+    }
+    port.speed = serial_speeds[i].speed;
+
+    if (ring_init(&port.rx, 65536) || ring_init(&port.tx, 65536))
+    {
+        printf("Error: malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    port.reopen.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (port.reopen.fd < 0)
+    {
+        perror("Error: timerfd_create() call failed");
+        exit(EXIT_FAILURE);
+    }
+    port.reopen.callback = &serial_reopen_event;
+    port.reopen.data = NULL;
+    if (event_add(loop, &port.reopen, EPOLLIN))
+        exit(EXIT_FAILURE);
+
+    if (serial_open() != 0)
+    {
+        printf("Error: Unable to open serial device %s (%s)\n", device, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include "testgear/debug.h"
+#include "testgear/log.h"
+#include "testgear/event.h"
+#include "testgear/client.h"
+#include "testgear/message.h"
+#include "testgear/unix.h"
+#include "testgear/shm.h"
+
+/*
+ * === Shared memory transport ===
+ *
+ * For clients on the same host requests and responses are exchanged through
+ * two rings in shared memory, so message data is never copied through the
+ * kernel.
+ *
+ * A client connects to the UNIX domain socket of the server and receives a
+ * shm_hello_t message carrying four descriptors (SCM_RIGHTS):
+ *
+ *   0: memfd holding the control page followed by the request ring and the
+ *      response ring, each hello.ring_size bytes
+ *   1: eventfd the client signals when requests are written
+ *   2: eventfd the server signals when responses are written or room is
+ *      made in the request ring
+ *   3: eventfd the client signals when room is made in the response ring
+ *
+ * The rings carry the normal message stream (see message.c). Each side
+ * only writes the index it owns. Before blocking, a consumer sets
+ * consumer_waiting and checks the ring again, and a producer that finds
+ * the ring full sets producer_waiting and checks again. The other side only
+ * signals the eventfd if it clears such a flag, so no system call is made
+ * while both sides are busy. The eventfds are non-blocking, clients wait
+ * for them with poll(). The connection lasts as long as the socket is open.
+ */
+
+/* Shared memory connection state */
+struct shm_connection_t
+{
+    struct client_t *client;
+    struct event_handler_t socket_handler;
+    struct event_handler_t room_handler;
+    int request_fd;
+    int response_fd;
+    struct shm_control_t *control;
+    char *requests;
+    char *responses;
+    size_t size;
+};
+
+static int server_socket;
+static struct event_handler_t server_handler;
+static struct message_io_t *shm_io;
+
+static void shm_signal(int fd)
+{
+    if (eventfd_write(fd, 1) < 0)
+        debug_printf("Signalling shared memory peer failed (%s)\n", strerror(errno));
+}
+
+int shm_writev(struct client_t *client, const struct iovec *iov, int count)
+{
+    struct shm_connection_t *connection = client->io_data;
+    struct shm_ring_t *ring = &connection->control->responses;
+    uint32_t head = ring->head;
+    uint32_t tail, room, offset, length, first;
+    int size = 0;
+    int i;
+
+    tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > SHM_RING_SIZE)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    room = SHM_RING_SIZE - (head - tail);
+    if (room == 0)
+    {
+        // Ask client for a signal once it has made room
+        __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+        room = SHM_RING_SIZE - (head - tail);
+        if (room == 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    for (i=0; (i<count) && (room > 0); i++)
+    {
+        length = iov[i].iov_len < room ? iov[i].iov_len : room;
+        offset = (head + size) & (SHM_RING_SIZE - 1);
+        first = SHM_RING_SIZE - offset;
+
+        if (first >= length)
+            memcpy(&connection->responses[offset], iov[i].iov_base, length);
+        else
+        {
+            memcpy(&connection->responses[offset], iov[i].iov_base, first);
+            memcpy(connection->responses, (char *) iov[i].iov_base + first, length - first);
+        }
+
+        size += length;
+        room -= length;
+    }
+
+    __atomic_store_n(&ring->head, head + size, __ATOMIC_SEQ_CST);
+
+    // Wake client if it waits for responses
+    if (__atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+        shm_signal(connection->response_fd);
+
+    debug_printf("Sending SHM data (%4d bytes)\n", size);
+
+    return size;
+}
+
+/*
+ * shm_wait_requests() - Asks client for a signal once it writes requests
+ *
+ * The request notification is only reset once the ring has been emptied,
+ * so the level triggered event loop keeps calling while requests are left
+ * in the ring.
+ */
+
+static void shm_wait_requests(struct client_t *client, struct shm_ring_t *ring, uint32_t tail)
+{
+    eventfd_t value;
+
+    eventfd_read(client->fd, &value);
+    __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+
+    // Requests written before the flag was seen
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != tail)
+        shm_signal(client->fd);
+}
+
+/*
+ * shm_read() - Reads requests from shared memory
+ */
+
+int shm_read(struct client_t *client, void *buffer, int length)
+{
+    struct shm_connection_t *connection = client->io_data;
+    struct shm_ring_t *ring = &connection->control->requests;
+    uint32_t tail = ring->tail;
+    uint32_t head, used, offset, first;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    used = head - tail;
+    if (used == 0)
+    {
+        shm_wait_requests(client, ring, tail);
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (used > SHM_RING_SIZE)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    if (length == 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (used > (uint32_t) length)
+        used = length;
+
+    offset = tail & (SHM_RING_SIZE - 1);
+    first = SHM_RING_SIZE - offset;
+    if (first >= used)
+        memcpy(buffer, &connection->requests[offset], used);
+    else
+    {
+        memcpy(buffer, &connection->requests[offset], first);
+        memcpy((char *) buffer + first, connection->requests, used - first);
+    }
+
+    __atomic_store_n(&ring->tail, tail + used, __ATOMIC_SEQ_CST);
+
+    // Saves an extra pass of the event loop to find the ring empty
+    if (tail + used == head)
+        shm_wait_requests(client, ring, head);
+
+    // Wake client if it waits for room
+    if (__atomic_exchange_n(&ring->producer_waiting, 0, __ATOMIC_SEQ_CST))
+        shm_signal(connection->response_fd);
+
+    debug_printf("Received SHM data (%4d bytes)\n", used);
+
+    return used;
+}
+
+int shm_close(struct client_t *client)
+{
+    struct shm_connection_t *connection = client->io_data;
+
+    event_remove(client->loop, &client->handler);
+    event_remove(client->loop, &connection->socket_handler);
+    event_remove(client->loop, &connection->room_handler);
+    close(client->fd);
+    close(connection->socket_handler.fd);
+    close(connection->room_handler.fd);
+    close(connection->response_fd);
+    munmap(connection->control, connection->size);
+    free(connection);
+
+    client->io_data = NULL;
+    client->connected = false;
+    return 0;
+}
+
+static void shm_client_event(int fd, unsigned int events, void *data)
+{
+    struct client_t *client = data;
+
+    if (events & EPOLLIN)
+        handle_incoming_message(client);
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * shm_room_event() - Resumes sending once client has made room
+ */
+
+static void shm_room_event(int fd, unsigned int events, void *data)
+{
+    struct client_t *client = data;
+    eventfd_t value;
+
+    eventfd_read(fd, &value);
+
+    handle_outgoing_messages(client);
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * shm_socket_event() - Closes connection when client closes socket
+ *
+ * Nothing but hang up is expected on the socket.
+ */
+
+static void shm_socket_event(int fd, unsigned int events, void *data)
+{
+    struct client_t *client = data;
+
+    debug_printf("Client connection (%s) hung up\n", client->address);
+    shm_close(client);
+    client_destroy(client);
+}
+
+/*
+ * shm_send_hello() - Passes shared memory and eventfds to client
+ */
+
+static int shm_send_hello(int socket, int fds[4])
+{
+    struct shm_hello_t hello;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(4 * sizeof(int))];
+
+    hello.magic = SHM_MAGIC;
+    hello.ring_size = SHM_RING_SIZE;
+
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(4 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 4 * sizeof(int));
+
+    if (sendmsg(socket, &msg, MSG_NOSIGNAL) != sizeof(hello))
+    {
+        log_error("Sending shared memory to client failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * shm_connect() - Sets up shared memory connection of accepted client
+ */
+
+static int shm_connect(struct event_loop_t *loop, int socket)
+{
+    struct shm_connection_t *connection;
+    struct client_t *client;
+    int fds[4] = { -1, -1, -1, -1 };
+    void *memory = MAP_FAILED;
+    size_t size = SHM_DATA_OFFSET + 2 * SHM_RING_SIZE;
+    int i;
+
+    connection = calloc(1, sizeof(struct shm_connection_t));
+    if (connection == NULL)
+    {
+        log_error("malloc() failed");
+        return -1;
+    }
+
+    // Create shared memory which the client can not resize under us
+    fds[0] = memfd_create("testgeard", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if ((fds[0] < 0) ||
+        (ftruncate(fds[0], size) < 0) ||
+        (fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0))
+    {
+        log_error("Creating shared memory failed (%s)", strerror(errno));
+        goto error;
+    }
+
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    if (memory == MAP_FAILED)
+    {
+        log_error("mmap() failed (%s)", strerror(errno));
+        goto error;
+    }
+
+    for (i=1; i<4; i++)
+    {
+        fds[i] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fds[i] < 0)
+        {
+            log_error("eventfd() failed (%s)", strerror(errno));
+            goto error;
+        }
+    }
+
+    connection->control = memory;
+    connection->requests = (char *) memory + SHM_DATA_OFFSET;
+    connection->responses = connection->requests + SHM_RING_SIZE;
+    connection->size = size;
+    connection->request_fd = fds[1];
+    connection->response_fd = fds[2];
+
+    // Server waits for requests right away
+    connection->control->requests.consumer_waiting = 1;
+
+    if (shm_send_hello(socket, fds) != 0)
+        goto error;
+
+    // Client holds its own reference to the shared memory
+    close(fds[0]);
+    fds[0] = -1;
+
+    client = client_create(loop, fds[1], shm_io, &shm_client_event);
+    if (client == NULL)
+        goto error;
+
+    client->io_data = connection;
+    client->tx_events = 0; // Room is signalled through room eventfd
+    unix_peer_address(socket, client->address, sizeof(client->address));
+    connection->client = client;
+
+    connection->socket_handler.fd = socket;
+    connection->socket_handler.callback = &shm_socket_event;
+    connection->socket_handler.data = client;
+    connection->room_handler.fd = fds[3];
+    connection->room_handler.callback = &shm_room_event;
+    connection->room_handler.data = client;
+    if (event_add(loop, &connection->socket_handler, EPOLLIN | EPOLLRDHUP) ||
+        event_add(loop, &connection->room_handler, EPOLLIN))
+    {
+        shm_close(client);
+        client_destroy(client);
+        return 0;
+    }
+
+    debug_printf("Incoming shared memory connection from client (%s)\n", client->address);
+
+    return 0;
+
+error:
+    for (i=0; i<4; i++)
+    {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    if (memory != MAP_FAILED)
+        munmap(memory, size);
+    free(connection);
+    return -1;
+}
+
+static void shm_accept_event(int fd, unsigned int events, void *data)
+{
+    struct event_loop_t *loop = data;
+    int client_socket;
+
+    // Accept all pending connections
+    while (1)
+    {
+        client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if ((errno == EINTR) || (errno == ECONNABORTED))
+                continue;
+            log_error("accept() call failed (%s)", strerror(errno));
+            break;
+        }
+
+        if (shm_connect(loop, client_socket) != 0)
+            close(client_socket);
+    }
+}
+
+/*
+ * shm_server_start() - Starts shared memory server
+ *
+ * Clients connect through the UNIX domain socket at path.
+ */
+
+void shm_server_start(struct event_loop_t *loop, const char *path, struct message_io_t *io)
+{
+    shm_io = io;
+
+    server_socket = unix_listen(path);
+
+    // Register server socket in event loop
+    server_handler.fd = server_socket;
+    server_handler.callback = &shm_accept_event;
+    server_handler.data = loop;
+    if (event_add(loop, &server_handler, EPOLLIN))
+    {
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    debug_printf("Listening for incoming shared memory connections on %s...\n", path);
+}
@@ -28,9 +28,13 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,10 +43,43 @@
 #include <string.h>
 #include "testgear/options.h"
 #include "testgear/debug.h"
+#include "testgear/log.h"
+#include "testgear/event.h"
+#include "testgear/client.h"
 #include "testgear/message.h"
+#include "testgear/uring.h"
+#include "testgear/tcp.h"
+
+/* Connection state when served through io_uring */
+struct tcp_connection_t
+{
+    struct client_t *client;
+    struct uring_op_t recv_op;
+    struct uring_op_t send_op;
+    bool receiving;              // Multishot receive armed
+    bool cancelling;             // Receive being cancelled
+    bool sending;
+    struct msghdr msg;
+    struct iovec iov[CLIENT_IOV_MAX];
+};
+
+/*
+ * Accepting is paused for this many milliseconds when accept() fails for
+ * lack of resources (eg. out of file descriptors), which is not resolved by
+ * trying again right away.
+ */
+#define TCP_ACCEPT_BACKOFF 100
 
-int server_socket, client_socket;
-static bool connected = false;
+/* Listening socket, one per event loop */
+struct tcp_server_t
+{
+    int socket;
+    struct event_loop_t *loop;
+    struct message_io_t *io;
+    struct event_handler_t handler;
+    struct uring_op_t accept_op;
+    struct wheel_timer_t accept_timer;
+};
 
 void tcp_dump_data(void *data, int length)
 {
@@ -63,28 +100,37 @@ void tcp_dump_data(void *data, int length)
     }
 }
 
-int tcp_write(void *buffer, int length)
+int tcp_writev(struct client_t *client, const struct iovec *iov, int count)
 {
-    int size;
+    struct msghdr msg;
+    int size, length, i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = count;
 
-    size = write(client_socket, buffer, length);
+    size = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
 
     // Debug
-    debug_printf("Sending TCP data (%4d bytes):  ", size);
-    tcp_dump_data(buffer, size);
-    debug_printf_raw("\n");
+    if (size > 0)
+    {
+        debug_printf("Sending TCP data (%4d bytes):  ", size);
+        for (i=0, length=size; (i<count) && (length>0); length-=iov[i].iov_len, i++)
+            tcp_dump_data(iov[i].iov_base, length < (int) iov[i].iov_len ? length : (int) iov[i].iov_len);
+        debug_printf_raw("\n");
+    }
 
     return size;
 }
 
-int tcp_read(void *buffer, int length)
+int tcp_read(struct client_t *client, void *buffer, int length)
 {
     int size;
 
-    size = read(client_socket, buffer, length);
+    size = read(client->fd, buffer, length);
 
     // Debug
-    if (size)
+    if (size > 0)
     {
         debug_printf("Received TCP data (%4d bytes): ", size);
         tcp_dump_data(buffer, size);
@@ -94,34 +140,442 @@ int tcp_read(void *buffer, int length)
     return size;
 }
 
-int tcp_close(void)
+int tcp_close(struct client_t *client)
 {
-    close(client_socket);
-    connected = false;
+    event_remove(client->loop, &client->handler);
+    close(client->fd);
+    client->connected = false;
     return 0;
 }
 
+static void tcp_client_event(int fd, unsigned int events, void *data)
+{
+    struct client_t *client = data;
+
+    if (events & EPOLLOUT)
+        handle_outgoing_messages(client);
+
+    if (client->connected && (events & EPOLLIN))
+        handle_incoming_message(client);
+    else if (client->connected && (events & (EPOLLHUP | EPOLLERR)))
+    {
+        debug_printf("Client connection (%s) hung up\n", client->address);
+        tcp_close(client);
+    }
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+static void tcp_accept_resume(void *data)
+{
+    struct tcp_server_t *server = data;
+
+    if (event_add(server->loop, &server->handler, EPOLLIN))
+        event_timer_start(server->loop, &server->accept_timer, TCP_ACCEPT_BACKOFF);
+}
+
+static void tcp_accept_event(int fd, unsigned int events, void *data)
+{
+    struct tcp_server_t *server = data;
+    struct sockaddr_in client_address;
+    struct client_t *client;
+    socklen_t sin_size;
+    int client_socket, flag = 1;
+
+    // Accept all pending connections
+    while (1)
+    {
+        sin_size = sizeof(struct sockaddr_in);
+        client_socket = accept4(server->socket, (struct sockaddr *) &client_address,
+                                &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if ((errno == EINTR) || (errno == ECONNABORTED))
+                continue;
+            log_error("accept() call failed (%s), pausing", strerror(errno));
+
+            // Socket stays readable, so stop watching it for a while
+            event_remove(server->loop, &server->handler);
+            server->accept_timer.callback = &tcp_accept_resume;
+            server->accept_timer.data = server;
+            event_timer_start(server->loop, &server->accept_timer, TCP_ACCEPT_BACKOFF);
+            break;
+        }
+
+        // Disable Nagle, messages are small and latency sensitive
+        setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        client = client_create(server->loop, client_socket, server->io, &tcp_client_event);
+        if (client == NULL)
+        {
+            close(client_socket);
+            continue;
+        }
+
+        strncpy(client->address, inet_ntoa(client_address.sin_addr), sizeof(client->address) - 1);
+
+        debug_printf("Incoming connection from client (%s)\n", client->address);
+    }
+}
+
+/*
+ * === io_uring data path ===
+ *
+ * Connections are accepted by one multishot accept and each connection
+ * receives through a multishot receive into the provided buffers of the
+ * ring, so no system call is made per received chunk. Queued responses are
+ * handed to the ring as one sendmsg per flush, submitted together with
+ * those of other connections.
+ *
+ * The client holds a reference (pending) for each operation in flight, so
+ * it is not destroyed before the kernel is done with its buffers.
+ */
+
+static void tcp_uring_release(struct client_t *client)
+{
+    struct tcp_connection_t *connection = client->io_data;
+
+    // Close once kernel is done with the socket
+    if ((connection == NULL) || connection->receiving || connection->sending)
+        return;
+
+    close(client->fd);
+    free(connection);
+    client->io_data = NULL;
+}
+
+static void tcp_uring_receive(struct tcp_connection_t *connection)
+{
+    struct client_t *client = connection->client;
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(client->loop->uring, &connection->recv_op);
+    if (sqe == NULL)
+    {
+        client->io->close(client);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+
+    connection->receiving = true;
+    client->pending++;
+}
+
+static void tcp_uring_receive_complete(struct uring_op_t *op, int result, unsigned int flags)
+{
+    struct tcp_connection_t *connection = op->data;
+    struct client_t *client = connection->client;
+    struct uring_t *ring = client->loop->uring;
+
+    if (result > 0)
+    {
+        if (client->connected)
+        {
+            debug_printf("Received TCP data (%4d bytes): ", result);
+            tcp_dump_data(uring_buffer(ring, flags), result);
+            debug_printf_raw("\n");
+
+            handle_received_data(client, uring_buffer(ring, flags), result);
+        }
+        uring_recycle_buffer(ring, flags);
+    }
+    else if ((result == 0) && client->connected)
+    {
+        debug_printf("Client closed connection\n");
+        client->io->close(client);
+    }
+    else if ((result < 0) && (result != -ENOBUFS) && (result != -ECANCELED) && client->connected)
+    {
+        debug_printf("Receive from client failed (%s)\n", strerror(-result));
+        client->io->close(client);
+    }
+
+    // Multishot receive terminated (closed, cancelled or out of buffers)
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        connection->receiving = false;
+        connection->cancelling = false;
+        client->pending--;
+
+        if (client->connected && (client->events & EPOLLIN))
+            tcp_uring_receive(connection);
+        else if (!client->connected)
+            tcp_uring_release(client);
+    }
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+static void tcp_uring_send_complete(struct uring_op_t *op, int result, unsigned int flags)
+{
+    struct tcp_connection_t *connection = op->data;
+    struct client_t *client = connection->client;
+
+    connection->sending = false;
+    client->pending--;
+
+    if (client->connected)
+    {
+        if (result >= 0)
+        {
+            client_sent(client, result);
+            handle_outgoing_messages(client);
+        }
+        else
+        {
+            debug_printf("Write to client failed (%s)\n", strerror(-result));
+            client->io->close(client);
+        }
+    }
+
+    if (!client->connected)
+    {
+        tcp_uring_release(client);
+        client_destroy(client);
+    }
+}
+
+/*
+ * tcp_uring_writev() - Queues send of data in io_uring
+ *
+ * Nothing is written right away, so this always fails with EAGAIN. The
+ * client is told how much was sent once the send completes.
+ */
+
+int tcp_uring_writev(struct client_t *client, const struct iovec *iov, int count)
+{
+    struct tcp_connection_t *connection = client->io_data;
+    struct io_uring_sqe *sqe;
+
+    if (!client->connected)
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    // One send at a time keeps the data in order
+    if (!connection->sending)
+    {
+        sqe = uring_get_sqe(client->loop->uring, &connection->send_op);
+        if (sqe == NULL)
+            return -1;
+
+        memcpy(connection->iov, iov, count * sizeof(struct iovec));
+        memset(&connection->msg, 0, sizeof(connection->msg));
+        connection->msg.msg_iov = connection->iov;
+        connection->msg.msg_iovlen = count;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = client->fd;
+        sqe->addr = (unsigned long) &connection->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+
+        connection->sending = true;
+        client->pending++;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/*
+ * tcp_uring_events() - Pauses or resumes receiving from client
+ */
+
+int tcp_uring_events(struct client_t *client, unsigned int events)
+{
+    struct tcp_connection_t *connection = client->io_data;
+    struct io_uring_sqe *sqe;
+
+    if (!client->connected)
+        return 0;
+
+    if ((events & EPOLLIN) && !connection->receiving)
+        tcp_uring_receive(connection);
+    else if (!(events & EPOLLIN) && connection->receiving && !connection->cancelling)
+    {
+        // Receive is re-armed on completion if resumed in the meantime
+        sqe = uring_get_sqe(client->loop->uring, NULL);
+        if (sqe == NULL)
+            return -1;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (unsigned long) &connection->recv_op;
+        connection->cancelling = true;
+    }
+
+    return 0;
+}
+
+/*
+ * tcp_uring_close() - Closes client connection
+ *
+ * Operations in flight are terminated by shutting down the socket. The
+ * socket is closed once they have completed.
+ */
+
+int tcp_uring_close(struct client_t *client)
+{
+    if (!client->connected)
+        return 0;
+
+    client->connected = false;
+    shutdown(client->fd, SHUT_RDWR);
+    tcp_uring_release(client);
+
+    return 0;
+}
+
+static void tcp_uring_accept(struct tcp_server_t *server);
+
+static void tcp_uring_accept_resume(void *data)
+{
+    tcp_uring_accept(data);
+}
+
+static void tcp_uring_accept_pause(struct tcp_server_t *server)
+{
+    server->accept_timer.callback = &tcp_uring_accept_resume;
+    server->accept_timer.data = server;
+    event_timer_start(server->loop, &server->accept_timer, TCP_ACCEPT_BACKOFF);
+}
+
+static void tcp_uring_accept_complete(struct uring_op_t *op, int result, unsigned int flags)
+{
+    struct tcp_server_t *server = op->data;
+    struct tcp_connection_t *connection;
+    struct sockaddr_in client_address;
+    struct client_t *client;
+    socklen_t sin_size = sizeof(struct sockaddr_in);
+    int flag = 1;
+
+    if ((result < 0) && (result != -EINTR) && (result != -ECONNABORTED) && (result != -ECANCELED))
+    {
+        log_error("accept() call failed (%s), pausing", strerror(-result));
+
+        // Accept is rearmed after a while, failing again right away otherwise
+        if (!(flags & IORING_CQE_F_MORE))
+            tcp_uring_accept_pause(server);
+        return;
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+        tcp_uring_accept(server);
+
+    if (result < 0)
+        return;
+
+    // Disable Nagle, messages are small and latency sensitive
+    setsockopt(result, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+    connection = calloc(1, sizeof(struct tcp_connection_t));
+    if (connection == NULL)
+    {
+        log_error("malloc() failed");
+        close(result);
+        return;
+    }
+
+    client = client_create(server->loop, result, server->io, NULL);
+    if (client == NULL)
+    {
+        free(connection);
+        close(result);
+        return;
+    }
+
+    connection->client = client;
+    connection->recv_op.complete = &tcp_uring_receive_complete;
+    connection->recv_op.data = connection;
+    connection->send_op.complete = &tcp_uring_send_complete;
+    connection->send_op.data = connection;
+    client->io_data = connection;
+    client->tx_events = 0;
+
+    if (getpeername(result, (struct sockaddr *) &client_address, &sin_size) == 0)
+        strncpy(client->address, inet_ntoa(client_address.sin_addr), sizeof(client->address) - 1);
+
+    debug_printf("Incoming connection from client (%s)\n", client->address);
+
+    tcp_uring_receive(connection);
+}
+
+static void tcp_uring_accept(struct tcp_server_t *server)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = uring_get_sqe(server->loop->uring, &server->accept_op);
+    if (sqe == NULL)
+    {
+        // Submission queue is full, accepting is retried after a while
+        log_error("Failed to queue accept, pausing");
+        tcp_uring_accept_pause(server);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->socket;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
 /*
  * tcp_server_start() - Starts TCP server
  *
- * This will listen for any incoming connections on provided port.
- * Receiving and sending of data will be performed by the test gear message
- * protocol handler ( handle_incoming_message() )
+ * This will listen for any incoming connections on provided port. Each
+ * accepted connection is served by the event loop. Receiving and sending of
+ * data will be performed by the test gear message protocol handler
+ * ( handle_incoming_message() )
+ *
+ * If the event loop uses io_uring, connections are served through the ring
+ * and the tcp_uring_*() functions must be used as message I/O.
+ *
+ * If shared, the port may be bound by several servers (SO_REUSEPORT), each
+ * started on its own event loop. The kernel then spreads the incoming
+ * connections across them.
  */
 
-void tcp_server_start(int port)
+void tcp_server_start(struct event_loop_t *loop, int port, struct message_io_t *io, bool shared)
 {
-    int rc, length = sizeof(int);
+    int rc, flag = 1;
     struct sockaddr_in server_address;
-    struct sockaddr_in client_address;
+    struct tcp_server_t *server;
+
+    server = calloc(1, sizeof(struct tcp_server_t));
+    if (server == NULL)
+    {
+        printf("Error: malloc() failed\n");
+        exit(EXIT_FAILURE);
+    }
+    server->loop = loop;
+    server->io = io;
 
     // Create a reliable stream socket using TCP/IP
-    if ((server_socket = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+    if ((server->socket = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP)) < 0)
     {
         perror("Error: socket() call failed");
         exit (-1);
     }
 
+    // Allow quick restart of server
+    setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+
+    // Let the kernel balance connections between servers sharing the port
+    if (shared && (setsockopt(server->socket, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) < 0))
+    {
+        perror("Error: setsockopt() SO_REUSEPORT failed");
+        exit(-1);
+    }
+
     // Construct the server address structure
     memset(&server_address, 0, sizeof(server_address));
     server_address.sin_family = AF_INET;
@@ -129,40 +583,40 @@ void tcp_server_start(int port)
     server_address.sin_addr.s_addr = htonl(INADDR_ANY);
 
     // Assign server address to socket
-    if ((rc = bind(server_socket, (struct sockaddr *) &server_address, sizeof(server_address))) < 0)
+    if ((rc = bind(server->socket, (struct sockaddr *) &server_address, sizeof(server_address))) < 0)
     {
         perror("Error: bind() call failed");
-        close(server_socket);
+        close(server->socket);
         exit(-1);
     }
 
-    // Only allow 1 client to be connected at any time
-    if((rc = listen(server_socket, 1)) < 0)
+    // Allow many clients to be connected at the same time
+    if((rc = listen(server->socket, SOMAXCONN)) < 0)
     {
         perror("Error: listen() call failed");
-        close(server_socket);
+        close(server->socket);
         exit (-1);
     }
 
-    debug_printf("Listening for incoming client connection on port %d...\n", port);
-
-    while (1)
+    // Accept through io_uring
+    if (loop->uring != NULL)
     {
-        // Wait and accept any incoming connection
-        socklen_t sin_size = sizeof(struct sockaddr_in);
-        if ((client_socket = accept(server_socket, (struct sockaddr *) &client_address, (socklen_t *) &sin_size)) < 0)
-        {
-            perror("Error: accept() call failed");
-            close(server_socket);
-            exit (-1);
-        }
-
-        connected = true;
-
-        debug_printf("Incoming connection from client (%s)\n", inet_ntoa(client_address.sin_addr));
+        server->accept_op.complete = &tcp_uring_accept_complete;
+        server->accept_op.data = server;
+        tcp_uring_accept(server);
+        debug_printf("Listening for incoming client connections on port %d (io_uring)...\n", port);
+        return;
+    }
 
-        // Process incoming messages
-        while (connected)
-            handle_incoming_message();
+    // Register server socket in event loop
+    server->handler.fd = server->socket;
+    server->handler.callback = &tcp_accept_event;
+    server->handler.data = server;
+    if (event_add(loop, &server->handler, EPOLLIN))
+    {
+        close(server->socket);
+        exit(-1);
     }
+
+    debug_printf("Listening for incoming client connections on port %d...\n", port);
 }
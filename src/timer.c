@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <string.h>
+#include "testgear/timer.h"
+
+/*
+ * === Timer wheel ===
+ *
+ * Hierarchical timer wheel with TIMER_LEVELS levels of TIMER_SLOTS slots.
+ * A slot of level 0 holds the timers expiring in one tick, a slot of level
+ * n covers TIMER_SLOTS^n ticks. Timers are put in the lowest level which
+ * reaches their expiry time. Whenever level 0 wraps around, the timers of
+ * the next slot of level 1 are moved down to level 0, and so on.
+ *
+ * Adding and removing a timer takes constant time, which matters since
+ * timers are restarted for each connection and request. Ticks without
+ * timers are skipped using a bitmap of occupied slots per level.
+ *
+ * Timers further away than the wheel reaches are put in the last slot
+ * within reach and moved on from there.
+ */
+
+#define LEVEL_SHIFT(level) ((level) * TIMER_SLOT_BITS)
+
+void timer_wheel_init(struct timer_wheel_t *wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(struct timer_wheel_t));
+    wheel->now = now;
+}
+
+static void timer_wheel_insert(struct timer_wheel_t *wheel, struct wheel_timer_t *timer)
+{
+    uint64_t expires = timer->expires;
+    unsigned int level, slot;
+
+    // Expired timers are run by the next tick
+    if (expires < wheel->now)
+        expires = wheel->now;
+
+    for (level = 0; level < TIMER_LEVELS - 1; level++)
+    {
+        if (expires - wheel->now < ((uint64_t) 1 << LEVEL_SHIFT(level + 1)))
+            break;
+    }
+
+    // Beyond reach of the wheel
+    if (expires - wheel->now >= ((uint64_t) 1 << LEVEL_SHIFT(TIMER_LEVELS)))
+        expires = wheel->now + ((uint64_t) 1 << LEVEL_SHIFT(TIMER_LEVELS)) - 1;
+
+    slot = (expires >> LEVEL_SHIFT(level)) & TIMER_SLOT_MASK;
+
+    timer->next = wheel->slots[level][slot];
+    if (timer->next != NULL)
+        timer->next->prev = &timer->next;
+    timer->prev = &wheel->slots[level][slot];
+    wheel->slots[level][slot] = timer;
+    wheel->occupied[level] |= (uint64_t) 1 << slot;
+}
+
+static void timer_wheel_unlink(struct timer_wheel_t *wheel, struct wheel_timer_t *timer)
+{
+    *timer->prev = timer->next;
+    if (timer->next != NULL)
+        timer->next->prev = timer->prev;
+    timer->prev = NULL;
+}
+
+/*
+ * timer_wheel_add() - Starts timer expiring at given tick
+ *
+ * A pending timer is restarted.
+ */
+
+void timer_wheel_add(struct timer_wheel_t *wheel, struct wheel_timer_t *timer, uint64_t expires)
+{
+    if (timer_pending(timer))
+        timer_wheel_remove(wheel, timer);
+
+    timer->expires = expires;
+    timer_wheel_insert(wheel, timer);
+    wheel->count++;
+}
+
+/*
+ * timer_wheel_remove() - Stops timer (has no effect if not pending)
+ *
+ * The occupied bit of the slot is left set, it is cleared once the slot is
+ * reached.
+ */
+
+void timer_wheel_remove(struct timer_wheel_t *wheel, struct wheel_timer_t *timer)
+{
+    if (!timer_pending(timer))
+        return;
+
+    timer_wheel_unlink(wheel, timer);
+    wheel->count--;
+}
+
+/*
+ * timer_wheel_cascade() - Moves timers of slot down to lower levels
+ */
+
+static void timer_wheel_cascade(struct timer_wheel_t *wheel, unsigned int level, unsigned int slot)
+{
+    struct wheel_timer_t *timer;
+
+    wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+
+    while ((timer = wheel->slots[level][slot]) != NULL)
+    {
+        timer_wheel_unlink(wheel, timer);
+        timer_wheel_insert(wheel, timer);
+    }
+}
+
+/*
+ * timer_wheel_advance() - Runs timers expiring up to and including now
+ *
+ * Timers may be added and removed by the callbacks.
+ */
+
+void timer_wheel_advance(struct timer_wheel_t *wheel, uint64_t now)
+{
+    struct wheel_timer_t *timer;
+    unsigned int level, slot;
+    uint64_t later;
+
+    while (wheel->now <= now)
+    {
+        if (wheel->count == 0)
+        {
+            wheel->now = now + 1;
+            break;
+        }
+
+        slot = wheel->now & TIMER_SLOT_MASK;
+
+        // Entering a new round of a level moves down timers of next level
+        for (level = 1; (level < TIMER_LEVELS) && (((wheel->now >> LEVEL_SHIFT(level - 1)) & TIMER_SLOT_MASK) == 0); level++)
+            timer_wheel_cascade(wheel, level, (wheel->now >> LEVEL_SHIFT(level)) & TIMER_SLOT_MASK);
+
+        // Run expired timers, including those added for this tick
+        wheel->occupied[0] &= ~((uint64_t) 1 << slot);
+        while ((timer = wheel->slots[0][slot]) != NULL)
+        {
+            timer_wheel_unlink(wheel, timer);
+            wheel->count--;
+            timer->callback(timer->data);
+        }
+
+        // Skip to next occupied slot or end of round
+        later = wheel->occupied[0] >> slot >> 1;
+        if ((slot == TIMER_SLOT_MASK) || (later == 0))
+            wheel->now = (wheel->now | TIMER_SLOT_MASK) + 1;
+        else
+            wheel->now += __builtin_ctzll(later) + 1;
+
+        if (wheel->now > now + 1)
+            wheel->now = now + 1;
+    }
+}
+
+/*
+ * timer_wheel_next() - Returns tick by which the wheel must be advanced
+ *
+ * This is the earliest tick at which a timer may expire or has to be moved
+ * down to a lower level. Returns -1 if no timers are pending.
+ */
+
+int timer_wheel_next(struct timer_wheel_t *wheel, uint64_t *next)
+{
+    uint64_t round, tick, occupied, earliest = UINT64_MAX;
+    unsigned int level, slot, distance;
+
+    if (wheel->count == 0)
+        return -1;
+
+    for (level = 0; level < TIMER_LEVELS; level++)
+    {
+        if (wheel->occupied[level] == 0)
+            continue;
+
+        // First round of level starting at or after the next tick
+        round = (wheel->now + ((uint64_t) 1 << LEVEL_SHIFT(level)) - 1) >> LEVEL_SHIFT(level);
+
+        // Distance to first occupied slot from there
+        slot = round & TIMER_SLOT_MASK;
+        occupied = wheel->occupied[level];
+        if (slot != 0)
+            occupied = (occupied >> slot) | (occupied << (TIMER_SLOTS - slot));
+        distance = __builtin_ctzll(occupied);
+
+        tick = (round + distance) << LEVEL_SHIFT(level);
+        if (tick < earliest)
+            earliest = tick;
+    }
+
+    *next = earliest;
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "testgear/debug.h"
+#include "testgear/log.h"
+#include "testgear/event.h"
+#include "testgear/client.h"
+#include "testgear/message.h"
+#include "testgear/unix.h"
+
+static int server_socket;
+static struct event_handler_t server_handler;
+static struct message_io_t *unix_io;
+static struct sockaddr_un server_address;
+
+int unix_writev(struct client_t *client, const struct iovec *iov, int count)
+{
+    struct msghdr msg;
+    int size;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec *) iov;
+    msg.msg_iovlen = count;
+
+    size = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+
+    // Debug
+    if (size > 0)
+        debug_printf("Sending UNIX data (%4d bytes)\n", size);
+
+    return size;
+}
+
+int unix_read(struct client_t *client, void *buffer, int length)
+{
+    int size;
+
+    size = read(client->fd, buffer, length);
+
+    // Debug
+    if (size > 0)
+        debug_printf("Received UNIX data (%4d bytes)\n", size);
+
+    return size;
+}
+
+int unix_close(struct client_t *client)
+{
+    event_remove(client->loop, &client->handler);
+    close(client->fd);
+    client->connected = false;
+    return 0;
+}
+
+static void unix_client_event(int fd, unsigned int events, void *data)
+{
+    struct client_t *client = data;
+
+    if (events & EPOLLOUT)
+        handle_outgoing_messages(client);
+
+    if (client->connected && (events & EPOLLIN))
+        handle_incoming_message(client);
+    else if (client->connected && (events & (EPOLLHUP | EPOLLERR)))
+    {
+        debug_printf("Client connection (%s) hung up\n", client->address);
+        unix_close(client);
+    }
+
+    if (!client->connected)
+        client_destroy(client);
+}
+
+/*
+ * unix_peer_address() - Names local client by its process id
+ */
+
+void unix_peer_address(int fd, char *address, unsigned int size)
+{
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0)
+        snprintf(address, size, "pid %d", (int) credentials.pid);
+    else
+        snprintf(address, size, "local");
+}
+
+static void unix_accept_event(int fd, unsigned int events, void *data)
+{
+    struct event_loop_t *loop = data;
+    struct client_t *client;
+    int client_socket;
+
+    // Accept all pending connections
+    while (1)
+    {
+        client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                break;
+            if ((errno == EINTR) || (errno == ECONNABORTED))
+                continue;
+            log_error("accept() call failed (%s)", strerror(errno));
+            break;
+        }
+
+        client = client_create(loop, client_socket, unix_io, &unix_client_event);
+        if (client == NULL)
+        {
+            close(client_socket);
+            continue;
+        }
+
+        unix_peer_address(client_socket, client->address, sizeof(client->address));
+
+        debug_printf("Incoming connection from client (%s)\n", client->address);
+    }
+}
+
+static void unix_server_stop(void)
+{
+    unlink(server_address.sun_path);
+}
+
+/*
+ * unix_remove_stale_socket() - Removes socket left behind by earlier server
+ *
+ * Anything but a socket is left untouched so bind() reports the conflict.
+ */
+
+static void unix_remove_stale_socket(const char *path)
+{
+    struct stat status;
+
+    if ((lstat(path, &status) == 0) && S_ISSOCK(status.st_mode))
+        unlink(path);
+}
+
+/*
+ * unix_listen() - Creates listening UNIX domain socket
+ *
+ * The socket is removed again when the server exits.
+ */
+
+int unix_listen(const char *path)
+{
+    int fd;
+
+    if (strlen(path) >= sizeof(server_address.sun_path))
+    {
+        printf("Error: UNIX socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Create a reliable local stream socket
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("Error: socket() call failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Allow quick restart of server
+    unix_remove_stale_socket(path);
+
+    // Construct the server address structure
+    memset(&server_address, 0, sizeof(server_address));
+    server_address.sun_family = AF_UNIX;
+    strcpy(server_address.sun_path, path);
+
+    // Assign server address to socket
+    if (bind(fd, (struct sockaddr *) &server_address, sizeof(server_address)) < 0)
+    {
+        perror("Error: bind() call failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    atexit(&unix_server_stop);
+
+    // Allow many clients to be connected at the same time
+    if (listen(fd, SOMAXCONN) < 0)
+    {
+        perror("Error: listen() call failed");
+        close(fd);
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/*
+ * unix_server_start() - Starts UNIX domain socket server
+ *
+ * Same as the TCP server but listens on a local socket path, which avoids
+ * the overhead of the TCP/IP stack for clients running on the same host.
+ */
+
+void unix_server_start(struct event_loop_t *loop, const char *path, struct message_io_t *io)
+{
+    unix_io = io;
+
+    server_socket = unix_listen(path);
+
+    // Register server socket in event loop
+    server_handler.fd = server_socket;
+    server_handler.callback = &unix_accept_event;
+    server_handler.data = loop;
+    if (event_add(loop, &server_handler, EPOLLIN))
+    {
+        close(server_socket);
+        exit(EXIT_FAILURE);
+    }
+
+    debug_printf("Listening for incoming client connections on %s...\n", path);
+}
@@ -0,0 +1,389 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "testgear/debug.h"
+#include "testgear/log.h"
+#include "testgear/uring.h"
+
+/*
+ * === io_uring ===
+ *
+ * Minimal io_uring interface on top of the raw system calls. Entries are
+ * prepared with uring_get_sqe() and submitted all together by the next
+ * uring_submit_and_wait(), which also waits for completions in the same
+ * system call. Completions are dispatched to the uring_op_t given when the
+ * entry was prepared.
+ *
+ * A ring of provided buffers is registered for multishot receive, so the
+ * kernel picks a buffer once data arrives instead of one buffer being
+ * reserved per connection.
+ */
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags, void *arg, size_t size)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size);
+}
+
+static int io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * uring_supported() - Checks kernel supports all operations used
+ *
+ * Multishot receive (Linux 6.0) can not be probed for, so the kernel
+ * version is checked as well.
+ */
+
+static int uring_supported(struct uring_t *ring)
+{
+    static const unsigned char ops[] =
+    {
+        IORING_OP_ACCEPT,
+        IORING_OP_RECV,
+        IORING_OP_SENDMSG,
+        IORING_OP_POLL_ADD,
+        IORING_OP_ASYNC_CANCEL,
+    };
+    struct io_uring_probe *probe;
+    struct utsname name;
+    int major = 0, minor = 0;
+    unsigned int i;
+    int status = 0;
+
+    if ((uname(&name) < 0) ||
+        (sscanf(name.release, "%d.%d", &major, &minor) != 2) ||
+        (major < 6))
+        return -1;
+
+    probe = calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+    if (probe == NULL)
+        return -1;
+
+    if (io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        status = -1;
+
+    for (i=0; (status == 0) && (i<sizeof(ops)); i++)
+    {
+        if ((ops[i] > probe->last_op) || !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            status = -1;
+    }
+
+    free(probe);
+
+    return status;
+}
+
+static int uring_register_buffers(struct uring_t *ring)
+{
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+
+    ring->buf_ring_size = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+    {
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buffers = malloc(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (ring->buffers == NULL)
+        return -1;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) ring->buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (i=0; i<URING_BUFFER_COUNT; i++)
+        uring_recycle_buffer(ring, i << IORING_CQE_BUFFER_SHIFT);
+
+    return 0;
+}
+
+static void uring_destroy(struct uring_t *ring)
+{
+    if (ring->buf_ring != NULL)
+        munmap(ring->buf_ring, ring->buf_ring_size);
+    free(ring->buffers);
+    if (ring->sqes != NULL)
+        munmap(ring->sqes, ring->sqes_size);
+    if (ring->ring != NULL)
+        munmap(ring->ring, ring->ring_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring);
+}
+
+/*
+ * uring_create() - Sets up io_uring
+ *
+ * Returns NULL if io_uring is not available, for example because the
+ * kernel is too old or io_uring has been disabled.
+ */
+
+struct uring_t * uring_create(void)
+{
+    struct io_uring_params params;
+    struct uring_t *ring;
+    char *sq, *cq;
+    unsigned int i;
+
+    ring = calloc(1, sizeof(struct uring_t));
+    if (ring == NULL)
+        return NULL;
+
+    // Completions are only run by the event loop thread when it waits
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = 4 * URING_ENTRIES;
+    ring->fd = io_uring_setup(URING_ENTRIES, &params);
+    if ((ring->fd < 0) && (errno == EINVAL))
+    {
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = 4 * URING_ENTRIES;
+        ring->fd = io_uring_setup(URING_ENTRIES, &params);
+    }
+    if (ring->fd < 0)
+    {
+        debug_printf("io_uring_setup() failed (%s)\n", strerror(errno));
+        free(ring);
+        return NULL;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_EXT_ARG) ||
+        (uring_supported(ring) != 0))
+    {
+        debug_printf("io_uring lacks required features\n");
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    // Submission and completion queue rings share one mapping
+    ring->ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    if (params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe) > ring->ring_size)
+        ring->ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring == MAP_FAILED)
+    {
+        ring->ring = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    sq = ring->ring;
+    ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+    ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int *) (sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+
+    // Submission entries are always used in order
+    for (i=0; i<params.sq_entries; i++)
+        ((unsigned int *) (sq + params.sq_off.array))[i] = i;
+
+    cq = ring->ring;
+    ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    if (uring_register_buffers(ring) != 0)
+    {
+        debug_printf("Registering io_uring buffers failed (%s)\n", strerror(errno));
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/*
+ * uring_get_sqe() - Returns cleared submission entry for operation
+ *
+ * Submits prepared entries first if the queue is full. Returns NULL if no
+ * entry is available.
+ */
+
+struct io_uring_sqe * uring_get_sqe(struct uring_t *ring, struct uring_op_t *op)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        uring_submit_and_wait(ring, 0, -1);
+        if (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+        {
+            log_error("io_uring submission queue full");
+            return NULL;
+        }
+    }
+
+    sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->user_data = (unsigned long) op;
+
+    ring->sq_local_tail++;
+    ring->to_submit++;
+
+    return sqe;
+}
+
+/*
+ * uring_submit_and_wait() - Submits prepared entries and waits
+ *
+ * Waits for at least wait completions, but no longer than timeout
+ * milliseconds (-1 waits forever). Returns -1 on failure.
+ */
+
+int uring_submit_and_wait(struct uring_t *ring, unsigned int wait, int timeout)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int flags = 0;
+    int submitted;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait > 0)
+    {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        if (timeout >= 0)
+        {
+            ts.tv_sec = timeout / 1000;
+            ts.tv_nsec = (timeout % 1000) * 1000000;
+            arg.ts = (unsigned long) &ts;
+        }
+    }
+
+    submitted = io_uring_enter(ring->fd, ring->to_submit, wait, flags,
+                               (flags & IORING_ENTER_EXT_ARG) ? &arg : NULL,
+                               (flags & IORING_ENTER_EXT_ARG) ? sizeof(arg) : 0);
+    if (submitted < 0)
+    {
+        if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY) || (errno == ETIME))
+            return 0;
+        log_error("io_uring_enter() failed (%s)", strerror(errno));
+        return -1;
+    }
+
+    ring->to_submit -= submitted;
+
+    return 0;
+}
+
+/*
+ * uring_reap() - Dispatches available completions
+ */
+
+void uring_reap(struct uring_t *ring)
+{
+    struct io_uring_cqe *cqe;
+    struct uring_op_t *op;
+    unsigned int head = *ring->cq_head;
+    int result;
+    unsigned int flags;
+
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        op = (struct uring_op_t *) (unsigned long) cqe->user_data;
+        result = cqe->res;
+        flags = cqe->flags;
+
+        // Free entry before the completion submits more work
+        head++;
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (op != NULL)
+            op->complete(op, result, flags);
+    }
+}
+
+/*
+ * uring_buffer() - Returns provided buffer a completion was received into
+ */
+
+void * uring_buffer(struct uring_t *ring, unsigned int flags)
+{
+    return &ring->buffers[(flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUFFER_SIZE];
+}
+
+/*
+ * uring_recycle_buffer() - Hands provided buffer back to the kernel
+ */
+
+void uring_recycle_buffer(struct uring_t *ring, unsigned int flags)
+{
+    unsigned int id = flags >> IORING_CQE_BUFFER_SHIFT;
+    struct io_uring_buf *buffer;
+
+    buffer = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFER_COUNT - 1)];
+    buffer->addr = (unsigned long) &ring->buffers[id * URING_BUFFER_SIZE];
+    buffer->len = URING_BUFFER_SIZE;
+    buffer->bid = id;
+    ring->buf_tail++;
+
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
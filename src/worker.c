@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2012-2014, Martin Lund
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holders nor contributors may be
+ *    used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "testgear/worker.h"
+#include "testgear/hash.h"
+#include "testgear/debug.h"
+#include "testgear/log.h"
+
+/*
+ * === Worker thread pool ===
+ *
+ * Requests are executed by a pool of worker threads. Jobs are submitted to
+ * a named strand (the plugin name). Jobs of the same strand are executed
+ * one at a time in submission order, because a plugin keeps its state in
+ * static globals, while jobs of different strands run in parallel.
+ *
+ * A strand with pending jobs is put on the run queue. A worker takes the
+ * first strand of the run queue, executes one job and puts the strand back
+ * at the end of the queue if it has more jobs. This way a busy plugin does
+ * not starve the others.
+ *
+ * Jobs submitted without a strand name are not ordered at all.
+ *
+ * A strand exists only while it has jobs, so names of plugins that come and
+ * go do not accumulate.
+ */
+
+#define STRAND_TABLE_SIZE 256
+#define STRAND_NAME_MAX 256
+
+struct strand_t
+{
+    char name[STRAND_NAME_MAX];
+    struct job_t *first;
+    struct job_t *last;
+    bool scheduled;
+    struct strand_t *next_run;
+    struct strand_t *next;
+};
+
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+
+static struct strand_t *strand_table[STRAND_TABLE_SIZE];
+
+static struct strand_t *run_first = NULL;
+static struct strand_t *run_last = NULL;
+
+static struct job_t *unordered_first = NULL;
+static struct job_t *unordered_last = NULL;
+
+/*
+ * find_strand() - Finds strand by name, creating it if needed
+ *
+ * Must be called with worker lock held.
+ */
+
+static struct strand_t * find_strand(const char *name)
+{
+    unsigned int bucket = hash_string(name) % STRAND_TABLE_SIZE;
+    struct strand_t *strand;
+
+    for (strand = strand_table[bucket]; strand != NULL; strand = strand->next)
+    {
+        if (strcmp(strand->name, name) == 0)
+            return strand;
+    }
+
+    strand = calloc(1, sizeof(struct strand_t));
+    if (strand == NULL)
+        return NULL;
+
+    strncpy(strand->name, name, STRAND_NAME_MAX - 1);
+    strand->next = strand_table[bucket];
+    strand_table[bucket] = strand;
+
+    return strand;
+}
+
+/*
+ * release_strand() - Removes strand which has run out of jobs
+ *
+ * Must be called with worker lock held.
+ */
+
+static void release_strand(struct strand_t *strand)
+{
+    struct strand_t **link = &strand_table[hash_string(strand->name) % STRAND_TABLE_SIZE];
+
+    while (*link != strand)
+        link = &(*link)->next;
+    *link = strand->next;
+
+    free(strand);
+}
+
+static void schedule_strand(struct strand_t *strand)
+{
+    strand->scheduled = true;
+    strand->next_run = NULL;
+
+    if (run_last != NULL)
+        run_last->next_run = strand;
+    else
+        run_first = strand;
+    run_last = strand;
+}
+
+static void * worker_thread(void *arg)
+{
+    struct strand_t *strand;
+    struct job_t *job;
+
+    pthread_mutex_lock(&worker_lock);
+
+    while (1)
+    {
+        if (run_first != NULL)
+        {
+            // Take first job of first runnable strand
+            strand = run_first;
+            run_first = strand->next_run;
+            if (run_first == NULL)
+                run_last = NULL;
+
+            job = strand->first;
+            strand->first = job->next;
+            if (strand->first == NULL)
+                strand->last = NULL;
+
+            pthread_mutex_unlock(&worker_lock);
+            job->function(job);
+            pthread_mutex_lock(&worker_lock);
+
+            // Reschedule strand if more jobs are pending
+            if (strand->first != NULL)
+                schedule_strand(strand);
+            else
+                release_strand(strand);
+        }
+        else if (unordered_first != NULL)
+        {
+            job = unordered_first;
+            unordered_first = job->next;
+            if (unordered_first == NULL)
+                unordered_last = NULL;
+
+            pthread_mutex_unlock(&worker_lock);
+            job->function(job);
+            pthread_mutex_lock(&worker_lock);
+        }
+        else
+            pthread_cond_wait(&worker_cond, &worker_lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * worker_submit() - Submits job for execution on named strand
+ *
+ * Returns -1 if the strand can not be created, in which case the job is not
+ * submitted.
+ */
+
+int worker_submit(const char *strand_name, struct job_t *job)
+{
+    struct strand_t *strand = NULL;
+
+    job->next = NULL;
+
+    pthread_mutex_lock(&worker_lock);
+
+    if (strand_name != NULL)
+    {
+        strand = find_strand(strand_name);
+        if (strand == NULL)
+        {
+            pthread_mutex_unlock(&worker_lock);
+            log_error("Failed to create strand %s", strand_name);
+            return -1;
+        }
+    }
+
+    if (strand != NULL)
+    {
+        if (strand->last != NULL)
+            strand->last->next = job;
+        else
+            strand->first = job;
+        strand->last = job;
+
+        // Strands being executed are rescheduled by their worker
+        if (!strand->scheduled)
+            schedule_strand(strand);
+    }
+    else
+    {
+        if (unordered_last != NULL)
+            unordered_last->next = job;
+        else
+            unordered_first = job;
+        unordered_last = job;
+    }
+
+    pthread_cond_signal(&worker_cond);
+    pthread_mutex_unlock(&worker_lock);
+
+    return 0;
+}
+
+/*
+ * worker_start() - Starts worker threads
+ *
+ * A count of 0 starts one worker per online CPU.
+ */
+
+void worker_start(int count)
+{
+    pthread_t thread;
+    int i;
+
+    if (count <= 0)
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count <= 0)
+        count = 1;
+
+    for (i=0; i<count; i++)
+    {
+        if (pthread_create(&thread, NULL, &worker_thread, NULL) != 0)
+        {
+            perror("Error: pthread_create() call failed");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+
+    log_info("Started %d worker threads", count);
+}